@@ -0,0 +1,131 @@
+/*
+
+  This file is part of gs_usb_leonardo project --
+  gs_usb compatible SocketCAN firmware for Arduino Leonardo /
+  MCP2515 based USB device, see
+
+          https://github.com/woj76/gs_usb_leonardo
+
+  For information about how this code came to be and what / whose
+  work it is based on, please see the LICENSE.md file in the project
+  root directory.
+
+  Copyright (C) 2019 Wojciech Mostowski <wojciech.mostowski@gmail.com>
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the License, or any later
+  version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  The copy of the license can be found in the licenses directory of
+  the project, or on GNU/FSF website at https://www.gnu.org/licenses/.
+
+*/
+
+/* Bit rate detection with the MCP in the listen only mode, in which it
+   neither acknowledges frames nor sends error frames, so it does not
+   disturb a bus of an unknown rate. The rates of autobaud_rates are tried
+   in turn: the MCP is reset and set up for the rate, which is taken once
+   AUTOBAUD_FRAMES frames come in without an error between them, and left at
+   the first message error (MERRF) or after AUTOBAUD_WINDOW_MS without a
+   frame. With traffic on the bus a wrong rate fails within the first frame,
+   the table is gone through again until AUTOBAUD_TIME_OUT_MS. Runs from main
+   while the interface is down, a start from the host ends it. */
+
+#include <avr/pgmspace.h>
+
+#include "autobaud.h"
+#include "mcp.h"
+#include "mcp_gs.h"
+#include "timer.h"
+#include "bool.h"
+
+#define AUTOBAUD_FRAMES		2
+#define AUTOBAUD_WINDOW_MS	25
+#define AUTOBAUD_TIME_OUT_MS	1000
+
+const uint32_t autobaud_rates[] PROGMEM = {
+	1000000, 500000, 250000, 125000, 100000, 83333, 50000, 800000, 33333, 20000
+};
+
+#define AUTOBAUD_N_RATES	(sizeof(autobaud_rates) / sizeof(uint32_t))
+
+/* The bit timing for a rate: 16 time quanta sampled at 87.5%, or when the
+   clock is too slow for that 10 at 80% or 8 at 75%, with the rate within
+   0.5%. */
+static uint8_t autobaud_timing(uint32_t rate, gs_device_bittiming* bt) {
+	static const uint8_t quanta[] PROGMEM = { 16, 10, 8 };
+	for(uint8_t i=0; i<sizeof(quanta); i++) {
+		uint8_t tq = pgm_read_byte(&quanta[i]);
+		uint32_t bit = rate * tq;
+		uint32_t brp = (MCP_FCLK_CAN + bit / 2) / bit;
+		uint32_t fclk = brp * bit;
+		uint32_t error = fclk > MCP_FCLK_CAN ? fclk - MCP_FCLK_CAN : MCP_FCLK_CAN - fclk;
+		if(brp && brp <= MCP_BRP_MAX && error <= MCP_FCLK_CAN / 200) {
+			bt->brp = brp;
+			bt->phase_seg2 = 2;
+			bt->phase_seg1 = tq == 16 ? 7 : tq / 2 - 1;
+			bt->prop_seg = tq - 1 - bt->phase_seg1 - bt->phase_seg2;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+volatile gs_device_autobaud autobaud;
+
+/* Listens at one rate, returns whether it is the one */
+static uint8_t autobaud_try(gs_device_bittiming* bt) {
+	gs_bittiming_to_mcp(bt, FALSE, mcp_cnfs);
+	mcp_set_mode_listen();
+	if(mcp_begin(FALSE) != OK) {
+		return FALSE;
+	}
+	uint8_t frames = 0;
+	uint32_t t = timer_now();
+	while(!gs_can_mode && timer_now() - t < AUTOBAUD_WINDOW_MS * 1000UL) {
+		uint8_t f = mcp_rx_probe();
+		if(f & MCP_MERRF) {
+			return FALSE;
+		}
+		frames += (f & MCP_RX0IF) + ((f & MCP_RX1IF) >> 1);
+		if(frames >= AUTOBAUD_FRAMES) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+void autobaud_run() {
+	// Everything let through, the filters are set up again with the next start
+	gs_device_filter open = { .mask = { 0, 0 } };
+	gs_filter_to_mcp(&open, mcp_rxf, mcp_rxm);
+	gs_device_bittiming bt = { .sjw = 1 };
+	uint32_t start = timer_now();
+	while(autobaud.state == GS_AUTOBAUD_RUNNING) {
+		for(uint8_t i=0; i<AUTOBAUD_N_RATES; i++) {
+			if(!autobaud_timing(pgm_read_dword(&autobaud_rates[i]), &bt)) {
+				continue;
+			}
+			if(autobaud_try(&bt)) {
+				autobaud.bittiming = bt;
+				autobaud.bitrate = MCP_FCLK_CAN / (bt.brp * (1 + bt.prop_seg + bt.phase_seg1 + bt.phase_seg2));
+				autobaud.state = GS_AUTOBAUD_FOUND;
+				break;
+			}
+			if(gs_can_mode) {
+				autobaud.state = GS_AUTOBAUD_IDLE;
+				break;
+			}
+		}
+		if(autobaud.state == GS_AUTOBAUD_RUNNING && timer_now() - start >= AUTOBAUD_TIME_OUT_MS * 1000UL) {
+			autobaud.state = GS_AUTOBAUD_FAILED;
+		}
+	}
+	mcp_set_mode_normal();
+}
@@ -0,0 +1,132 @@
+/*
+
+  This file is part of gs_usb_leonardo project --
+  gs_usb compatible SocketCAN firmware for Arduino Leonardo /
+  MCP2515 based USB device, see
+
+          https://github.com/woj76/gs_usb_leonardo
+
+  For information about how this code came to be and what / whose
+  work it is based on, please see the LICENSE.md file in the project
+  root directory.
+
+  Copyright (C) 2019 Wojciech Mostowski <wojciech.mostowski@gmail.com>
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the License, or any later
+  version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  The copy of the license can be found in the licenses directory of
+  the project, or on GNU/FSF website at https://www.gnu.org/licenses/.
+
+*/
+
+/* Bus load and per id frame counts taken in the MCP interrupt, see
+   gs_device_bus_stats. The table is an open addressing hash set probed at
+   most BUSSTAT_PROBES slots from the hash of the id, so a frame costs a
+   bounded number of cycles however many ids the bus carries, the ones that
+   find no slot are counted as untracked. The load is only worked out when
+   the host asks for it. */
+
+#include "busstat.h"
+#include "timer.h"
+#include "mcp.h"
+#include "can.h"
+#include "bool.h"
+
+#define BUSSTAT_MASK		(GS_BUS_STATS_IDS - 1)
+#define BUSSTAT_PROBES		4
+
+// The load is worked out in whole time quanta per microsecond
+#define BUSSTAT_FCLK_MHZ	(MCP_FCLK_CAN / 1000000)
+#if MCP_FCLK_CAN % 1000000
+#error "The bus load needs an MCP_CLOCK of whole 2MHz steps"
+#endif
+
+volatile uint8_t busstat_mode = GS_BUS_STATS_OFF;
+volatile gs_device_bus_stats busstat;
+
+uint32_t busstat_start;
+
+void busstat_clear() {
+	uint8_t* p = (uint8_t*)&busstat;
+	for(uint8_t i=0; i<sizeof(busstat); i++) {
+		p[i] = 0;
+	}
+	busstat.mode = busstat_mode;
+	busstat_start = timer_now();
+}
+
+void busstat_set(uint8_t mode) {
+	busstat_mode = mode;
+	busstat_clear();
+}
+
+/* Fills in the interval and the load against the requested bit timing,
+   called from the USB interrupt right before the statistics are sent. */
+void busstat_snapshot() {
+	busstat.interval_us = timer_now() - busstat_start;
+	// Bits the interval could carry in hundreds, a bit takes brp * tq
+	// periods of fclk_can
+	uint32_t tq = 1 + gs_requested_bittiming.prop_seg + gs_requested_bittiming.phase_seg1 + gs_requested_bittiming.phase_seg2;
+	uint32_t bit = gs_requested_bittiming.brp * tq;
+	uint32_t c = bit ? busstat.interval_us / bit * BUSSTAT_FCLK_MHZ / 100 : 0;
+	// In 0.01%, coarser for the long intervals that would overflow
+	uint32_t bits = busstat.bits;
+	uint32_t load = 0;
+	if(bits < 0x1000000) {
+		load = c ? bits * 100 / c : 0;
+	} else if(c >= 100) {
+		load = bits / (c / 100);
+	}
+	busstat.load = load > 10000 ? 10000 : load;
+}
+
+static void busstat_count(uint32_t can_id, uint8_t dlc) {
+	// Stuffing can hit every fourth bit from the start of frame to the CRC,
+	// 34 bits plus the data for a standard frame, 54 for an extended one;
+	// the other 13 are the CRC delimiter, ACK, end of frame and interframe
+	uint8_t n = (can_id & CAN_RTR_FLAG) ? 0 : (dlc > 8 ? 64 : dlc << 3);
+	uint8_t g = ((can_id & CAN_EFF_FLAG) ? 54 : 34) + n;
+	busstat.bits += g + 13 + ((g - 1) >> 2);
+	busstat.frames++;
+	can_id &= CAN_EFF_FLAG | CAN_EFF_MASK;
+	uint8_t* b = (uint8_t*)&can_id;
+	uint8_t h = (b[0] ^ b[1] ^ b[2] ^ b[3]) & BUSSTAT_MASK;
+	for(uint8_t i=0; i<BUSSTAT_PROBES; i++) {
+		if(!busstat.count[h]) {
+			busstat.can_id[h] = can_id;
+			busstat.count[h] = 1;
+			return;
+		}
+		if(busstat.can_id[h] == can_id) {
+			if(busstat.count[h] != 0xFFFF) {
+				busstat.count[h]++;
+			}
+			return;
+		}
+		h = (h + 1) & BUSSTAT_MASK;
+	}
+	busstat.untracked++;
+}
+
+/* Counts a received frame, returns whether it is to go to the host. */
+uint8_t busstat_rx(volatile gs_host_frame* hf) {
+	if(!busstat_mode) {
+		return TRUE;
+	}
+	busstat_count(hf->can_id, hf->can_dlc);
+	return busstat_mode != GS_BUS_STATS_ONLY;
+}
+
+void busstat_tx(volatile gs_host_frame* hf) {
+	if(busstat_mode) {
+		busstat_count(hf->can_id, hf->can_dlc);
+	}
+}
@@ -40,6 +40,8 @@
 #define CAN_ERR_CTRL			0x00000004
 #define CAN_ERR_ACK			0x00000020
 #define CAN_ERR_BUSOFF			0x00000040
+#define CAN_ERR_RESTARTED		0x00000100
+#define CAN_ERR_CNT			0x00000200	// TX / RX error counters in data[6] / data[7]
 #define CAN_ERR_CRTL_RX_WARNING		0x04
 #define CAN_ERR_CRTL_TX_WARNING		0x08
 #define CAN_ERR_CRTL_RX_PASSIVE		0x10
@@ -0,0 +1,193 @@
+/*
+
+  This file is part of gs_usb_leonardo project --
+  gs_usb compatible SocketCAN firmware for Arduino Leonardo /
+  MCP2515 based USB device, see
+
+          https://github.com/woj76/gs_usb_leonardo
+
+  For information about how this code came to be and what / whose
+  work it is based on, please see the LICENSE.md file in the project
+  root directory.
+
+  Copyright (C) 2019 Wojciech Mostowski <wojciech.mostowski@gmail.com>
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the License, or any later
+  version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  The copy of the license can be found in the licenses directory of
+  the project, or on GNU/FSF website at https://www.gnu.org/licenses/.
+
+*/
+
+/* Cyclic transmissions done by the device itself, see gs_device_cyclic. The
+   frames are kept ready in the MCP transmit buffer format, and the active
+   slots in the order of their deadlines (in timer_now microseconds). The
+   Timer1 compare B interrupt is pointed at the earliest deadline, so a frame
+   goes to the MCP within microseconds of it when a transmit buffer is free,
+   and otherwise (cyclic_pending) with the next buffer the MCP interrupt
+   frees, ahead of the frames from the host. Periods are kept from deadline
+   to deadline, the ones missed altogether (bus off, a stopped device) are
+   skipped, not made up for. The table stays across the mode changes, the
+   deadlines start over with every cyclic_start. */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "cyclic.h"
+#include "mcp_gs.h"
+#include "timer.h"
+#include "bool.h"
+
+typedef struct {
+	uint8_t buf[13];	// Ready for the MCP transmit buffer
+	uint16_t period_ms;	// 0 for a free slot
+	uint16_t count;		// Frames left, 0 for no limit
+	uint32_t deadline;
+} cyclic_entry;
+
+cyclic_entry cyclic_table[GS_CYCLIC_MAX_SLOTS];
+uint8_t cyclic_order[GS_CYCLIC_MAX_SLOTS];	// Active slots, earliest deadline first
+uint8_t cyclic_active;
+uint8_t cyclic_running;
+volatile uint8_t cyclic_pending;
+
+void cyclic_remove(uint8_t slot) {
+	uint8_t i = 0;
+	while(i < cyclic_active && cyclic_order[i] != slot) {
+		i++;
+	}
+	if(i == cyclic_active) {
+		return;
+	}
+	cyclic_active--;
+	for(; i<cyclic_active; i++) {
+		cyclic_order[i] = cyclic_order[i + 1];
+	}
+}
+
+void cyclic_insert(uint8_t slot) {
+	uint32_t d = cyclic_table[slot].deadline;
+	uint8_t i = cyclic_active++;
+	while(i && (int32_t)(cyclic_table[cyclic_order[i - 1]].deadline - d) > 0) {
+		cyclic_order[i] = cyclic_order[i - 1];
+		i--;
+	}
+	cyclic_order[i] = slot;
+}
+
+void cyclic_clear() {
+	register uint8_t _sreg = SREG;
+	cli();
+	for(uint8_t i=0; i<GS_CYCLIC_MAX_SLOTS; i++) {
+		cyclic_table[i].period_ms = 0;
+	}
+	cyclic_active = 0;
+	cyclic_pending = FALSE;
+	TIMSK1 &= ~(1 << OCIE1B);
+	SREG = _sreg;
+}
+
+/* Sets up or (with a period of 0) frees a slot, a running slot starts over
+   with a frame right away. Returns FALSE for values out of range. */
+uint8_t cyclic_set(uint8_t slot, volatile gs_device_cyclic* cyclic) {
+	if(slot >= GS_CYCLIC_MAX_SLOTS || cyclic->period_ms > 0xFFFF || cyclic->count > 0xFFFF || cyclic->can_dlc > 8) {
+		return FALSE;
+	}
+	gs_host_frame hf;
+	hf.can_id = cyclic->can_id;
+	hf.can_dlc = cyclic->can_dlc;
+	for(uint8_t i=0; i<8; i++) {
+		hf.data[i] = cyclic->data[i];
+	}
+	register uint8_t _sreg = SREG;
+	cli();
+	cyclic_entry* e = &cyclic_table[slot];
+	cyclic_remove(slot);
+	gs_host_frame_to_mcp(&hf, e->buf);
+	e->period_ms = cyclic->period_ms;
+	e->count = cyclic->count;
+	if(cyclic_running && e->period_ms) {
+		e->deadline = timer_now();
+		cyclic_insert(slot);
+	}
+	cyclic_arm();
+	SREG = _sreg;
+	return TRUE;
+}
+
+void cyclic_start() {
+	register uint8_t _sreg = SREG;
+	cli();
+	uint32_t now = timer_now();
+	cyclic_active = 0;
+	for(uint8_t i=0; i<GS_CYCLIC_MAX_SLOTS; i++) {
+		if(cyclic_table[i].period_ms) {
+			cyclic_table[i].deadline = now;
+			cyclic_insert(i);
+		}
+	}
+	cyclic_running = TRUE;
+	cyclic_arm();
+	SREG = _sreg;
+}
+
+void cyclic_stop() {
+	register uint8_t _sreg = SREG;
+	cli();
+	cyclic_running = FALSE;
+	cyclic_pending = FALSE;
+	TIMSK1 &= ~(1 << OCIE1B);
+	SREG = _sreg;
+}
+
+uint8_t cyclic_due() {
+	return cyclic_running && cyclic_active && (int32_t)(cyclic_table[cyclic_order[0]].deadline - timer_now()) <= 0;
+}
+
+/* Points the compare B interrupt at the earliest deadline (it also fires
+   every 32ms on the way to one further off). Needs to run with interrupts
+   disabled, like the rest below. */
+void cyclic_arm() {
+	if(!cyclic_running || !cyclic_active) {
+		TIMSK1 &= ~(1 << OCIE1B);
+		return;
+	}
+	timer_wake(TIMER_WAKE_B, cyclic_table[cyclic_order[0]].deadline);
+}
+
+/* A frame is due, but there is no transmit buffer for it */
+void cyclic_wait() {
+	cyclic_pending = TRUE;
+	TIMSK1 &= ~(1 << OCIE1B);
+}
+
+/* Returns the earliest frame in the MCP transmit buffer format, and moves
+   the slot on to its next deadline. The frame stays put until the slot is
+   set up again, so it is loaded from where it is. */
+uint8_t* cyclic_take() {
+	uint8_t slot = cyclic_order[0];
+	cyclic_entry* e = &cyclic_table[slot];
+	cyclic_remove(slot);
+	if(e->count && !--e->count) {
+		e->period_ms = 0;
+	} else {
+		uint32_t period = (uint32_t)e->period_ms * 1000;
+		uint32_t now = timer_now();
+		e->deadline += period;
+		if((int32_t)(e->deadline - now) <= 0) {
+			e->deadline = now + period;
+		}
+		cyclic_insert(slot);
+	}
+	cyclic_pending = FALSE;
+	cyclic_arm();
+	return e->buf;
+}
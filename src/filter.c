@@ -0,0 +1,103 @@
+/*
+
+  This file is part of gs_usb_leonardo project --
+  gs_usb compatible SocketCAN firmware for Arduino Leonardo /
+  MCP2515 based USB device, see
+
+          https://github.com/woj76/gs_usb_leonardo
+
+  For information about how this code came to be and what / whose
+  work it is based on, please see the LICENSE.md file in the project
+  root directory.
+
+  Copyright (C) 2019 Wojciech Mostowski <wojciech.mostowski@gmail.com>
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the License, or any later
+  version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  The copy of the license can be found in the licenses directory of
+  the project, or on GNU/FSF website at https://www.gnu.org/licenses/.
+
+*/
+
+/* Software CAN id filter applied to the received frames, for when the six
+   MCP2515 filters are not enough. 11 bit ids are kept in a 2048 bit bitmap,
+   29 bit ids in a sorted table. The lookup runs in the MCP interrupt: an 11
+   bit id takes one bitmap lookup, a 29 bit one a binary search of at most 6
+   compares. Any FILTER_EXT_SIZE 29 bit ids fit, unlike with a hash set with
+   a bounded number of probes, which already refuses some sets of a dozen
+   diagnostic ids (0x18DAxxF1 / 0x18DAF1xx, the two differ only in the byte
+   order). */
+
+#include "filter.h"
+#include "can.h"
+#include "bool.h"
+
+volatile uint8_t filter_enabled = FALSE;
+
+uint8_t filter_std[(CAN_SFF_MASK + 1) / 8];
+uint32_t filter_ext[FILTER_EXT_SIZE];	// Ascending, ids are stored with CAN_EFF_FLAG
+uint8_t filter_ext_n;
+
+void filter_clear() {
+	filter_enabled = FALSE;
+	for(uint16_t i=0; i<sizeof(filter_std); i++) {
+		filter_std[i] = 0;
+	}
+	filter_ext_n = 0;
+}
+
+/* The position of the first id in the table that is not below can_id */
+uint8_t filter_ext_find(uint32_t can_id) {
+	uint8_t lo = 0;
+	uint8_t hi = filter_ext_n;
+	while(lo < hi) {
+		uint8_t mid = (lo + hi) >> 1;
+		if(filter_ext[mid] < can_id) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+uint8_t filter_add(uint32_t can_id) {
+	if(can_id & CAN_EFF_FLAG) {
+		can_id &= (CAN_EFF_FLAG | CAN_EFF_MASK);
+		uint8_t i = filter_ext_find(can_id);
+		if(i == filter_ext_n || filter_ext[i] != can_id) {
+			if(filter_ext_n == FILTER_EXT_SIZE) {
+				return FALSE;
+			}
+			for(uint8_t j=filter_ext_n; j>i; j--) {
+				filter_ext[j] = filter_ext[j - 1];
+			}
+			filter_ext[i] = can_id;
+			filter_ext_n++;
+		}
+		filter_enabled = TRUE;
+		return TRUE;
+	}
+	can_id &= CAN_SFF_MASK;
+	filter_std[can_id >> 3] |= (1 << (can_id & 0x07));
+	filter_enabled = TRUE;
+	return TRUE;
+}
+
+uint8_t filter_match(uint32_t can_id) {
+	if(can_id & CAN_EFF_FLAG) {
+		can_id &= (CAN_EFF_FLAG | CAN_EFF_MASK);
+		uint8_t i = filter_ext_find(can_id);
+		return i < filter_ext_n && filter_ext[i] == can_id;
+	}
+	uint16_t id = (uint16_t)can_id & CAN_SFF_MASK;
+	return filter_std[id >> 3] & (1 << (id & 0x07));
+}
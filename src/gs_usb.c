@@ -27,11 +27,23 @@
 
 */
 
+#include <avr/io.h>
+#include <avr/interrupt.h>
 #include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include <avr/boot.h>
 
 #include "bool.h"
 #include "usb.h"
 #include "gs_usb.h"
+#include "timer.h"
+#include "filter.h"
+#include "cyclic.h"
+#include "isotp.h"
+#include "busstat.h"
+#include "autobaud.h"
+#include "mcp.h"
+#include "mcp_gs.h"
 #include "leds.h"
 
 /* This file provides the GS specific USB functionality */
@@ -39,7 +51,40 @@
 const uint8_t STRING_LANGUAGE[] PROGMEM = { 0x04, 0x03, 0x09, 0x04};
 const uint8_t STRING_PRODUCT[] PROGMEM = "Arduino Leonardo";
 const uint8_t STRING_MANUFACTURER[] PROGMEM = "Arduino LLC";
-const uint8_t STRING_SERIAL[] PROGMEM = "USB-CAN";
+
+/* The serial number string is made up in RAM by serial_load: the user ID
+   from the EEPROM in hex when one was set with GS_USB_BREQ_SET_USER_ID,
+   otherwise the serial number bytes of the signature row in hex, which differ
+   from chip to chip. Either way two adapters on one host can be told apart (and bound to
+   their interfaces by udev) without opening them. */
+#define SIGNATURE_SERIAL	0x0E
+#define SIGNATURE_SERIAL_LEN	10
+
+// A state byte (USER_ID_VALID once one is set) and then the ID
+#define EEPROM_USER_ID		((uint8_t*)0)
+#define USER_ID_VALID		0x5A
+
+/* The set up the device starts with after a reset (see
+   GS_USB_BREQ_BOOT_CONFIG), a state byte and then boot_config. Until the
+   host starts the interface itself, or asks for a reset, the device runs on
+   it with gs_boot_run set; a start with the same set up then simply takes
+   over, frames received before it included. */
+#define EEPROM_BOOT		((uint8_t*)32)
+#define BOOT_OFF		0xFF
+#define BOOT_ON			0x01	// Nothing kept yet
+#define BOOT_VALID		0x5A
+
+typedef struct {
+	gs_device_bittiming bittiming;
+	uint8_t flags;
+	gs_device_filter filter;
+} boot_config;
+
+const uint8_t HEX_DIGITS[] PROGMEM = "0123456789ABCDEF";
+
+uint8_t serial[2*SIGNATURE_SERIAL_LEN];
+uint8_t serial_len;
+uint32_t user_id;
 
 /* USB device identifier with vendor and product id set so that the Linux
    gs_usb driver can recognise it. */
@@ -106,14 +151,18 @@ const gs_device_bt_const GS_DEVICE_BT_CONST PROGMEM = {
 		GS_CAN_FEATURE_LISTEN_ONLY |
 		GS_CAN_FEATURE_LOOP_BACK |
 		GS_CAN_FEATURE_IDENTIFY |
+		GS_CAN_FEATURE_USER_ID |
 		GS_CAN_FEATURE_TRIPLE_SAMPLE |
-		GS_CAN_FEATURE_ONE_SHOT,
-	.fclk_can = 8000000, // I really thought this ought to be 16MHz...
-	.tseg1_min = 3, .tseg1_max = 8 /* was 16 */, // Max should be 8 according to the chip docs, also it does not list 3 as minimum
-	.tseg2_min = 2, .tseg2_max = 8,
-	.sjw_max = 4,
+		GS_CAN_FEATURE_ONE_SHOT |
+		GS_CAN_FEATURE_HW_TIMESTAMP |
+		GS_CAN_FEATURE_GET_STATE,
+	.fclk_can = MCP_FCLK_CAN,
+	// tseg1 is split between PRSEG and PHSEG1 by gs_bittiming_to_mcp
+	.tseg1_min = MCP_TSEG1_MIN, .tseg1_max = MCP_TSEG1_MAX,
+	.tseg2_min = MCP_TSEG2_MIN, .tseg2_max = MCP_SEG_MAX,
+	.sjw_max = MCP_SJW_MAX,
 	.brp_min = 1,
-	.brp_max = 64,
+	.brp_max = MCP_BRP_MAX,
 	.brp_inc = 1
 };
 
@@ -130,17 +179,138 @@ const gs_device_config GS_DEVICE_CONFIG PROGMEM = {
 volatile gs_device_bittiming gs_requested_bittiming;
 volatile uint8_t gs_can_mode = GS_CAN_MODE_RESET;
 volatile uint8_t gs_can_mode_flags = GS_CAN_MODE_NORMAL;
+volatile gs_device_filter gs_requested_filter;
+volatile gs_device_stats gs_stats;
+volatile gs_device_restart gs_restart;
+volatile uint8_t gs_boot_run;
 
 union received_control_t {
 	gs_host_config host_config;
 	gs_device_bittiming device_bittiming;
 	gs_identify_mode identify_mode;
 	gs_device_mode device_mode;
+	gs_device_filter device_filter;
+	gs_device_restart restart;
+	gs_device_cyclic cyclic;
+	gs_device_isotp isotp;
+	uint32_t filter_ids[GS_SW_FILTER_MAX_IDS];
+	uint32_t user_id;
 } received_control;
 
+static void serial_hex(uint8_t b) {
+	serial[serial_len++] = pgm_read_byte(&HEX_DIGITS[b >> 4]);
+	serial[serial_len++] = pgm_read_byte(&HEX_DIGITS[b & 0x0F]);
+}
+
+static void serial_load() {
+	serial_len = 0;
+	user_id = GS_USER_ID_NONE;
+	if(eeprom_read_byte(EEPROM_USER_ID) == USER_ID_VALID) {
+		eeprom_read_block(&user_id, EEPROM_USER_ID + 1, sizeof(user_id));
+		// Most significant digit first, as the ID reads in hex
+		for(uint8_t i=sizeof(user_id); i--;) {
+			serial_hex(user_id >> (i << 3));
+		}
+		return;
+	}
+	for(uint8_t i=0; i<SIGNATURE_SERIAL_LEN; i++) {
+		// The signature row read is a timed SPM / LPM sequence
+		register uint8_t _sreg = SREG;
+		cli();
+		uint8_t b = boot_signature_byte_get(SIGNATURE_SERIAL + i);
+		SREG = _sreg;
+		serial_hex(b);
+	}
+}
+
+static void user_id_set(uint32_t id) {
+	// The state goes last, an ID cut short by a reset is not taken
+	eeprom_update_byte(EEPROM_USER_ID, 0xFF);
+	if(id != GS_USER_ID_NONE) {
+		eeprom_update_block(&id, EEPROM_USER_ID + 1, sizeof(id));
+		eeprom_update_byte(EEPROM_USER_ID, USER_ID_VALID);
+	}
+	serial_load();
+}
+
+static void boot_requested(boot_config* c) {
+	c->bittiming = gs_requested_bittiming;
+	c->flags = gs_can_mode_flags;
+	c->filter = gs_requested_filter;
+}
+
+/* The EEPROM accesses of main, each with interrupts off: gs_usb_init reads
+   it from the USB reset interrupt, which would otherwise set its own address
+   in the middle of the EEMPE / EEPE sequence or of a read. The previous
+   write (3.4ms) is waited for with interrupts on, a read of the interrupt
+   waits for one in progress by itself. Fine for the interrupt side too. */
+static uint8_t boot_get(const uint8_t* p) {
+	register uint8_t _sreg = SREG;
+	cli();
+	uint8_t v = eeprom_read_byte(p);
+	SREG = _sreg;
+	return v;
+}
+
+static void boot_put(uint8_t* p, uint8_t v) {
+	eeprom_busy_wait();
+	register uint8_t _sreg = SREG;
+	cli();
+	eeprom_update_byte(p, v);
+	SREG = _sreg;
+}
+
+static uint8_t boot_differs(const boot_config* c) {
+	const uint8_t* p = (const uint8_t*)c;
+	for(uint8_t i=0; i<sizeof(boot_config); i++) {
+		if(boot_get(EEPROM_BOOT + 1 + i) != p[i]) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* Called by main for every start that the MCP took, with its set up, so
+   that one it refuses is never kept. Only the changed bytes are written
+   (3.4ms each), none when the set up is the kept one. */
+void gs_usb_boot_save() {
+	uint8_t b = boot_get(EEPROM_BOOT);
+	if(b != BOOT_ON && b != BOOT_VALID) {
+		return;
+	}
+	boot_config c;
+	boot_requested(&c);
+	if(b == BOOT_VALID && !boot_differs(&c)) {
+		return;
+	}
+	// The state goes last, a set up cut short by a reset is not taken
+	boot_put(EEPROM_BOOT, BOOT_ON);
+	const uint8_t* p = (const uint8_t*)&c;
+	for(uint8_t i=0; i<sizeof(boot_config); i++) {
+		boot_put(EEPROM_BOOT + 1 + i, p[i]);
+	}
+	boot_put(EEPROM_BOOT, BOOT_VALID);
+}
+
 void gs_usb_init() {
-	gs_can_mode = GS_CAN_MODE_RESET;
+	if(gs_boot_run) {
+		// A USB reset while still running on the kept set up
+		serial_load();
+		return;
+	}
 	gs_can_mode_flags = GS_CAN_MODE_NORMAL;
+	if(eeprom_read_byte(EEPROM_BOOT) == BOOT_VALID) {
+		boot_config c;
+		eeprom_read_block(&c, EEPROM_BOOT + 1, sizeof(c));
+		gs_requested_bittiming = c.bittiming;
+		gs_can_mode_flags = c.flags;
+		gs_requested_filter = c.filter;
+		gs_boot_run = TRUE;
+		gs_can_mode = gs_can_mode ? GS_CAN_MODE_RESTART : GS_CAN_MODE_START;
+	} else {
+		gs_can_mode = GS_CAN_MODE_RESET;
+	}
+	serial_load();
 }
 
 uint8_t gs_usb_descriptor(usb_setup* setup) {
@@ -162,7 +332,7 @@ uint8_t gs_usb_descriptor(usb_setup* setup) {
 		} else if (t == IMANUFACTURER) {
 			return usb_send_string(STRING_MANUFACTURER, sizeof(STRING_MANUFACTURER));
 		} else if (t == ISERIAL) {
-			return usb_send_string(STRING_SERIAL, sizeof(STRING_SERIAL));
+			return usb_send_string_ram(serial, serial_len);
 		}
 	}
 	return FALSE;
@@ -178,6 +348,46 @@ uint8_t gs_usb_setup(usb_setup* setup) {
 			return usb_send_control(&GS_DEVICE_BT_CONST, sizeof(GS_DEVICE_BT_CONST));
 		} else if(r == GS_USB_BREQ_DEVICE_CONFIG) {
 			return usb_send_control(&GS_DEVICE_CONFIG, sizeof(GS_DEVICE_CONFIG));
+		} else if(r == GS_USB_BREQ_TIMESTAMP) {
+			uint32_t ts = timer_now();
+			return usb_send_control_ram(&ts, sizeof(ts));
+		} else if(r == GS_USB_BREQ_GET_USER_ID) {
+			return usb_send_control_ram(&user_id, sizeof(user_id));
+		} else if(r == GS_USB_BREQ_GET_STATE) {
+			// Asked for by "ip -details link" while the bus is up, the
+			// registers are only read
+			gs_device_state st = { .state = GS_CAN_STATE_STOPPED };
+			if(gs_can_mode) {
+				uint8_t c[2];
+				st.state = mcp_to_gs_state(mcp_read_error_state(c));
+				st.txerr = c[0];
+				st.rxerr = c[1];
+			}
+			return usb_send_control_ram(&st, sizeof(st));
+		} else if(r == GS_USB_BREQ_STATS) {
+			// Runs in the USB interrupt, so the counters do not change
+			// under the copy
+			gs_stats.rx_overflows[0] = mcp_rx_overflows[0];
+			gs_stats.rx_overflows[1] = mcp_rx_overflows[1];
+			t = usb_send_control_ram((const void*)&gs_stats, sizeof(gs_stats));
+			if(t && setup->wValueL == GS_STATS_READ_CLEAR) {
+				uint8_t* p = (uint8_t*)&gs_stats;
+				for(uint8_t i=0; i<sizeof(gs_stats); i++) {
+					p[i] = 0;
+				}
+				mcp_rx_overflows[0] = mcp_rx_overflows[1] = 0;
+			}
+			return t;
+		} else if(r == GS_USB_BREQ_BUS_STATS) {
+			// Like the counters above, nothing is counted under the copy
+			busstat_snapshot();
+			t = usb_send_control_ram((const void*)&busstat, sizeof(busstat));
+			if(t && setup->wValueL == GS_STATS_READ_CLEAR) {
+				busstat_clear();
+			}
+			return t;
+		} else if(r == GS_USB_BREQ_AUTOBAUD) {
+			return usb_send_control_ram((const void*)&autobaud, sizeof(autobaud));
 		}
 	}else if (t == REQUEST_HOSTTODEVICE_VENDOR_INTERFACE) {
 		if(r == GS_USB_BREQ_HOST_FORMAT) {
@@ -192,9 +402,94 @@ uint8_t gs_usb_setup(usb_setup* setup) {
 			return TRUE;
 		}else if(r == GS_USB_BREQ_MODE) {
 			usb_receive_control(&received_control.device_mode, sizeof(gs_device_mode));
-			gs_can_mode = received_control.device_mode.mode;
 			gs_can_mode_flags = received_control.device_mode.flags;
+			if(gs_boot_run) {
+				// The host takes over, a different set up needs a
+				// new start
+				boot_config c;
+				boot_requested(&c);
+				gs_boot_run = FALSE;
+				if(received_control.device_mode.mode == GS_CAN_MODE_START && gs_can_mode && boot_differs(&c)) {
+					gs_can_mode = GS_CAN_MODE_RESTART;
+					return TRUE;
+				}
+				// The same one: main_loop runs on, but the bus reset of
+				// the enumeration turned the OUT endpoint interrupt off
+				if(received_control.device_mode.mode == GS_CAN_MODE_START && gs_can_mode == GS_CAN_MODE_START) {
+					usb_out_interrupt(TRUE);
+				}
+			}
+			gs_can_mode = received_control.device_mode.mode;
 			return TRUE;
+		}else if(r == GS_USB_BREQ_HW_FILTER) {
+			// Takes effect with the next mode start
+			usb_receive_control(&received_control.device_filter, sizeof(gs_device_filter));
+			if(gs_filter_in_order(&received_control.device_filter)) {
+				gs_requested_filter = received_control.device_filter;
+				return TRUE;
+			}
+		}else if(r == GS_USB_BREQ_RESTART) {
+			// Applies to the next bus off
+			usb_receive_control(&received_control.restart, sizeof(gs_device_restart));
+			if(received_control.restart.restart_ms > 0xFFFF) {
+				received_control.restart.restart_ms = 0xFFFF;
+			}
+			gs_restart = received_control.restart;
+			return TRUE;
+		}else if(r == GS_USB_BREQ_CYCLIC) {
+			if(setup->wValueL == GS_CYCLIC_CLEAR) {
+				cyclic_clear();
+				return TRUE;
+			}else if(setup->wValueL < GS_CYCLIC_MAX_SLOTS) {
+				usb_receive_control(&received_control.cyclic, sizeof(gs_device_cyclic));
+				return cyclic_set(setup->wValueL, &received_control.cyclic);
+			}
+		}else if(r == GS_USB_BREQ_ISOTP) {
+			usb_receive_control(&received_control.isotp, sizeof(gs_device_isotp));
+			return isotp_set(&received_control.isotp);
+		}else if(r == GS_USB_BREQ_SET_USER_ID) {
+			// Only with the interface down, every changed EEPROM byte
+			// keeps this interrupt busy for 3.4ms
+			if(!gs_can_mode) {
+				usb_receive_control(&received_control.user_id, sizeof(uint32_t));
+				user_id_set(received_control.user_id);
+				return TRUE;
+			}
+		}else if(r == GS_USB_BREQ_BOOT_CONFIG) {
+			// Like the user ID, only with the interface down
+			if(!gs_can_mode && setup->wValueL == GS_BOOT_CONFIG_OFF) {
+				eeprom_update_byte(EEPROM_BOOT, BOOT_OFF);
+				return TRUE;
+			}else if(!gs_can_mode && setup->wValueL == GS_BOOT_CONFIG_ON) {
+				if(eeprom_read_byte(EEPROM_BOOT) != BOOT_VALID) {
+					eeprom_update_byte(EEPROM_BOOT, BOOT_ON);
+				}
+				return TRUE;
+			}
+		}else if(r == GS_USB_BREQ_BUS_STATS) {
+			if(setup->wValueL <= GS_BUS_STATS_ONLY) {
+				busstat_set(setup->wValueL);
+				return TRUE;
+			}
+		}else if(r == GS_USB_BREQ_AUTOBAUD) {
+			// Run by main, which only waits while the interface is down
+			if(!gs_can_mode) {
+				autobaud.state = GS_AUTOBAUD_RUNNING;
+				return TRUE;
+			}
+		}else if(r == GS_USB_BREQ_SW_FILTER) {
+			if(setup->wValueL == GS_SW_FILTER_CLEAR) {
+				filter_clear();
+				return TRUE;
+			}else if(setup->wValueL == GS_SW_FILTER_ADD && setup->wLength <= sizeof(received_control.filter_ids)) {
+				uint8_t n = setup->wLength / sizeof(uint32_t);
+				usb_receive_control(&received_control.filter_ids, setup->wLength);
+				t = TRUE;
+				for(uint8_t i=0; i<n; i++) {
+					t &= filter_add(received_control.filter_ids[i]);
+				}
+				return t;
+			}
 		}else if(r == GS_USB_BREQ_IDENTIFY) {
 			usb_receive_control(&received_control.identify_mode, sizeof(gs_identify_mode));
 			if(received_control.identify_mode.mode == GS_CAN_IDENTIFY_ON) {
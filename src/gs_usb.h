@@ -45,30 +45,99 @@
 #define GS_USB_BREQ_BERR		3 // unused by the Linux gs_usb driver
 #define GS_USB_BREQ_BT_CONST		4
 #define GS_USB_BREQ_DEVICE_CONFIG	5
-#define GS_USB_BREQ_TIMESTAMP		6 // unused by the Linux gs_usb driver
+#define GS_USB_BREQ_TIMESTAMP		6
 #define GS_USB_BREQ_IDENTIFY		7
+#define GS_USB_BREQ_GET_USER_ID		8 // uint32_t, 0xFFFFFFFF when none is set
+#define GS_USB_BREQ_SET_USER_ID		9 // uint32_t, 0xFFFFFFFF clears it
+#define GS_USB_BREQ_GET_STATE		14 // the numbers in between are for CAN FD and alike
+
+// Device specific requests, numbered away from the ones of the gs_usb protocol
+#define GS_USB_BREQ_HW_FILTER		32
+#define GS_USB_BREQ_SW_FILTER		33
+#define GS_USB_BREQ_STATS		34 // device to host, gs_device_stats
+#define GS_USB_BREQ_RESTART		35 // gs_device_restart
+#define GS_USB_BREQ_CYCLIC		36 // gs_device_cyclic, wValue is the slot
+#define GS_USB_BREQ_ISOTP		37 // gs_device_isotp
+#define GS_USB_BREQ_BOOT_CONFIG		39 // wValue below, without a data stage
+#define GS_USB_BREQ_BUS_STATS		40 // host to device the mode in wValue, device
+					   // to host gs_device_bus_stats
+#define GS_USB_BREQ_AUTOBAUD		41 // host to device starts, device to host
+					   // gs_device_autobaud
+
+// wValue of GS_USB_BREQ_SW_FILTER, the ids to add (up to 16) come as uint32_t
+// SocketCAN ids in the data stage
+#define GS_SW_FILTER_CLEAR		0
+#define GS_SW_FILTER_ADD		1
+#define GS_SW_FILTER_MAX_IDS		16
+
+// wValue of GS_USB_BREQ_STATS, the counters are cleared after being sent
+#define GS_STATS_READ			0
+#define GS_STATS_READ_CLEAR		1
+
+// gs_device_restart flags
+#define GS_RESTART_FLUSH_TX		1
+
+// wValue of GS_USB_BREQ_CYCLIC to free all slots, without a data stage
+#define GS_CYCLIC_CLEAR			0xFF
+#define GS_CYCLIC_MAX_SLOTS		8
+
+// gs_device_isotp flags
+#define GS_ISOTP_AUTO_FC		1 // Answer the First Frames on rx_id
+#define GS_ISOTP_PACE_CF		2 // Pace the Consecutive Frames on tx_id
+
+// GS_USB_BREQ_GET_USER_ID without an ID set
+#define GS_USER_ID_NONE			0xFFFFFFFF
+
+// wValue of GS_USB_BREQ_BOOT_CONFIG: with it on, the bit timing, mode flags
+// and hardware filter of every start are kept in the EEPROM and the device
+// starts with them after a reset, before the host has asked for anything
+#define GS_BOOT_CONFIG_OFF		0
+#define GS_BOOT_CONFIG_ON		1
+
+// wValue of GS_USB_BREQ_BUS_STATS to the device, every mode change clears
+// the statistics; read with GS_STATS_READ or GS_STATS_READ_CLEAR
+#define GS_BUS_STATS_OFF		0
+#define GS_BUS_STATS_ON			1
+#define GS_BUS_STATS_ONLY		2 // Received frames are not sent to the host
+#define GS_BUS_STATS_IDS		32
+
+// gs_device_autobaud state
+#define GS_AUTOBAUD_IDLE		0
+#define GS_AUTOBAUD_RUNNING		1
+#define GS_AUTOBAUD_FOUND		2
+#define GS_AUTOBAUD_FAILED		3 // Nothing received at any rate
 
 #define GS_CAN_MODE_RESET		0
 #define GS_CAN_MODE_START		1
+#define GS_CAN_MODE_RESTART		2 // Device internal, start over with the requested set up
 
 #define GS_CAN_MODE_NORMAL		0x00
 #define GS_CAN_MODE_LISTEN_ONLY		0x01
 #define GS_CAN_MODE_LOOP_BACK		0x02
 #define GS_CAN_MODE_TRIPLE_SAMPLE	0x04
 #define GS_CAN_MODE_ONE_SHOT		0x08
+#define GS_CAN_MODE_HW_TIMESTAMP	0x10
 
 #define GS_CAN_FEATURE_LISTEN_ONLY	0x01
 #define GS_CAN_FEATURE_LOOP_BACK	0x02
 #define GS_CAN_FEATURE_TRIPLE_SAMPLE	0x04
 #define GS_CAN_FEATURE_ONE_SHOT		0x08
-#define GS_CAN_FEATURE_HW_TIMESTAMP	0x10 // unused by the Linux gs_usb drivers
+#define GS_CAN_FEATURE_HW_TIMESTAMP	0x10
 #define GS_CAN_FEATURE_IDENTIFY		0x20
+#define GS_CAN_FEATURE_USER_ID		0x40
+#define GS_CAN_FEATURE_GET_STATE	0x2000
 
 #define GS_CAN_IDENTIFY_OFF		0
 #define GS_CAN_IDENTIFY_ON		1
 
 #define GS_CAN_FLAG_OVERFLOW		1
 
+#define GS_CAN_STATE_ERROR_ACTIVE	0
+#define GS_CAN_STATE_ERROR_WARNING	1
+#define GS_CAN_STATE_ERROR_PASSIVE	2
+#define GS_CAN_STATE_BUS_OFF		3
+#define GS_CAN_STATE_STOPPED		4
+
 typedef struct  {
 	uint32_t feature;
 	uint32_t fclk_can;
@@ -112,6 +181,105 @@ typedef struct {
 	uint32_t flags;
 } gs_device_mode;
 
+/* Bus off recovery on the device: transmissions are held for restart_ms
+   after the bus off and then resumed, or with GS_RESTART_FLUSH_TX dropped
+   together with the frames queued until then (they still come back as
+   echoes, the host needs those to free its transmit slots). A
+   CAN_ERR_RESTARTED error frame marks the restart, after a drop with
+   CAN_ERR_CTRL / CAN_ERR_CRTL_TX_OVERFLOW and the number of dropped frames
+   in data[5]. Those are not counted as sent, in gs_device_stats or the bus
+   statistics. 0 leaves the recovery to the MCP alone. */
+typedef struct {
+	uint32_t restart_ms;
+	uint32_t flags;
+} gs_device_restart;
+
+/* A frame the device sends by itself every period_ms (up to 65535),
+   count times or (0) until the slot is freed with a period of 0. The
+   frames are not echoed to the host, their timing does not depend on it.
+   The slots stay set across the mode changes and run while the device is
+   started. */
+typedef struct {
+	uint32_t period_ms;
+	uint32_t count;
+	uint32_t can_id;
+	uint8_t can_dlc;
+	uint8_t reserved[3];
+	uint8_t data[8];
+} gs_device_cyclic;
+
+/* The ISO-TP engine, see isotp.c. The Flow Control frames of the device go
+   on tx_id with block_size and st_min, 8 bytes padded with padding. Flags of
+   0 turn it off, the setting stays across the mode changes. */
+typedef struct {
+	uint32_t flags;
+	uint32_t tx_id;		// Tester to ECU
+	uint32_t rx_id;		// ECU to tester
+	uint8_t block_size;
+	uint8_t st_min;
+	uint8_t padding;
+	uint8_t reserved;
+} gs_device_isotp;
+
+typedef struct {
+	uint32_t state;
+	uint32_t rxerr;
+	uint32_t txerr;
+} gs_device_state;
+
+/* Acceptance masks and filters of the MCP2515 in the SocketCAN can_id format,
+   with CAN_EFF_FLAG set for 29 bit ones. RXB0 takes frames matching filter 0
+   or 1 on the bits set in mask 0, RXB1 those matching filters 2 to 5 on the
+   bits of mask 1. Masks are 0 (let everything through) by default, to filter
+   both masks have to be set. RXB1 also takes what RXB0 has no room for and
+   the firmware reads the two in that order, so a set up where filters 2 to
+   5 pass frames that filters 0 and 1 do not is refused, see
+   gs_filter_in_order in mcp_gs.c. */
+typedef struct {
+	uint32_t mask[2];
+	uint32_t filter[6];
+} gs_device_filter;
+
+/* Counters kept by the firmware since power up or the last clear. They
+   wrap around, the host computes the rates from the differences. */
+typedef struct {
+	uint32_t rx_frames;		// Read from the MCP receive buffers
+	uint32_t rx_dropped;		// Lost on a full host ring
+	uint32_t tx_frames;		// Loaded into the MCP transmit buffers
+	uint32_t echo_frames;		// Echoes queued for the host
+	uint32_t rx_overflows[2];	// RX0OVR and RX1OVR events of the MCP
+	uint32_t tx_fifo_full;		// Times the TX FIFO filled up and held the host off
+	uint32_t isr_max_ticks;		// Longest MCP interrupt routine, in 0.5us timer ticks
+	uint32_t host_ring_peak;	// Most frames ever waiting in the host ring
+} gs_device_stats;
+
+/* Bus load and the frames per id since the mode was set or the statistics
+   last cleared, counted for the received and the sent frames alike. The
+   bits are estimated from the id type and DLC with the worst case bit
+   stuffing and the interframe space, so the load comes out somewhat high.
+   The ids (CAN_RTR_FLAG cleared) are kept in an open addressing table, an
+   entry with count 0 is free, frames with ids that find no room in it are
+   only counted as untracked. */
+typedef struct {
+	uint32_t interval_us;
+	uint32_t frames;
+	uint32_t bits;
+	uint32_t untracked;
+	uint16_t load;			// Of the bit rate, in 0.01%
+	uint16_t mode;
+	uint32_t can_id[GS_BUS_STATS_IDS];
+	uint16_t count[GS_BUS_STATS_IDS];	// Stops at 0xFFFF
+} gs_device_bus_stats;
+
+/* Bit rate detection, started with the interface down. The bit timing found
+   is for the fclk_can of GS_USB_BREQ_BT_CONST (MCP_FCLK_CAN), as the ones
+   the host sets. */
+typedef struct {
+	uint32_t state;
+	uint32_t bitrate;
+	gs_device_bittiming bittiming;
+} gs_device_autobaud;
+
 typedef struct {
 	uint32_t echo_id;
 	uint32_t can_id;
@@ -120,13 +288,21 @@ typedef struct {
 	uint8_t flags;
 	uint8_t reserved;
 	uint8_t data[8];
+	uint32_t timestamp_us; // only sent to the host in GS_CAN_MODE_HW_TIMESTAMP mode
 } gs_host_frame;
 
+#define GS_HOST_FRAME_SIZE		(sizeof(gs_host_frame) - sizeof(uint32_t))
+#define GS_HOST_FRAME_SIZE_TS		sizeof(gs_host_frame)
+
 extern volatile gs_device_bittiming gs_requested_bittiming;
 extern volatile uint8_t gs_can_mode;
 extern volatile uint8_t gs_can_mode_flags;
+extern volatile gs_device_filter gs_requested_filter;
+extern volatile gs_device_stats gs_stats;
+extern volatile gs_device_restart gs_restart;
 
 void gs_usb_init();
+void gs_usb_boot_save();
 uint8_t gs_usb_descriptor();
 uint8_t gs_usb_setup();
 
@@ -0,0 +1,51 @@
+/*
+
+  This file is part of gs_usb_leonardo project --
+  gs_usb compatible SocketCAN firmware for Arduino Leonardo /
+  MCP2515 based USB device, see
+
+          https://github.com/woj76/gs_usb_leonardo
+
+  For information about how this code came to be and what / whose
+  work it is based on, please see the LICENSE.md file in the project
+  root directory.
+
+  Copyright (C) 2019 Wojciech Mostowski <wojciech.mostowski@gmail.com>
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the License, or any later
+  version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  The copy of the license can be found in the licenses directory of
+  the project, or on GNU/FSF website at https://www.gnu.org/licenses/.
+
+*/
+
+/* Stand-in for avr/eeprom.h in the host build, the EEPROM is the sim_eeprom
+   array of sim_avr.c, erased (all 0xFF) at the start. The writes take no
+   time here, on the chip every changed byte takes 3.4ms. */
+
+#ifndef HOST_AVR_EEPROM_H
+#define HOST_AVR_EEPROM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define E2END		0x3FF
+
+extern uint8_t sim_eeprom[E2END + 1];
+
+#define eeprom_busy_wait()			do {} while(0)
+#define eeprom_read_byte(address)		(sim_eeprom[(size_t)(address)])
+#define eeprom_update_byte(address, value)	(sim_eeprom[(size_t)(address)] = (value))
+#define eeprom_read_block(dst, src, n)		memcpy((dst), &sim_eeprom[(size_t)(src)], (n))
+#define eeprom_update_block(src, dst, n)	memcpy(&sim_eeprom[(size_t)(dst)], (src), (n))
+
+#endif
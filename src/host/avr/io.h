@@ -0,0 +1,206 @@
+/*
+
+  This file is part of gs_usb_leonardo project --
+  gs_usb compatible SocketCAN firmware for Arduino Leonardo /
+  MCP2515 based USB device, see
+
+          https://github.com/woj76/gs_usb_leonardo
+
+  For information about how this code came to be and what / whose
+  work it is based on, please see the LICENSE.md file in the project
+  root directory.
+
+  Copyright (C) 2019 Wojciech Mostowski <wojciech.mostowski@gmail.com>
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the License, or any later
+  version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  The copy of the license can be found in the licenses directory of
+  the project, or on GNU/FSF website at https://www.gnu.org/licenses/.
+
+*/
+
+/* Stand-in for avr/io.h in the host build (see sim_avr.c), declaring the
+   ATmega32U4 registers used by the firmware. Most are plain variables, the
+   ones with side effects (SPI transfer, USB endpoint FIFOs, the timer) are
+   accessor functions returning a pointer the firmware reads or writes
+   through, see sim_avr.c for how the writes are picked up. */
+
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+
+#include <stdint.h>
+
+uint8_t* sim_reg_sreg();
+uint8_t* sim_reg_spsr();
+uint8_t* sim_reg_spdr();
+uint8_t* sim_reg_udr1();
+uint8_t* sim_reg_ucsr1a();
+uint8_t* sim_reg_pllcsr();
+uint16_t* sim_reg_tcnt1();
+uint8_t* sim_reg_tifr1();
+uint8_t* sim_reg_ueintx();
+uint8_t* sim_reg_uedatx();
+uint8_t* sim_reg_uebclx();
+uint8_t* sim_reg_ueconx();
+uint8_t* sim_reg_ueienx();
+uint8_t* sim_reg_uecfg0x();
+uint8_t* sim_reg_uecfg1x();
+
+#define SREG		(*(volatile uint8_t*)sim_reg_sreg())
+#define SPSR		(*(volatile uint8_t*)sim_reg_spsr())
+#define SPDR		(*(volatile uint8_t*)sim_reg_spdr())
+#define UDR1		(*(volatile uint8_t*)sim_reg_udr1())
+#define UCSR1A		(*(volatile uint8_t*)sim_reg_ucsr1a())
+#define PLLCSR		(*(volatile uint8_t*)sim_reg_pllcsr())
+#define TCNT1		(*(volatile uint16_t*)sim_reg_tcnt1())
+#define TIFR1		(*(volatile uint8_t*)sim_reg_tifr1())
+#define UEINTX		(*(volatile uint8_t*)sim_reg_ueintx())
+#define UEDATX		(*(volatile uint8_t*)sim_reg_uedatx())
+#define UEBCLX		(*(volatile uint8_t*)sim_reg_uebclx())
+#define UECONX		(*(volatile uint8_t*)sim_reg_ueconx())
+#define UEIENX		(*(volatile uint8_t*)sim_reg_ueienx())
+#define UECFG0X		(*(volatile uint8_t*)sim_reg_uecfg0x())
+#define UECFG1X		(*(volatile uint8_t*)sim_reg_uecfg1x())
+
+extern volatile uint8_t DDRB, PORTB, PINB;
+extern volatile uint8_t DDRC, PORTC, PINC;
+extern volatile uint8_t DDRD, PORTD, PIND;
+extern volatile uint8_t DDRE, PORTE, PINE;
+extern volatile uint8_t DDRF, PORTF, PINF;
+extern volatile uint8_t EICRA, EICRB, EIMSK, EIFR;
+extern volatile uint8_t SPCR;
+extern volatile uint8_t UCSR1B, UCSR1C;
+extern volatile uint16_t UBRR1;
+extern volatile uint8_t TCCR1A, TCCR1B, TCCR1C, TIMSK1;
+extern volatile uint16_t OCR1A, OCR1B, OCR1C;
+extern volatile uint8_t UHWCON, USBCON, USBSTA, UDCON, UDINT, UDIEN, UDADDR;
+extern volatile uint8_t UENUM, UERST, UEINT;
+extern volatile uint8_t UDFNUML, UDFNUMH;
+extern volatile uint8_t GPIOR0, GPIOR1, GPIOR2;
+extern volatile uint8_t SMCR, MCUCR, MCUSR;
+extern volatile uint8_t CLKSEL0, CLKSTA;
+
+// SPSR, SPCR
+#define SPIF		7
+#define WCOL		6
+#define SPI2X		0
+#define SPIE		7
+#define SPE		6
+#define DORD		5
+#define MSTR		4
+#define CPOL		3
+#define CPHA		2
+#define SPR1		1
+#define SPR0		0
+
+// USART1
+#define RXC1		7
+#define TXC1		6
+#define UDRE1		5
+#define RXEN1		4
+#define TXEN1		3
+#define UMSEL11		7
+#define UMSEL10		6
+
+// EICRB, EIMSK, EIFR
+#define ISC71		7
+#define ISC70		6
+#define ISC61		5
+#define ISC60		4
+#define INT6		6
+#define INTF6		6
+
+// Timer 1
+#define WGM11		1
+#define WGM10		0
+#define ICNC1		7
+#define ICES1		6
+#define WGM13		4
+#define WGM12		3
+#define CS12		2
+#define CS11		1
+#define CS10		0
+#define ICIE1		5
+#define OCIE1C		3
+#define OCIE1B		2
+#define OCIE1A		1
+#define TOIE1		0
+#define ICF1		5
+#define OCF1C		3
+#define OCF1B		2
+#define OCF1A		1
+#define TOV1		0
+
+// SMCR
+#define SM2		3
+#define SM1		2
+#define SM0		1
+#define SE		0
+
+// PLL and USB controller
+#define PINDIV		4
+#define PLLE		1
+#define PLOCK		0
+#define UVREGE		0
+#define USBE		7
+#define FRZCLK		5
+#define OTGPADE		4
+#define VBUSTE		0
+#define VBUS		0
+#define RSTCPU		3
+#define LSM		2
+#define RMWKUP		1
+#define DETACH		0
+#define UPRSMI		6
+#define EORSMI		5
+#define WAKEUPI		4
+#define EORSTI		3
+#define SOFI		2
+#define SUSPI		0
+#define UPRSME		6
+#define EORSME		5
+#define WAKEUPE		4
+#define EORSTE		3
+#define SOFE		2
+#define SUSPE		0
+#define ADDEN		7
+
+// Endpoint registers
+#define STALLRQ		5
+#define STALLRQC	4
+#define RSTDT		3
+#define EPEN		0
+#define EPTYPE1		7
+#define EPTYPE0		6
+#define EPDIR		0
+#define EPSIZE2		6
+#define EPSIZE1		5
+#define EPSIZE0		4
+#define EPBK1		3
+#define EPBK0		2
+#define ALLOC		1
+#define FIFOCON		7
+#define NAKINI		6
+#define RWAL		5
+#define NAKOUTI		4
+#define RXSTPI		3
+#define RXOUTI		2
+#define STALLEDI	1
+#define TXINI		0
+#define FLERRE		7
+#define NAKINE		6
+#define NAKOUTE		4
+#define RXSTPE		3
+#define RXOUTE		2
+#define STALLEDE	1
+#define TXINE		0
+
+#endif
@@ -0,0 +1,324 @@
+/*
+
+  This file is part of gs_usb_leonardo project --
+  gs_usb compatible SocketCAN firmware for Arduino Leonardo /
+  MCP2515 based USB device, see
+
+          https://github.com/woj76/gs_usb_leonardo
+
+  For information about how this code came to be and what / whose
+  work it is based on, please see the LICENSE.md file in the project
+  root directory.
+
+  Copyright (C) 2019 Wojciech Mostowski <wojciech.mostowski@gmail.com>
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the License, or any later
+  version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  The copy of the license can be found in the licenses directory of
+  the project, or on GNU/FSF website at https://www.gnu.org/licenses/.
+
+*/
+
+/* Benchmark of the receive and transmit paths on the host build, run with
+   "make host-bench" in the src directory. For each bit rate the device gets
+   a burst of back to back frames from the bus, and the host a burst of
+   frames to send with as many in flight as the Linux driver keeps. The
+   numbers go to a JSON file:
+
+   - units spent in ISR(INT6_vect) per received frame, and the longest run
+   - with "make HOST_SRAM=1 host-bench" also the SRAM bytes read and written
+     per frame over the same two stretches
+   - units from an OUT packet reaching the firmware to the transmit request
+     of its frame, that is the trip through main_loop, one frame at a time
+   - the longest stretch of main line code with interrupts disabled, the
+     longest run of every interrupt routine, and the longest the MCP
+     interrupt line stays low before ISR(INT6_vect) starts
+   - frames per second delivered / sent and the frames lost on the way, the
+     sending also in the loopback mode
+   - both directions at once at 1Mbit/s, for the INT6 latency with the USB
+     and the MCP interrupts crossing
+
+   The units are the costs the models charge per register access, SPI byte
+   and interrupt entry (SIM_COST_* in sim.h), not AVR cycles of the built
+   image: the code between the accesses costs nothing in them. They tell one
+   version of the firmware from the next, not what the board measures. Frames go on the bus without stuff bits. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "harness.h"
+
+#define BENCH_FRAMES		2000
+#define BENCH_SINGLE_FRAMES	100
+
+typedef struct {
+	uint32_t delivered;
+	uint32_t lost;
+	double fps;
+	double latency_us;	// Average from the end of the frame on the bus to the host
+	double latency_max_us;
+	uint32_t rxovr;
+	double int6_units;	// Per frame stored by the MCP
+	uint32_t int6_max;
+	double int6_sram;	// Bytes, per frame stored by the MCP
+} bench_rx;
+
+typedef struct {
+	uint32_t sent;
+	double fps;
+	double main_loop_units;
+	uint32_t main_loop_max;
+	double main_loop_sram;	// Bytes, over the same stretch as the units
+} bench_tx;
+
+typedef struct {
+	uint32_t received;
+	uint32_t echoed;
+	double int6_latency;
+	uint32_t int6_latency_max;
+} bench_mixed;
+
+static uint32_t cli_max;
+static uint32_t int6_latency_max;
+static uint32_t isr_max[SIM_N_VECTORS];
+
+static void bench_track() {
+	if(sim_cli_max > cli_max) {
+		cli_max = sim_cli_max;
+	}
+	if(sim_int6_latency_max > int6_latency_max) {
+		int6_latency_max = sim_int6_latency_max;
+	}
+	for(uint8_t v=0; v<SIM_N_VECTORS; v++) {
+		if(sim_vectors[v].max > isr_max[v]) {
+			isr_max[v] = sim_vectors[v].max;
+		}
+	}
+}
+
+static void bench_rx_burst(uint32_t bit_cycles, uint8_t dlc, bench_rx* r) {
+	memset(r, 0, sizeof(bench_rx));
+	sim_bus_reset(bit_cycles);
+	gs_start(GS_CAN_MODE_NORMAL, bit_cycles);
+	sim_stats_reset();
+	uint64_t t0 = sim_cycles;
+	sim_can_frame f = std_frame(0, 0);
+	f.dlc = dlc;
+	uint64_t frame_cycles = (uint64_t)sim_bus_frame_bits(&f) * bit_cycles;
+	for(uint32_t i=0; i<BENCH_FRAMES; i++) {
+		f = std_frame(i & CAN_SFF_MASK, i);
+		f.dlc = dlc;
+		sim_bus_send(&f, t0);
+	}
+	collect(5);
+	uint64_t last = t0, latency = 0;
+	for(int i=0; i<n_got; i++) {
+		if(got[i].can_id & CAN_ERR_FLAG) {
+			continue;
+		}
+		// Frames of 0 bytes carry no sequence number, but then every frame
+		// has its own id within a run of 2048
+		uint32_t seq = dlc >= 4 ? seq_of(got[i].data) : got[i].can_id;
+		uint64_t end = t0 + (seq + 1) * frame_cycles;
+		uint64_t l = got_time[i] > end ? got_time[i] - end : 0;
+		latency += l;
+		if(l > r->latency_max_us * SIM_CYCLES_US(1)) {
+			r->latency_max_us = (double)l / SIM_CYCLES_US(1);
+		}
+		r->delivered++;
+		last = got_time[i];
+	}
+	r->lost = BENCH_FRAMES - r->delivered;
+	r->fps = per_second(r->delivered, last - t0);
+	r->latency_us = r->delivered ? (double)latency / r->delivered / SIM_CYCLES_US(1) : 0;
+	r->rxovr = sim_bus.n_rx0ovr + sim_bus.n_rx1ovr;
+	r->int6_units = sim_bus.n_received ? (double)sim_vectors[SIM_VECT_INT6].cycles / sim_bus.n_received : 0;
+	r->int6_max = sim_vectors[SIM_VECT_INT6].max;
+	r->int6_sram = sim_bus.n_received ? (double)sim_vectors[SIM_VECT_INT6].sram / sim_bus.n_received : 0;
+	bench_track();
+	gs_stop();
+}
+
+static void bench_tx_burst(uint32_t bit_cycles, uint32_t mode, bench_tx* r) {
+	memset(r, 0, sizeof(bench_tx));
+	sim_bus_reset(bit_cycles);
+	gs_start(mode, bit_cycles);
+	sim_stats_reset();
+	// One frame at a time first, for the trip through main_loop alone
+	uint64_t total = 0, sram = 0;
+	for(uint32_t i=0; i<BENCH_SINGLE_FRAMES; i++) {
+		gs_host_frame hf = { .echo_id = 0, .can_id = 0x100, .can_dlc = 8 };
+		uint64_t before = sim_mcp_txreq_time;
+		sim_host_out(&hf, GS_HOST_FRAME_SIZE);
+		collect(1);
+		if(sim_mcp_txreq_time != before && sim_mcp_txreq_time > sim_usb_out_time) {
+			uint32_t c = sim_mcp_txreq_time - sim_usb_out_time;
+			total += c;
+			sram += sim_mcp_txreq_sram - sim_usb_out_sram;
+			if(c > r->main_loop_max) {
+				r->main_loop_max = c;
+			}
+		}
+	}
+	r->main_loop_units = (double)total / BENCH_SINGLE_FRAMES;
+	r->main_loop_sram = (double)sram / BENCH_SINGLE_FRAMES;
+	uint32_t single = sim_bus.n_sent;
+	// Then the burst
+	uint32_t sent = 0, echoed = 0;
+	uint64_t t0 = sim_cycles, last = t0;
+	while(echoed < BENCH_FRAMES && sim_cycles - last < SIM_CYCLES_MS(50)) {
+		if(sent < BENCH_FRAMES && sent - echoed < HOST_TX_URBS) {
+			gs_host_frame hf = { .echo_id = sent % HOST_TX_URBS, .can_id = 0x100, .can_dlc = 8 };
+			sim_host_out(&hf, GS_HOST_FRAME_SIZE);
+			sent++;
+			continue;
+		}
+		gs_host_frame hf;
+		if(sim_host_in(&hf) < 0) {
+			sim_wait(SIM_CYCLES_US(20));
+			continue;
+		}
+		if(hf.echo_id != ECHO_RX) {
+			echoed++;
+			last = sim_cycles;
+		}
+	}
+	r->sent = sim_bus.n_sent - single;
+	if(sim_bus.n_sent && sim_bus.n_sent <= SIM_BUS_LOG_SIZE) {
+		r->fps = per_second(r->sent, sim_bus.sent[sim_bus.n_sent - 1].time - t0);
+	}
+	bench_track();
+	gs_stop();
+}
+
+/* Frames from another node back to back, with the host sending as fast as
+   the bus takes its frames in between. The lengths vary, so that the frames
+   end at all points of the main loop and not at the same one each time. */
+static void bench_mixed_burst(uint32_t bit_cycles, bench_mixed* r) {
+	memset(r, 0, sizeof(bench_mixed));
+	sim_bus_reset(bit_cycles);
+	gs_start(GS_CAN_MODE_NORMAL, bit_cycles);
+	sim_stats_reset();
+	uint64_t t0 = sim_cycles;
+	for(uint32_t i=0; i<BENCH_FRAMES; i++) {
+		sim_can_frame f = std_frame(0x200 + (i & 0xFF), i);
+		f.dlc = 4 + i % 5;
+		sim_bus_send(&f, t0);
+	}
+	uint32_t sent = 0;
+	uint64_t last = t0;
+	while(sim_cycles - last < SIM_CYCLES_MS(5)) {
+		if(sent < BENCH_FRAMES && sent - r->echoed < HOST_TX_URBS) {
+			gs_host_frame hf = { .echo_id = sent % HOST_TX_URBS, .can_id = 0x100, .can_dlc = sent % 9 };
+			sim_host_out(&hf, GS_HOST_FRAME_SIZE);
+			sent++;
+			continue;
+		}
+		gs_host_frame hf;
+		if(sim_host_in(&hf) < 0) {
+			sim_wait(SIM_CYCLES_US(20));
+			continue;
+		}
+		if(hf.echo_id == ECHO_RX) {
+			r->received++;
+		} else {
+			r->echoed++;
+		}
+		last = sim_cycles;
+	}
+	r->int6_latency = sim_int6_entries ? (double)sim_int6_latency_total / sim_int6_entries : 0;
+	r->int6_latency_max = sim_int6_latency_max;
+	bench_track();
+	gs_stop();
+}
+
+static void bench_print_tx(FILE* f, const char* name, bench_tx* r, const char* sep) {
+	fprintf(f, "\t\t\t\"%s\": {\"sent\": %u, \"frames_per_s\": %.0f, "
+		"\"main_loop_units_per_frame\": %.1f, \"main_loop_max_units\": %u",
+		name, r->sent, r->fps, r->main_loop_units, r->main_loop_max);
+#ifdef HOST_SRAM
+	fprintf(f, ", \"main_loop_sram_bytes_per_frame\": %.1f", r->main_loop_sram);
+#endif
+	fprintf(f, "}%s\n", sep);
+}
+
+static void bench_print_rx(FILE* f, const char* name, bench_rx* r) {
+	fprintf(f, "\t\t\t\"%s\": {\"delivered\": %u, \"lost\": %u, \"frames_per_s\": %.0f, "
+		"\"latency_us\": %.1f, \"latency_max_us\": %.1f, \"rx_overflows\": %u, "
+		"\"int6_units_per_frame\": %.1f, \"int6_max_units\": %u",
+		name, r->delivered, r->lost, r->fps, r->latency_us, r->latency_max_us, r->rxovr,
+		r->int6_units, r->int6_max);
+#ifdef HOST_SRAM
+	fprintf(f, ", \"int6_sram_bytes_per_frame\": %.1f", r->int6_sram);
+#endif
+	fprintf(f, "},\n");
+}
+
+// Name of a rate in the results, the top one is 1M with the 16MHz MCP2515
+// and 500k with MCP_CLOCK=8000000 (see harness.h)
+static const char* bench_rate_name(uint32_t bit_cycles) {
+	static char name[8];
+	uint32_t bitrate = SIM_F_CPU / bit_cycles;
+	if(bitrate % 1000000) {
+		snprintf(name, sizeof(name), "%uk", bitrate / 1000);
+	} else {
+		snprintf(name, sizeof(name), "%uM", bitrate / 1000000);
+	}
+	return name;
+}
+
+int bench(const char* file_name) {
+	static const uint32_t rates[] = { BIT_CYCLES_125K, BIT_CYCLES_500K, BIT_CYCLES_1M };
+	static const char* vectors[SIM_N_VECTORS] = { "INT6", "USB_GEN", "USB_COM", "TIMER1_COMPA", "TIMER1_COMPB", "TIMER1_COMPC", "TIMER1_OVF" };
+	FILE* f = fopen(file_name, "w");
+	if(!f) {
+		perror(file_name);
+		return 1;
+	}
+	fprintf(f, "{\n\t\"unit_costs\": {\"register\": %d, \"spi_byte\": %d, \"isr\": %d},\n",
+		SIM_COST_REG, SIM_COST_SPI_BYTE, SIM_COST_ISR);
+	fprintf(f, "\t\"frames_per_run\": %d,\n\t\"rates\": {\n", BENCH_FRAMES);
+	for(uint8_t i=0; i<sizeof(rates) / sizeof(rates[0]); i++) {
+		bench_rx rx8, rx0;
+		bench_tx tx, lb;
+		const char* name = bench_rate_name(rates[i]);
+		bench_rx_burst(rates[i], 8, &rx8);
+		bench_rx_burst(rates[i], 0, &rx0);
+		bench_tx_burst(rates[i], GS_CAN_MODE_NORMAL, &tx);
+		bench_tx_burst(rates[i], GS_CAN_MODE_LOOP_BACK, &lb);
+		fprintf(f, "\t\t\"%s\": {\n\t\t\t\"bitrate\": %u,\n", name, (uint32_t)(SIM_F_CPU / rates[i]));
+		bench_print_rx(f, "rx_dlc8", &rx8);
+		bench_print_rx(f, "rx_dlc0", &rx0);
+		bench_print_tx(f, "tx_dlc8", &tx, ",");
+		bench_print_tx(f, "loopback_dlc8", &lb, "");
+		fprintf(f, "\t\t}%s\n", i + 1 < sizeof(rates) / sizeof(rates[0]) ? "," : "");
+		printf("%-5s rx %u/%u lost, %.0f + %.0f frames/s, INT6 %.0f units/frame, tx %.0f frames/s, main_loop %.0f units/frame, loopback %.0f frames/s\n",
+			name, rx8.lost, rx0.lost, rx8.fps, rx0.fps, rx8.int6_units, tx.fps, tx.main_loop_units, lb.fps);
+#ifdef HOST_SRAM
+		printf("%-5s SRAM bytes per 8 byte frame: %.0f in INT6, %.0f from the OUT packet to the transmit request\n",
+			name, rx8.int6_sram, tx.main_loop_sram);
+#endif
+	}
+	bench_mixed mixed;
+	const char* name = bench_rate_name(BIT_CYCLES_1M);
+	bench_mixed_burst(BIT_CYCLES_1M, &mixed);
+	fprintf(f, "\t},\n\t\"mixed_%s\": {\"received\": %u, \"echoed\": %u, \"int6_latency_units\": %.1f, \"int6_latency_max_units\": %u},\n",
+		name, mixed.received, mixed.echoed, mixed.int6_latency, mixed.int6_latency_max);
+	printf("%-5s both ways %u received, %u echoed, INT6 latency %.1f units, up to %u\n", name, mixed.received, mixed.echoed, mixed.int6_latency, mixed.int6_latency_max);
+	fprintf(f, "\t\"interrupts_disabled_max_units\": %u,\n\t\"int6_latency_max_units\": %u,\n\t\"isr_max_units\": {", cli_max, int6_latency_max);
+	for(uint8_t v=0; v<SIM_N_VECTORS; v++) {
+		fprintf(f, "%s\"%s\": %u", v ? ", " : "", vectors[v], isr_max[v]);
+	}
+	fprintf(f, "}\n}\n");
+	fclose(f);
+	printf("Interrupts disabled for up to %u units, INT6 latency up to %u units, results in %s\n", cli_max, int6_latency_max, file_name);
+	return 0;
+}
@@ -0,0 +1,1508 @@
+/*
+
+  This file is part of gs_usb_leonardo project --
+  gs_usb compatible SocketCAN firmware for Arduino Leonardo /
+  MCP2515 based USB device, see
+
+          https://github.com/woj76/gs_usb_leonardo
+
+  For information about how this code came to be and what / whose
+  work it is based on, please see the LICENSE.md file in the project
+  root directory.
+
+  Copyright (C) 2019 Wojciech Mostowski <wojciech.mostowski@gmail.com>
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the License, or any later
+  version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  The copy of the license can be found in the licenses directory of
+  the project, or on GNU/FSF website at https://www.gnu.org/licenses/.
+
+*/
+
+/* Scripted scenarios for the host build of the firmware: the host end of
+   the USB cable enumerates the device and talks gs_usb to it like the Linux
+   driver does, while the other nodes on the CAN bus are played from the bus
+   model. Every scenario prints PASS or FAIL with a few numbers measured in
+   the virtual time of the model, the exit status is the number of failed
+   scenarios. Run with "make host-check" in the src directory, with --bench
+   the scenarios are replaced by the benchmark in bench.c. */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <avr/eeprom.h>
+
+#include "harness.h"
+#include "usb.h"
+#include "mcp.h"
+
+void firmware_main();
+
+// The harness talks to the firmware with the structures of gs_usb.h built
+// without -fpack-struct, these have no padding anyway
+_Static_assert(sizeof(gs_host_frame) == 24, "gs_host_frame layout");
+_Static_assert(GS_HOST_FRAME_SIZE == 20, "gs_host_frame layout");
+_Static_assert(sizeof(gs_device_bittiming) == 20, "gs_device_bittiming layout");
+_Static_assert(sizeof(gs_device_filter) == 32, "gs_device_filter layout");
+_Static_assert(sizeof(gs_device_stats) == 36, "gs_device_stats layout");
+_Static_assert(sizeof(gs_device_state) == 12, "gs_device_state layout");
+_Static_assert(sizeof(gs_device_restart) == 8, "gs_device_restart layout");
+_Static_assert(sizeof(gs_device_cyclic) == 24, "gs_device_cyclic layout");
+_Static_assert(sizeof(gs_device_isotp) == 16, "gs_device_isotp layout");
+_Static_assert(sizeof(gs_device_bus_stats) == 212, "gs_device_bus_stats layout");
+_Static_assert(sizeof(gs_device_autobaud) == 28, "gs_device_autobaud layout");
+
+static int failures;
+
+/* Reporting */
+
+static int check(int ok, const char* scenario, const char* what) {
+	if(!ok) {
+		printf("  %s: %s\n", scenario, what);
+	}
+	return ok;
+}
+
+static void result(const char* scenario, int ok, const char* metrics) {
+	printf("%-12s %s  %s\n", scenario, ok ? "PASS" : "FAIL", metrics);
+	if(!ok) {
+		failures++;
+	}
+}
+
+double per_second(uint32_t n, uint64_t cycles) {
+	return cycles ? (double)n * SIM_F_CPU / cycles : 0.0;
+}
+
+/* The gs_usb host side */
+
+int vendor_out(uint8_t request, uint16_t value, void* data, uint16_t len) {
+	return sim_host_control(0x41, request, value, 0, data, len) >= 0;
+}
+
+int enumerate() {
+	uint8_t desc[64];
+	sim_host_attach();
+	if(sim_host_control(0x00, 5, 1, 0, 0, 0) < 0) {
+		return 0;
+	}
+	if(sim_host_control(0x80, 6, 0x0100, 0, desc, 18) != 18 || desc[1] != 1) {
+		return 0;
+	}
+	if(sim_host_control(0x80, 6, 0x0200, 0, desc, 32) != 32 || desc[4] != 1) {
+		return 0;
+	}
+	if(sim_host_control(0x00, 9, 1, 0, 0, 0) < 0) {
+		return 0;
+	}
+	return sim_host_configured();
+}
+
+int gs_start(uint32_t flags, uint32_t bit_cycles) {
+	gs_host_config hc = { .byte_order = 0x0000beef };
+	// 8 time quanta or the next count that divides the bit time in periods of
+	// the fclk_can the device reports, 1Mbit/s is brp 1 with 16MHz
+	uint32_t quanta = (uint64_t)bit_cycles * MCP_FCLK_CAN / SIM_F_CPU;
+	uint32_t tq = 8;
+	while(quanta % tq) {
+		tq++;
+	}
+	gs_device_bittiming bt = { .prop_seg = tq - 6, .phase_seg1 = 3, .phase_seg2 = 2, .sjw = 1, .brp = quanta / tq };
+	gs_device_mode m = { .mode = GS_CAN_MODE_START, .flags = flags };
+	int ok = vendor_out(GS_USB_BREQ_HOST_FORMAT, 1, &hc, sizeof(hc))
+		&& vendor_out(GS_USB_BREQ_BITTIMING, 0, &bt, sizeof(bt))
+		&& vendor_out(GS_USB_BREQ_MODE, 0, &m, sizeof(m));
+	// Let the firmware set up the MCP before anything comes in
+	sim_wait(SIM_CYCLES_MS(2));
+	return ok;
+}
+
+int gs_stop() {
+	gs_device_mode m = { .mode = GS_CAN_MODE_RESET, .flags = 0 };
+	int ok = vendor_out(GS_USB_BREQ_MODE, 0, &m, sizeof(m));
+	sim_wait(SIM_CYCLES_MS(2));
+	gs_host_frame hf;
+	while(sim_host_in(&hf) >= 0);
+	sim_host_in_pause(0);
+	sim_bus_reset(sim_bus.bit_cycles);
+	return ok;
+}
+
+/* Frames from the device collected until nothing came for quiet_ms */
+
+gs_host_frame got[MAX_GOT];
+uint64_t got_time[MAX_GOT];
+int got_len[MAX_GOT];
+int n_got;
+
+void collect(uint32_t quiet_ms) {
+	uint64_t last = sim_cycles;
+	n_got = 0;
+	while(sim_cycles - last < SIM_CYCLES_MS(quiet_ms)) {
+		if(sim_bus_pending()) {
+			last = sim_cycles;
+		}
+		gs_host_frame hf;
+		int len = sim_host_in(&hf);
+		if(len < 0) {
+			sim_wait(SIM_CYCLES_US(20));
+			continue;
+		}
+		last = sim_cycles;
+		if(n_got < MAX_GOT) {
+			got[n_got] = hf;
+			got_time[n_got] = sim_cycles;
+			got_len[n_got] = len;
+			n_got++;
+		}
+	}
+}
+
+sim_can_frame std_frame(uint32_t id, uint32_t seq) {
+	sim_can_frame f = { .id = id, .ext = 0, .rtr = 0, .dlc = 8 };
+	memcpy(f.data, &seq, 4);
+	return f;
+}
+
+uint32_t seq_of(const uint8_t* data) {
+	uint32_t seq;
+	memcpy(&seq, data, 4);
+	return seq;
+}
+
+/* Scenarios */
+
+static void scenario_enumerate() {
+	result("enumerate", enumerate(), "");
+}
+
+/* The bit timing Linux works out from the limits the device reports, like
+   can_calc_bittiming of drivers/net/can/dev/calc_bittiming.c does: the
+   nominal sample point for the rate, the smallest rate error first and
+   then the smallest sample point error (at or below the nominal one). */
+
+static uint32_t sample_point_for(const gs_device_bt_const* btc, uint32_t nominal, uint32_t tseg, uint32_t* tseg1_out, uint32_t* tseg2_out, uint32_t* error_out) {
+	uint32_t best = 0, best_error = UINT32_MAX;
+	for(int i=0; i<=1; i++) {
+		int32_t tseg2 = tseg + 1 - (nominal * (tseg + 1)) / 1000 - i;
+		if(tseg2 < (int32_t)btc->tseg2_min) {
+			tseg2 = btc->tseg2_min;
+		} else if(tseg2 > (int32_t)btc->tseg2_max) {
+			tseg2 = btc->tseg2_max;
+		}
+		int32_t tseg1 = tseg - tseg2;
+		if(tseg1 > (int32_t)btc->tseg1_max) {
+			tseg1 = btc->tseg1_max;
+			tseg2 = tseg - tseg1;
+		}
+		uint32_t sp = 1000 * (tseg + 1 - tseg2) / (tseg + 1);
+		uint32_t error = nominal > sp ? nominal - sp : sp - nominal;
+		if(sp <= nominal && error < best_error) {
+			best = sp;
+			best_error = error;
+			*tseg1_out = tseg1;
+			*tseg2_out = tseg2;
+		}
+	}
+	if(error_out) {
+		*error_out = best_error;
+	}
+	return best;
+}
+
+static int calc_bittiming(const gs_device_bt_const* btc, uint32_t bitrate, gs_device_bittiming* bt) {
+	uint32_t nominal = bitrate > 800000 ? 750 : bitrate > 500000 ? 800 : 875;
+	uint32_t best_rate_error = UINT32_MAX, best_sp_error = UINT32_MAX, best_tseg = 0, best_brp = 0;
+	uint32_t tseg1 = 0, tseg2 = 0;
+	for(uint32_t tseg = (btc->tseg1_max + btc->tseg2_max) * 2 + 1; tseg >= (btc->tseg1_min + btc->tseg2_min) * 2; tseg--) {
+		uint32_t all = 1 + tseg / 2;
+		uint32_t brp = btc->fclk_can / (all * bitrate) + tseg % 2;
+		brp = brp / btc->brp_inc * btc->brp_inc;
+		if(brp < btc->brp_min || brp > btc->brp_max) {
+			continue;
+		}
+		uint32_t rate = btc->fclk_can / (brp * all);
+		uint32_t rate_error = rate > bitrate ? rate - bitrate : bitrate - rate;
+		if(rate_error > best_rate_error) {
+			continue;
+		}
+		if(rate_error < best_rate_error) {
+			best_sp_error = UINT32_MAX;
+		}
+		uint32_t sp_error;
+		sample_point_for(btc, nominal, tseg / 2, &tseg1, &tseg2, &sp_error);
+		if(sp_error >= best_sp_error) {
+			continue;
+		}
+		best_sp_error = sp_error;
+		best_rate_error = rate_error;
+		best_tseg = tseg / 2;
+		best_brp = brp;
+		if(!rate_error && !sp_error) {
+			break;
+		}
+	}
+	// More than 5% off is refused
+	if(!best_brp || (uint64_t)best_rate_error * 1000 / bitrate > 50) {
+		return 0;
+	}
+	sample_point_for(btc, nominal, best_tseg, &tseg1, &tseg2, 0);
+	bt->prop_seg = tseg1 / 2;
+	bt->phase_seg1 = tseg1 - bt->prop_seg;
+	bt->phase_seg2 = tseg2;
+	bt->sjw = 1;
+	bt->brp = best_brp;
+	return 1;
+}
+
+/* Every standard rate set up the way Linux would ends up in the CNF
+   registers with the bit time of the rate, with the 16MHz MCP2515 exactly
+   as below: the sample point CiA 301 recommends (87.5% up to 500kbit/s).
+   A slower MCP_CLOCK leaves out the rates under 5 time quanta. */
+
+static const struct {
+	uint32_t bitrate;
+	uint8_t cnf[3];
+} bittiming_table[] = {
+	{ 1000000, { 0x00, 0x91, 0x81 } },
+	{ 800000, { 0x00, 0x9A, 0x81 } },
+	{ 500000, { 0x00, 0xB5, 0x81 } },
+	{ 250000, { 0x01, 0xB5, 0x81 } },
+	{ 125000, { 0x03, 0xB5, 0x81 } },
+	{ 100000, { 0x04, 0xB5, 0x81 } },
+	{ 83333, { 0x05, 0xB5, 0x81 } },
+	{ 50000, { 0x09, 0xB5, 0x81 } },
+	{ 33333, { 0x0E, 0xB5, 0x81 } },
+	{ 20000, { 0x18, 0xB5, 0x81 } },
+	{ 10000, { 0x31, 0xB5, 0x81 } }
+};
+
+static void scenario_bittiming() {
+	const char* s = "bittiming";
+	gs_device_bt_const btc;
+	int ok = check(sim_host_control(0xC1, GS_USB_BREQ_BT_CONST, 0, 0, &btc, sizeof(btc)) == sizeof(btc), s, "bt const request");
+	uint32_t worst = 1000, exact = 0;
+	for(size_t i=0; i<sizeof(bittiming_table) / sizeof(bittiming_table[0]); i++) {
+		uint32_t rate = bittiming_table[i].bitrate;
+		gs_device_bittiming bt;
+		gs_device_mode m = { .mode = GS_CAN_MODE_START, .flags = GS_CAN_MODE_NORMAL };
+		int reach = rate * (1 + MCP_TSEG1_MIN + MCP_TSEG2_MIN) <= MCP_FCLK_CAN;
+		ok &= check(calc_bittiming(&btc, rate, &bt) == reach, s, reach ? "rate out of reach" : "rate taken out of reach");
+		if(!reach) {
+			continue;
+		}
+		ok &= check(vendor_out(GS_USB_BREQ_BITTIMING, 0, &bt, sizeof(bt)) && vendor_out(GS_USB_BREQ_MODE, 0, &m, sizeof(m)), s, "start");
+		sim_wait(SIM_CYCLES_MS(2));
+		uint8_t cnf[3] = { sim_mcp_register(MCP_CNF1), sim_mcp_register(MCP_CNF2), sim_mcp_register(MCP_CNF3) };
+		ok &= check(MCP_CLOCK != 16000000UL || !memcmp(cnf, bittiming_table[i].cnf, 3), s, "CNF registers differ");
+		// Bit time in MCP clock periods against the rate, and the sample point
+		uint32_t brp = (cnf[0] & 0x3F) + 1;
+		uint32_t tq = 1 + (cnf[1] & 0x07) + 1 + ((cnf[1] >> 3) & 0x07) + 1 + (cnf[2] & 0x07) + 1;
+		// Exact where it is a whole number of time quanta, else within 5%
+		uint32_t clocks = (MCP_CLOCK + rate / 2) / rate;
+		if(clocks % 2) {
+			ok &= check(2 * brp * tq * 20 > clocks * 19 && 2 * brp * tq * 20 < clocks * 21, s, "bit time off");
+		} else {
+			ok &= check(2 * brp * tq == clocks, s, "bit time off");
+			exact++;
+		}
+		uint32_t sp = 1000 * (tq - (cnf[2] & 0x07) - 1) / tq;
+		if(sp < worst) {
+			worst = sp;
+		}
+		ok &= check(gs_stop(), s, "stop");
+	}
+	char m[160];
+	snprintf(m, sizeof(m), "%u rates exact, sample points down to %.1f%%", exact, worst / 10.0);
+	result(s, ok, m);
+}
+
+/* Back to back 8 byte standard frames at 1Mbit/s: every frame either makes
+   it to the host in bus order, or its loss is reported to the host */
+static void scenario_rx_burst() {
+	const char* s = "rx_burst";
+	const uint32_t n = 2000;
+	int ok = check(gs_start(GS_CAN_MODE_NORMAL, BIT_CYCLES_1M), s, "start");
+	uint64_t t0 = sim_cycles;
+	uint32_t packets = sim_usb_in_packets;
+	for(uint32_t i=0; i<n; i++) {
+		sim_can_frame f = std_frame(i & CAN_SFF_MASK, i);
+		sim_bus_send(&f, t0);
+	}
+	collect(5);
+	// A gap in the sequence needs the overflow flag on the frame after it or
+	// an error frame reporting the overflow before it
+	uint32_t rx = 0, next = 0, order = 1, unreported = 0, reported = 0;
+	uint64_t last = t0;
+	for(int i=0; i<n_got; i++) {
+		if(got[i].can_id & CAN_ERR_FLAG) {
+			reported |= (got[i].data[1] & CAN_ERR_CRTL_RX_OVERFLOW) != 0;
+			continue;
+		}
+		uint32_t seq = seq_of(got[i].data);
+		if(seq < next || got[i].can_id != (seq & CAN_SFF_MASK)) {
+			order = 0;
+		}
+		if(seq > next && !reported && !(got[i].flags & GS_CAN_FLAG_OVERFLOW)) {
+			unreported += seq - next;
+		}
+		reported = 0;
+		next = seq + 1;
+		rx++;
+		last = got_time[i];
+	}
+	ok &= check(order, s, "frames out of order or mangled");
+	ok &= check(!unreported, s, "frames lost without an overflow report");
+	char m[160];
+	snprintf(m, sizeof(m), "%u/%u frames, %.0f frames/s, %.2f IN transfers per frame, RXnOVR %u/%u, buffer read in %.0f units",
+		rx, n, per_second(rx, last - t0), rx ? (double)(sim_usb_in_packets - packets) / rx : 0.0, sim_bus.n_rx0ovr, sim_bus.n_rx1ovr,
+		sim_bus.n_rx_reads ? (double)sim_bus.rx_read_cycles / sim_bus.n_rx_reads : 0.0);
+	ok &= check(gs_stop(), s, "stop");
+	result(s, ok, m);
+}
+
+/* Back to back frames without data at 1Mbit/s, the shortest time to read
+   RXB0 before the next frame is in, while the host keeps HOST_TX_URBS frames
+   in flight and reads the bus statistics every 5ms like "gs_usb_stats -b"
+   (the 212 bytes go out from the USB_COM routine and hold off the MCP
+   interrupt). Run with the rollover into RXB1 the firmware sets up, and with
+   it turned off again, and with the hardware filters dropping every fourth
+   frame. The frames that make it have to be in bus order, the id counts up.
+   Returns the frames that did not reach the host. */
+static uint32_t rollover_run(const char* s, int* ok, int bukt, int filtered, uint32_t* rx0ovr, uint32_t* rx1ovr) {
+	const uint32_t n = 2000;
+	sim_bus_reset(BIT_CYCLES_1M);
+	gs_device_filter filter = { .mask = { 0 } };
+	if(filtered) {
+		filter = (gs_device_filter){
+			.mask = { 0x700, 0x700 },
+			.filter = { 0x200, 0x200, 0x200, 0x200, 0x200, 0x200 }
+		};
+	}
+	*ok &= check(vendor_out(GS_USB_BREQ_HW_FILTER, 0, &filter, sizeof(filter)), s, "filter request");
+	*ok &= check(gs_start(GS_CAN_MODE_NORMAL, BIT_CYCLES_1M), s, "start");
+	if(!bukt) {
+		sim_mcp_set_register(MCP_RXB0CTRL, sim_mcp_register(MCP_RXB0CTRL) & ~MCP_RXB_BUKT_MASK);
+	}
+	uint64_t t0 = sim_cycles;
+	for(uint32_t i=0; i<n; i++) {
+		sim_can_frame f = { .id = 0x200 + (i & 0xFF), .dlc = 0 };
+		sim_bus_send(&f, t0);
+		if(filtered && (i & 3) == 3) {
+			f.id = 0x300;
+			sim_bus_send(&f, t0);
+		}
+	}
+	uint32_t sent = 0, echoed = 0, rx = 0, prev = 0, order = 1;
+	uint64_t last = t0, poll = t0;
+	while(sim_cycles - last < SIM_CYCLES_MS(5)) {
+		if(sim_bus_pending() && sim_cycles >= poll) {
+			gs_device_bus_stats st;
+			*ok &= check(sim_host_control(0xC1, GS_USB_BREQ_BUS_STATS, GS_STATS_READ, 0, &st, sizeof(st)) == sizeof(st), s, "bus stats request");
+			poll += SIM_CYCLES_MS(5);
+			continue;
+		}
+		if(sent < n && sent - echoed < HOST_TX_URBS) {
+			gs_host_frame hf = { .echo_id = sent % HOST_TX_URBS, .can_id = 0x100, .can_dlc = sent % 9 };
+			sim_host_out(&hf, GS_HOST_FRAME_SIZE);
+			sent++;
+			continue;
+		}
+		gs_host_frame hf;
+		if(sim_host_in(&hf) < 0) {
+			sim_wait(SIM_CYCLES_US(20));
+			continue;
+		}
+		if(hf.echo_id == ECHO_RX) {
+			if(!(hf.can_id & CAN_ERR_FLAG)) {
+				// Lost frames leave a gap, an older one coming late
+				// shows as a step back
+				uint8_t step = hf.can_id - prev;
+				order &= (hf.can_id & ~0xFF) == 0x200 && (!rx || (step && step < 0x80));
+				prev = hf.can_id;
+				rx++;
+			}
+		} else {
+			echoed++;
+		}
+		last = sim_cycles;
+	}
+	*ok &= check(echoed == n, s, "echoes missing");
+	*ok &= check(order, s, "frames out of order");
+	*rx0ovr = sim_bus.n_rx0ovr;
+	*rx1ovr = sim_bus.n_rx1ovr;
+	*ok &= check(gs_stop(), s, "stop");
+	return n - rx;
+}
+
+static void scenario_rollover() {
+	const char* s = "rollover";
+	int ok = 1;
+	uint32_t on0, on1, off0, off1, f0, f1;
+	uint32_t lost_on = rollover_run(s, &ok, 1, 0, &on0, &on1);
+	uint32_t lost_off = rollover_run(s, &ok, 0, 0, &off0, &off1);
+	uint32_t lost_filtered = rollover_run(s, &ok, 1, 1, &f0, &f1);
+	ok &= check(lost_on <= lost_off, s, "more frames lost with the rollover");
+	gs_device_filter filter = { .mask = { 0 } };
+	ok &= check(vendor_out(GS_USB_BREQ_HW_FILTER, 0, &filter, sizeof(filter)), s, "filter request");
+	sim_bus_reset(BIT_CYCLES_1M);
+	char m[200];
+	snprintf(m, sizeof(m), "RXnOVR %u/%u with %u frames lost, %u/%u with %u lost without it, %u/%u with %u lost filtered",
+		on0, on1, lost_on, off0, off1, lost_off, f0, f1, lost_filtered);
+	result(s, ok, m);
+}
+
+/* The host keeps HOST_TX_URBS frames in flight like the Linux driver does,
+   the frames have to go on the bus in the order sent and come back as echoes
+   in the same order */
+static void scenario_tx_burst() {
+	const char* s = "tx_burst";
+	const uint32_t n = 2000;
+	int ok = check(gs_start(GS_CAN_MODE_NORMAL, BIT_CYCLES_1M), s, "start");
+	uint32_t sent = 0, echoed = 0, order = 1;
+	uint64_t t0 = sim_cycles, last = t0;
+	while(echoed < n && sim_cycles - last < SIM_CYCLES_MS(50)) {
+		if(sent < n && sent - echoed < HOST_TX_URBS) {
+			gs_host_frame hf = { .echo_id = sent % HOST_TX_URBS, .can_id = 0x100 + (sent & 0xFF), .can_dlc = 8 };
+			memcpy(hf.data, &sent, 4);
+			sim_host_out(&hf, GS_HOST_FRAME_SIZE);
+			sent++;
+			continue;
+		}
+		gs_host_frame hf;
+		if(sim_host_in(&hf) < 0) {
+			sim_wait(SIM_CYCLES_US(20));
+			continue;
+		}
+		if(hf.echo_id == ECHO_RX) {
+			continue;
+		}
+		if(hf.echo_id != echoed % HOST_TX_URBS || seq_of(hf.data) != echoed) {
+			order = 0;
+		}
+		echoed++;
+		last = sim_cycles;
+	}
+	ok &= check(echoed == n, s, "echoes missing");
+	ok &= check(order, s, "echoes out of order");
+	ok &= check(sim_bus.n_sent == n, s, "frames missing on the bus");
+	for(uint32_t i=0; i<sim_bus.n_sent && i<SIM_BUS_LOG_SIZE; i++) {
+		if(seq_of(sim_bus.sent[i].frame.data) != i || sim_bus.sent[i].frame.id != 0x100 + (i & 0xFF)) {
+			ok &= check(0, s, "frames out of order on the bus");
+			break;
+		}
+	}
+	uint64_t bus_time = sim_bus.n_sent ? sim_bus.sent[sim_bus.n_sent - 1].time - t0 : 0;
+	// A zero length packet is dropped, it neither holds up the frame
+	// behind it nor keeps raising the endpoint interrupt
+	uint32_t com = sim_vectors[SIM_VECT_USB_COM].count;
+	gs_host_frame hf = { .echo_id = 0, .can_id = 0x123, .can_dlc = 0 };
+	sim_host_out(&hf, 0);
+	sim_host_out(&hf, GS_HOST_FRAME_SIZE);
+	collect(2);
+	ok &= check(sim_bus.n_sent == n + 1, s, "frame behind a zero length packet not sent");
+	ok &= check(sim_vectors[SIM_VECT_USB_COM].count - com < 10, s, "zero length packet not released");
+	ok &= check(gs_stop(), s, "stop");
+	char m[160];
+	snprintf(m, sizeof(m), "%u/%u echoes, %.0f frames/s on the bus", echoed, n, per_second(n, bus_time));
+	result(s, ok, m);
+}
+
+/* The host stops reading, the frames that do not fit in the device are
+   dropped and the next one delivered carries the overflow flag */
+static void scenario_host_stall() {
+	const char* s = "host_stall";
+	const uint32_t n = 100;
+	int ok = check(gs_start(GS_CAN_MODE_NORMAL, BIT_CYCLES_1M), s, "start");
+	sim_host_in_pause(1);
+	for(uint32_t i=0; i<n; i++) {
+		sim_can_frame f = std_frame(0x55, i);
+		sim_bus_send(&f, sim_cycles);
+	}
+	while(sim_bus_pending()) {
+		sim_wait(SIM_CYCLES_MS(1));
+	}
+	sim_host_in_pause(0);
+	// One more frame after the stall, it has to come with the flag
+	sim_can_frame f = std_frame(0x55, n);
+	sim_bus_send(&f, sim_cycles + SIM_CYCLES_MS(1));
+	collect(5);
+	int flagged = 0, order = 1;
+	uint32_t next = 0;
+	for(int i=0; i<n_got; i++) {
+		if(got[i].can_id & CAN_ERR_FLAG) {
+			continue;
+		}
+		uint32_t seq = seq_of(got[i].data);
+		if(seq < next) {
+			order = 0;
+		}
+		if(got[i].flags & GS_CAN_FLAG_OVERFLOW) {
+			flagged = 1;
+			ok &= check(seq > next, s, "overflow flag on a frame without a loss before it");
+		}
+		next = seq + 1;
+	}
+	ok &= check(order, s, "frames out of order");
+	ok &= check(flagged, s, "no overflow flag after the stall");
+	ok &= check(next == n + 1, s, "frame after the stall missing");
+	ok &= check(gs_stop(), s, "stop");
+	char m[160];
+	snprintf(m, sizeof(m), "%d/%u frames delivered", n_got, n + 1);
+	result(s, ok, m);
+}
+
+static void scenario_loopback() {
+	const char* s = "loopback";
+	const uint32_t n = 500;
+	int ok = check(gs_start(GS_CAN_MODE_LOOP_BACK, BIT_CYCLES_1M), s, "start");
+	// Pipelined like tx_burst, every frame comes back as an echo and received
+	uint32_t sent = 0, echoes = 0, rx = 0, order = 1;
+	uint64_t t0 = sim_cycles, last = t0;
+	while((echoes < n || rx < n) && sim_cycles - last < SIM_CYCLES_MS(50)) {
+		if(sent < n && sent - echoes < HOST_TX_URBS) {
+			gs_host_frame hf = { .echo_id = sent % HOST_TX_URBS, .can_id = CAN_EFF_FLAG | (0x1000 + sent), .can_dlc = 4 };
+			memcpy(hf.data, &sent, 4);
+			sim_host_out(&hf, GS_HOST_FRAME_SIZE);
+			sent++;
+			continue;
+		}
+		gs_host_frame hf;
+		if(sim_host_in(&hf) < 0) {
+			sim_wait(SIM_CYCLES_US(20));
+			continue;
+		}
+		last = sim_cycles;
+		if(hf.echo_id == ECHO_RX) {
+			order &= seq_of(hf.data) == rx && hf.can_id == (CAN_EFF_FLAG | (0x1000 + rx));
+			rx++;
+		} else {
+			order &= seq_of(hf.data) == echoes && hf.echo_id == echoes % HOST_TX_URBS;
+			echoes++;
+		}
+	}
+	ok &= check(echoes == n, s, "echoes missing");
+	ok &= check(rx == n, s, "looped back frames missing");
+	ok &= check(order, s, "frames out of order");
+	ok &= check(gs_stop(), s, "stop");
+	char m[160];
+	snprintf(m, sizeof(m), "%u echoes, %u received of %u, %.0f frames/s", echoes, rx, n, per_second(rx, last - t0));
+	result(s, ok, m);
+}
+
+static void scenario_hw_filter() {
+	const char* s = "hw_filter";
+	// RXB1 taking frames that RXB0 does not, by its filters or by a
+	// narrower mask, would break the receive order
+	gs_device_filter filter = {
+		.mask = { CAN_SFF_MASK, CAN_EFF_FLAG | CAN_EFF_MASK },
+		.filter = { 0x100, 0x101, CAN_EFF_FLAG | 0x12345, 0x7FF, 0x7FF, 0x7FF }
+	};
+	int ok = check(!vendor_out(GS_USB_BREQ_HW_FILTER, 0, &filter, sizeof(filter)), s, "RXB1 only filter taken");
+	filter = (gs_device_filter){
+		.mask = { CAN_SFF_MASK, 0x700 },
+		.filter = { 0x100, 0x101, 0x100, 0x100, 0x100, 0x100 }
+	};
+	ok &= check(!vendor_out(GS_USB_BREQ_HW_FILTER, 0, &filter, sizeof(filter)), s, "RXB1 only mask taken");
+	filter = (gs_device_filter){
+		.mask = { CAN_SFF_MASK, CAN_SFF_MASK },
+		.filter = { 0x100, 0x101, 0x101, 0x100, 0x100, 0x100 }
+	};
+	ok &= check(vendor_out(GS_USB_BREQ_HW_FILTER, 0, &filter, sizeof(filter)), s, "filter request");
+	ok &= check(gs_start(GS_CAN_MODE_NORMAL, BIT_CYCLES_1M), s, "start");
+	uint32_t ids[] = { 0x0FF, 0x100, 0x101, 0x102, 0x12345, 0x12346 };
+	uint8_t ext[] = { 0, 0, 0, 0, 1, 1 };
+	for(uint32_t i=0; i<sizeof(ids) / sizeof(ids[0]); i++) {
+		sim_can_frame f = std_frame(ids[i], i);
+		f.ext = ext[i];
+		sim_bus_send(&f, sim_cycles);
+	}
+	collect(2);
+	uint32_t expected[] = { 0x100, 0x101 };
+	ok &= check(n_got == 2, s, "wrong number of frames passed");
+	for(int i=0; i<n_got && i<2; i++) {
+		ok &= check(got[i].can_id == expected[i], s, "wrong frame passed");
+	}
+	ok &= check(gs_stop(), s, "stop");
+	memset(&filter, 0, sizeof(filter));
+	ok &= check(vendor_out(GS_USB_BREQ_HW_FILTER, 0, &filter, sizeof(filter)), s, "filter request");
+	char m[160];
+	snprintf(m, sizeof(m), "%d/6 frames passed", n_got);
+	result(s, ok, m);
+}
+
+static void scenario_sw_filter() {
+	const char* s = "sw_filter";
+	uint32_t ids[] = { 0x123, CAN_EFF_FLAG | 0x1ABCDEF };
+	int ok = check(vendor_out(GS_USB_BREQ_SW_FILTER, GS_SW_FILTER_CLEAR, 0, 0), s, "clear request");
+	ok &= check(vendor_out(GS_USB_BREQ_SW_FILTER, GS_SW_FILTER_ADD, ids, sizeof(ids)), s, "add request");
+	ok &= check(gs_start(GS_CAN_MODE_NORMAL, BIT_CYCLES_1M), s, "start");
+	for(uint32_t i=0; i<64; i++) {
+		sim_can_frame f = std_frame(0x100 + i, i);
+		sim_bus_send(&f, sim_cycles);
+		if(i == 40) {
+			f.ext = 1;
+			f.id = 0x1ABCDEF;
+			sim_bus_send(&f, sim_cycles);
+		}
+	}
+	collect(2);
+	ok &= check(n_got == 2, s, "wrong number of frames passed");
+	ok &= check(n_got < 1 || got[0].can_id == 0x123, s, "wrong frame passed");
+	ok &= check(n_got < 2 || got[1].can_id == ids[1], s, "wrong frame passed");
+	ok &= check(gs_stop(), s, "stop");
+	int passed = n_got;
+	// The UDS ids of 16 ECUs, requests 0x18DAxxF1 and responses 0x18DAF1xx,
+	// all 32 fit and a 33rd does not
+	static const uint8_t ecus[16] = { 0x01, 0x07, 0x10, 0x11, 0x17, 0x18, 0x19, 0x1A, 0x28, 0x29, 0x40, 0x58, 0x60, 0x61, 0x76, 0x7A };
+	uint32_t uds[32];
+	for(int i=0; i<16; i++) {
+		uds[2 * i] = CAN_EFF_FLAG | 0x18DA00F1 | (ecus[i] << 8);
+		uds[2 * i + 1] = CAN_EFF_FLAG | 0x18DAF100 | ecus[i];
+	}
+	ok &= check(vendor_out(GS_USB_BREQ_SW_FILTER, GS_SW_FILTER_CLEAR, 0, 0), s, "clear request");
+	ok &= check(vendor_out(GS_USB_BREQ_SW_FILTER, GS_SW_FILTER_ADD, uds, 16 * sizeof(uint32_t)), s, "UDS ids refused");
+	ok &= check(vendor_out(GS_USB_BREQ_SW_FILTER, GS_SW_FILTER_ADD, uds + 16, 16 * sizeof(uint32_t)), s, "UDS ids refused");
+	uint32_t more = CAN_EFF_FLAG | 0x18DB33F1;
+	ok &= check(!vendor_out(GS_USB_BREQ_SW_FILTER, GS_SW_FILTER_ADD, &more, sizeof(more)), s, "33rd id taken");
+	ok &= check(gs_start(GS_CAN_MODE_NORMAL, BIT_CYCLES_1M), s, "start");
+	for(uint32_t i=0; i<256; i++) {
+		sim_can_frame f = std_frame(0, i);
+		f.ext = 1;
+		f.id = (i & 1) ? 0x18DAF100 | (i >> 1) : 0x18DA00F1 | ((i >> 1) << 8);
+		sim_bus_send(&f, sim_cycles);
+	}
+	collect(5);
+	int uds_ok = n_got == 32;
+	for(int i=0; i<n_got && i<32; i++) {
+		uds_ok &= memchr(ecus, ((got[i].can_id >> 8) & 0xFF) == 0xF1 ? got[i].can_id & 0xFF : (got[i].can_id >> 8) & 0xFF, 16) != 0;
+	}
+	ok &= check(uds_ok, s, "wrong UDS frames passed");
+	ok &= check(gs_stop(), s, "stop");
+	ok &= check(vendor_out(GS_USB_BREQ_SW_FILTER, GS_SW_FILTER_CLEAR, 0, 0), s, "clear request");
+	char m[160];
+	snprintf(m, sizeof(m), "%d/65 frames passed, %d/256 of 16 ECUs with 32 UDS ids", passed, n_got);
+	result(s, ok, m);
+}
+
+/* Remote frames, standard ones are flagged differently than the extended
+   ones in the MCP receive buffers */
+static void scenario_rtr() {
+	const char* s = "rtr";
+	int ok = check(gs_start(GS_CAN_MODE_NORMAL, BIT_CYCLES_1M), s, "start");
+	sim_can_frame f = { .id = 0x321, .ext = 0, .rtr = 1, .dlc = 2 };
+	sim_bus_send(&f, sim_cycles);
+	f.ext = 1;
+	f.id = 0x54321;
+	f.dlc = 3;
+	sim_bus_send(&f, sim_cycles);
+	f = std_frame(0x321, 0);
+	sim_bus_send(&f, sim_cycles);
+	collect(2);
+	ok &= check(n_got == 3, s, "frames missing");
+	ok &= check(n_got < 1 || (got[0].can_id == (CAN_RTR_FLAG | 0x321) && got[0].can_dlc == 2), s, "standard remote frame");
+	ok &= check(n_got < 2 || (got[1].can_id == (CAN_RTR_FLAG | CAN_EFF_FLAG | 0x54321) && got[1].can_dlc == 3), s, "extended remote frame");
+	ok &= check(n_got < 3 || got[2].can_id == 0x321, s, "standard data frame");
+	ok &= check(gs_stop(), s, "stop");
+	result(s, ok, "");
+}
+
+static void scenario_timestamp() {
+	const char* s = "timestamp";
+	int ok = check(gs_start(GS_CAN_MODE_HW_TIMESTAMP, BIT_CYCLES_1M), s, "start");
+	for(uint32_t i=0; i<4; i++) {
+		sim_can_frame f = std_frame(0x42, i);
+		sim_bus_send(&f, sim_cycles + SIM_CYCLES_MS(5 * i));
+	}
+	collect(2);
+	ok &= check(n_got == 4, s, "frames missing");
+	int32_t worst = 0;
+	for(int i=0; i<n_got; i++) {
+		ok &= check(got_len[i] == GS_HOST_FRAME_SIZE_TS, s, "frame without the time stamp");
+		if(i) {
+			int32_t d = (int32_t)(got[i].timestamp_us - got[i - 1].timestamp_us) - 5000;
+			if(d < 0) {
+				d = -d;
+			}
+			if(d > worst) {
+				worst = d;
+			}
+		}
+	}
+	ok &= check(worst < 50, s, "time stamps off");
+	ok &= check(gs_stop(), s, "stop");
+	char m[160];
+	snprintf(m, sizeof(m), "worst deviation %dus", worst);
+	result(s, ok, m);
+}
+
+/* Every transmission is destroyed, the device goes bus off, reports it and
+   sends the frame after the recovery */
+static void scenario_stats() {
+	const char* s = "stats";
+	gs_device_stats st;
+	int ok = check(sim_host_control(0xC1, GS_USB_BREQ_STATS, GS_STATS_READ_CLEAR, 0, &st, sizeof(st)) == sizeof(st), s, "clear request");
+	ok &= check(gs_start(GS_CAN_MODE_NORMAL, BIT_CYCLES_1M), s, "start");
+	for(uint32_t i=0; i<20; i++) {
+		sim_can_frame f = std_frame(0x200, i);
+		sim_bus_send(&f, sim_cycles);
+	}
+	for(uint32_t i=0; i<10; i++) {
+		gs_host_frame hf = { .echo_id = i, .can_id = 0x300, .can_dlc = 8 };
+		sim_host_out(&hf, GS_HOST_FRAME_SIZE);
+	}
+	collect(2);
+	ok &= check(gs_stop(), s, "stop");
+	ok &= check(sim_host_control(0xC1, GS_USB_BREQ_STATS, GS_STATS_READ_CLEAR, 0, &st, sizeof(st)) == sizeof(st), s, "stats request");
+	ok &= check(st.rx_frames == 20 && st.rx_dropped == 0, s, "received frames miscounted");
+	ok &= check(st.tx_frames == 10 && st.echo_frames == 10, s, "sent frames miscounted");
+	ok &= check(st.isr_max_ticks > 0 && st.host_ring_peak > 0, s, "high water marks not kept");
+	gs_device_stats cleared;
+	ok &= check(sim_host_control(0xC1, GS_USB_BREQ_STATS, GS_STATS_READ, 0, &cleared, sizeof(cleared)) == sizeof(cleared), s, "stats request");
+	ok &= check(!cleared.rx_frames && !cleared.tx_frames && !cleared.isr_max_ticks, s, "counters not cleared");
+	char m[160];
+	snprintf(m, sizeof(m), "INT6 up to %uus, ring peak %u", st.isr_max_ticks / 2, st.host_ring_peak);
+	result(s, ok, m);
+}
+
+static int get_state(gs_device_state* st) {
+	return sim_host_control(0xC1, GS_USB_BREQ_GET_STATE, 0, 0, st, sizeof(*st)) == sizeof(*st);
+}
+
+static void scenario_error_state() {
+	const char* s = "error_state";
+	gs_device_state st;
+	int ok = check(get_state(&st) && st.state == GS_CAN_STATE_STOPPED, s, "state before start");
+	ok &= check(gs_start(GS_CAN_MODE_NORMAL, BIT_CYCLES_1M), s, "start");
+	ok &= check(get_state(&st) && st.state == GS_CAN_STATE_ERROR_ACTIVE && !st.txerr && !st.rxerr, s, "state after start");
+	// Without an acknowledge TEC stops at error passive
+	sim_bus.tx_fault = SIM_TX_NO_ACK;
+	gs_host_frame hf = { .echo_id = 0, .can_id = 0x78, .can_dlc = 1 };
+	sim_host_out(&hf, GS_HOST_FRAME_SIZE);
+	while(sim_bus.n_merr < 20) {
+		sim_wait(SIM_CYCLES_US(100));
+	}
+	ok &= check(get_state(&st) && st.state == GS_CAN_STATE_ERROR_PASSIVE && st.txerr == 128, s, "state while passive");
+	sim_bus.tx_fault = SIM_TX_OK;
+	collect(5);
+	int counted = 0, passive = 0;
+	for(int i=0; i<n_got; i++) {
+		if(got[i].can_id & CAN_ERR_FLAG) {
+			counted += (got[i].can_id & CAN_ERR_CNT) != 0;
+			passive |= (got[i].data[1] & CAN_ERR_CRTL_TX_PASSIVE) && got[i].data[6] == 128;
+		}
+	}
+	ok &= check(counted && passive, s, "error counters missing in the error frames");
+	ok &= check(get_state(&st) && st.txerr == 127, s, "counter after the recovery");
+	ok &= check(gs_stop(), s, "stop");
+	char m[160];
+	snprintf(m, sizeof(m), "%d error frames with counters", counted);
+	result(s, ok, m);
+}
+
+/* One frame into a bus off, cleared right after, with the device holding
+   the transmissions for 20ms. Returns the time of the bus off error frame,
+   the frames come in got and sent_at is when the frame made it to the bus
+   (0 if it did not). */
+static uint64_t bus_off_restart(const char* s, int* ok, uint32_t flags, uint64_t* sent_at) {
+	gs_device_restart restart = { .restart_ms = 20, .flags = flags };
+	*ok &= check(vendor_out(GS_USB_BREQ_RESTART, 0, &restart, sizeof(restart)), s, "restart request");
+	*ok &= check(gs_start(GS_CAN_MODE_NORMAL, BIT_CYCLES_1M), s, "start");
+	sim_bus.tx_fault = SIM_TX_BIT_ERROR;
+	gs_host_frame hf = { .echo_id = 0, .can_id = 0x79, .can_dlc = 1 };
+	sim_host_out(&hf, GS_HOST_FRAME_SIZE);
+	while(!sim_bus.n_busoff && sim_bus.n_merr < 100) {
+		sim_wait(SIM_CYCLES_US(100));
+	}
+	sim_bus.tx_fault = SIM_TX_OK;
+	collect(30);
+	*sent_at = sim_bus.n_sent ? sim_bus.sent[0].time : 0;
+	// The restart delay counts from the bus off, the report of it can reach
+	// the host later behind the error frames before it
+	uint64_t bus_off = sim_bus.busoff_time;
+	*ok &= check(sim_bus.n_sent <= 1, s, "frame sent more than once");
+	*ok &= check(gs_stop(), s, "stop");
+	restart.restart_ms = 0;
+	*ok &= check(vendor_out(GS_USB_BREQ_RESTART, 0, &restart, sizeof(restart)), s, "restart request");
+	for(int i=0; i<n_got; i++) {
+		if((got[i].can_id & CAN_ERR_FLAG) && (got[i].can_id & CAN_ERR_BUSOFF)) {
+			return bus_off;
+		}
+	}
+	*ok &= check(0, s, "bus off not reported");
+	return 0;
+}
+
+static void scenario_restart() {
+	const char* s = "restart";
+	int ok = 1;
+	// The frame stays loaded and goes out after the restart
+	uint64_t sent_at;
+	uint64_t t = bus_off_restart(s, &ok, 0, &sent_at);
+	int restarted = 0, echo = 0;
+	for(int i=0; i<n_got; i++) {
+		restarted |= got[i].can_id == (CAN_ERR_FLAG | CAN_ERR_RESTARTED) && got_time[i] >= t + SIM_CYCLES_MS(20);
+		echo |= got[i].echo_id == 0 && got[i].can_id == 0x79 && restarted;
+	}
+	ok &= check(restarted, s, "no restart reported after the delay");
+	ok &= check(echo && sent_at + HOST_IN_DELAY >= t + SIM_CYCLES_MS(20), s, "frame not sent after the restart");
+	uint32_t held = sent_at ? (sent_at - t) / SIM_CYCLES_US(1) : 0;
+	// Dropped, with its echo, but reported as dropped and not counted
+	gs_device_stats st;
+	gs_device_bus_stats bst;
+	ok &= check(sim_host_control(0xC1, GS_USB_BREQ_STATS, GS_STATS_READ_CLEAR, 0, &st, sizeof(st)) == sizeof(st), s, "clear request");
+	ok &= check(vendor_out(GS_USB_BREQ_BUS_STATS, GS_BUS_STATS_ON, 0, 0), s, "bus stats request");
+	t = bus_off_restart(s, &ok, GS_RESTART_FLUSH_TX, &sent_at);
+	restarted = echo = 0;
+	for(int i=0; i<n_got; i++) {
+		restarted |= got[i].can_id == (CAN_ERR_FLAG | CAN_ERR_RESTARTED | CAN_ERR_CTRL)
+			&& got[i].data[1] == CAN_ERR_CRTL_TX_OVERFLOW && got[i].data[5] == 1;
+		echo |= got[i].echo_id == 0 && got[i].can_id == 0x79;
+	}
+	ok &= check(restarted && echo, s, "no restart with the drop or no echo with the flush");
+	ok &= check(!sent_at, s, "flushed frame sent");
+	ok &= check(sim_host_control(0xC1, GS_USB_BREQ_STATS, GS_STATS_READ, 0, &st, sizeof(st)) == sizeof(st), s, "stats request");
+	ok &= check(sim_host_control(0xC1, GS_USB_BREQ_BUS_STATS, GS_STATS_READ, 0, &bst, sizeof(bst)) == sizeof(bst), s, "bus stats request");
+	ok &= check(!st.echo_frames && !bst.frames && !bst.bits, s, "flushed frame counted as sent");
+	ok &= check(vendor_out(GS_USB_BREQ_BUS_STATS, GS_BUS_STATS_OFF, 0, 0), s, "bus stats request");
+	char m[160];
+	snprintf(m, sizeof(m), "frame held for %uus", held);
+	result(s, ok, m);
+}
+
+static void scenario_bus_off() {
+	const char* s = "bus_off";
+	int ok = check(gs_start(GS_CAN_MODE_NORMAL, BIT_CYCLES_1M), s, "start");
+	sim_bus.tx_fault = SIM_TX_BIT_ERROR;
+	gs_host_frame hf = { .echo_id = 0, .can_id = 0x77, .can_dlc = 1 };
+	sim_host_out(&hf, GS_HOST_FRAME_SIZE);
+	while(!sim_bus.n_busoff && sim_bus.n_merr < 100) {
+		sim_wait(SIM_CYCLES_US(100));
+	}
+	sim_bus.tx_fault = SIM_TX_OK;
+	// The recovery takes 128 * 11 bits, 1.4ms at 1Mbit/s
+	collect(5 * BIT_SLOWER);
+	int bus_off = 0, echo = 0;
+	for(int i=0; i<n_got; i++) {
+		if((got[i].can_id & CAN_ERR_FLAG) && (got[i].can_id & CAN_ERR_BUSOFF)) {
+			bus_off = 1;
+		}
+		if(got[i].echo_id == 0 && got[i].can_id == 0x77) {
+			echo = 1;
+		}
+	}
+	ok &= check(sim_bus.n_busoff == 1, s, "no bus off in the model");
+	ok &= check(bus_off, s, "bus off not reported");
+	ok &= check(echo && sim_bus.n_sent == 1, s, "frame not sent after the recovery");
+	char m[160];
+	snprintf(m, sizeof(m), "%u failed transmissions", sim_bus.n_merr);
+	ok &= check(gs_stop(), s, "stop");
+	result(s, ok, m);
+}
+
+/* Frames the device sends by itself keep their period while the host keeps
+   all the transmit buffers busy, and are not echoed */
+static int set_cyclic(uint8_t slot, uint32_t period_ms, uint32_t count, uint32_t id) {
+	gs_device_cyclic c = { .period_ms = period_ms, .count = count, .can_id = id, .can_dlc = 2, .data = { slot, 0xCC } };
+	return vendor_out(GS_USB_BREQ_CYCLIC, slot, &c, sizeof(c));
+}
+
+/* Number of the frames with id on the bus and the spread of their delays
+   behind the deadlines, first frame plus multiples of period_ms, in
+   microseconds */
+static uint32_t cyclic_sent(uint32_t id, uint32_t period_ms, uint32_t* jitter_us) {
+	uint32_t n = 0;
+	uint64_t first = 0;
+	int64_t lo = 0, hi = 0;
+	for(uint32_t i=0; i<sim_bus.n_sent && i<SIM_BUS_LOG_SIZE; i++) {
+		if(sim_bus.sent[i].frame.id != id) {
+			continue;
+		}
+		if(!n) {
+			first = sim_bus.sent[i].time;
+		}
+		int64_t d = (int64_t)(sim_bus.sent[i].time - first) - (int64_t)n * SIM_CYCLES_MS(period_ms);
+		lo = d < lo ? d : lo;
+		hi = d > hi ? d : hi;
+		n++;
+	}
+	*jitter_us = (hi - lo) / SIM_CYCLES_US(1);
+	return n;
+}
+
+static void scenario_cyclic() {
+	const char* s = "cyclic";
+	const uint32_t n = 300;
+	int ok = check(set_cyclic(0, 10, 5, 0x55) && set_cyclic(1, 3, 0, 0x56), s, "cyclic request");
+	ok &= check(!set_cyclic(GS_CYCLIC_MAX_SLOTS, 1, 0, 0x57) && !set_cyclic(2, 0x10000, 0, 0x57), s, "bad slot accepted");
+	ok &= check(gs_start(GS_CAN_MODE_NORMAL, BIT_CYCLES_1M), s, "start");
+	uint32_t sent = 0, echoed = 0, foreign = 0;
+	uint64_t last = sim_cycles;
+	while(echoed < n && sim_cycles - last < SIM_CYCLES_MS(50)) {
+		if(sent < n && sent - echoed < HOST_TX_URBS) {
+			gs_host_frame hf = { .echo_id = sent % HOST_TX_URBS, .can_id = 0x100, .can_dlc = 8 };
+			sim_host_out(&hf, GS_HOST_FRAME_SIZE);
+			sent++;
+			continue;
+		}
+		gs_host_frame hf;
+		if(sim_host_in(&hf) < 0) {
+			sim_wait(SIM_CYCLES_US(20));
+			continue;
+		}
+		if(hf.echo_id != ECHO_RX) {
+			foreign |= hf.can_id != 0x100;
+			echoed++;
+			last = sim_cycles;
+		}
+	}
+	// Not collect(), the bus never goes quiet with the unlimited slot
+	sim_wait(SIM_CYCLES_MS(40));
+	gs_host_frame hf;
+	while(sim_host_in(&hf) >= 0) {
+		foreign = 1;
+	}
+	uint32_t jitter0, jitter1;
+	uint32_t n0 = cyclic_sent(0x55, 10, &jitter0);
+	uint32_t n1 = cyclic_sent(0x56, 3, &jitter1);
+	ok &= check(echoed == n, s, "host frames not echoed");
+	ok &= check(!foreign, s, "cyclic frames echoed");
+	ok &= check(n0 == 5, s, "frame count not kept");
+	ok &= check(n1 >= 20, s, "frames missing on the bus");
+	// At most the frames already loaded in the MCP go out ahead, 600us at
+	// 1Mbit/s
+	ok &= check(jitter0 < 600 * BIT_SLOWER && jitter1 < 600 * BIT_SLOWER, s, "period not kept");
+	ok &= check(gs_stop(), s, "stop");
+	// The unlimited slot stays and starts over, the used up one is gone
+	ok &= check(gs_start(GS_CAN_MODE_NORMAL, BIT_CYCLES_1M), s, "start");
+	sim_wait(SIM_CYCLES_MS(10));
+	ok &= check(set_cyclic(1, 0, 0, 0x56), s, "cyclic request");
+	collect(10);
+	uint32_t j;
+	uint32_t again0 = cyclic_sent(0x55, 10, &j);
+	uint32_t again1 = cyclic_sent(0x56, 3, &j);
+	ok &= check(!again0 && again1 >= 3 && again1 <= 5, s, "slots not kept across the restart");
+	ok &= check(gs_stop(), s, "stop");
+	ok &= check(vendor_out(GS_USB_BREQ_CYCLIC, GS_CYCLIC_CLEAR, 0, 0), s, "clear request");
+	char m[160];
+	snprintf(m, sizeof(m), "%u+%u cyclic frames next to %u from the host, jitter up to %uus", n0, n1, n, jitter0 > jitter1 ? jitter0 : jitter1);
+	result(s, ok, m);
+}
+
+/* ISO-TP with the device answering and pacing the Flow Control, compared
+   to the host doing it */
+
+#define ISOTP_TX_ID		0x7E0
+#define ISOTP_RX_ID		0x7E8
+#define ISOTP_ECU_US		50	// Time the ECU takes to answer
+// The host sees a frame with the next USB frame at the earliest and its
+// application has to get scheduled, 1ms is the optimistic end of it
+#define ISOTP_HOST_US		1000
+
+/* An ECU taking a segmented message on ISOTP_TX_ID and answering it with
+   Flow Control frames on ISOTP_RX_ID */
+typedef struct {
+	uint8_t fs;		// Flow status, 2 to refuse the message
+	uint8_t bs;
+	uint8_t st_min;
+	uint32_t seen;		// sim_bus.sent entries looked at
+	uint32_t left;
+	uint8_t block;
+	uint64_t fc_end;	// Consecutive Frames starting before are early
+	uint64_t first;		// End of the First Frame
+	uint64_t last;		// End of the last Consecutive Frame
+	uint32_t early;
+	uint32_t min_gap_us;	// Between the Consecutive Frames of a block
+} isotp_ecu;
+
+static uint32_t iso_sent, iso_echoed, iso_fc;
+
+static uint64_t frame_cycles(const sim_can_frame* f) {
+	return (uint64_t)sim_bus_frame_bits(f) * sim_bus.bit_cycles;
+}
+
+static void isotp_ecu_send_fc(isotp_ecu* e, uint64_t t) {
+	sim_can_frame fc = { .id = ISOTP_RX_ID, .dlc = 8, .data = { 0x30 | e->fs, e->bs, e->st_min, 0xAA, 0xAA, 0xAA, 0xAA, 0xAA } };
+	sim_bus_send(&fc, t + SIM_CYCLES_US(ISOTP_ECU_US));
+	e->fc_end = t + SIM_CYCLES_US(ISOTP_ECU_US) + frame_cycles(&fc);
+	e->block = e->bs;
+}
+
+static void isotp_ecu_step(isotp_ecu* e) {
+	for(; e->seen < sim_bus.n_sent && e->seen < SIM_BUS_LOG_SIZE; e->seen++) {
+		sim_can_frame* f = &sim_bus.sent[e->seen].frame;
+		uint64_t t = sim_bus.sent[e->seen].time;
+		if(f->id != ISOTP_TX_ID) {
+			continue;
+		}
+		if((f->data[0] & 0xF0) == 0x10) {
+			e->left = (((f->data[0] & 0x0F) << 8) | f->data[1]) - 6;
+			e->first = t;
+			e->last = 0;
+			isotp_ecu_send_fc(e, t);
+		} else if((f->data[0] & 0xF0) == 0x20 && e->left) {
+			uint64_t start = t - frame_cycles(f);
+			e->early += start < e->fc_end;
+			if(e->last && e->block != e->bs) {
+				uint32_t gap = start > e->last ? (start - e->last) / SIM_CYCLES_US(1) : 0;
+				if(gap < e->min_gap_us) {
+					e->min_gap_us = gap;
+				}
+			}
+			e->last = t;
+			e->left -= e->left > 7 ? 7 : e->left;
+			if(e->left && e->bs && !--e->block) {
+				isotp_ecu_send_fc(e, t);
+			}
+		}
+	}
+}
+
+static void isotp_pump(isotp_ecu* e) {
+	isotp_ecu_step(e);
+	gs_host_frame hf;
+	while(sim_host_in(&hf) >= 0) {
+		if(hf.echo_id != ECHO_RX) {
+			iso_echoed++;
+		} else if(hf.can_id == ISOTP_RX_ID && (hf.data[0] & 0xF0) == 0x30) {
+			iso_fc++;
+		}
+	}
+	sim_wait(SIM_CYCLES_US(20));
+}
+
+/* Sends a message of len bytes from the host, which either waits for every
+   Flow Control frame itself or (paced) queues all of it at once. Returns the
+   time from the end of the First Frame to the end of the last Consecutive
+   Frame on the bus. */
+static uint64_t isotp_send(isotp_ecu* e, uint32_t len, int paced) {
+	uint32_t n_cf = (len - 6 + 6) / 7;
+	uint32_t fc_want = 0;
+	uint64_t limit = sim_cycles + SIM_CYCLES_MS(500);
+	iso_sent = iso_echoed = iso_fc = 0;
+	e->seen = sim_bus.n_sent;
+	e->early = 0;
+	e->min_gap_us = 0xFFFFFFFF;
+	for(uint32_t i=0; i<=n_cf && sim_cycles < limit; i++) {
+		if(!paced && (i == 1 || (i > 1 && e->bs && (i - 1) % e->bs == 0))) {
+			fc_want++;
+			while(iso_fc < fc_want && sim_cycles < limit) {
+				isotp_pump(e);
+			}
+			sim_wait(SIM_CYCLES_US(ISOTP_HOST_US));
+		}
+		while(iso_sent - iso_echoed >= HOST_TX_URBS && sim_cycles < limit) {
+			isotp_pump(e);
+		}
+		gs_host_frame hf = { .echo_id = iso_sent % HOST_TX_URBS, .can_id = ISOTP_TX_ID, .can_dlc = 8 };
+		if(!i) {
+			hf.data[0] = 0x10 | (len >> 8);
+			hf.data[1] = len & 0xFF;
+		} else {
+			hf.data[0] = 0x20 | (i & 0x0F);
+		}
+		sim_host_out(&hf, GS_HOST_FRAME_SIZE);
+		iso_sent++;
+	}
+	while(iso_echoed < iso_sent && sim_cycles < limit) {
+		isotp_pump(e);
+	}
+	isotp_ecu_step(e);
+	return e->last > e->first ? e->last - e->first : 0;
+}
+
+static void scenario_isotp() {
+	const char* s = "isotp";
+	const uint32_t len = 2048;
+	isotp_ecu e = { .bs = 8, .st_min = 0 };
+	int ok = check(gs_start(GS_CAN_MODE_NORMAL, BIT_CYCLES_1M), s, "start");
+	// The host answering the Flow Control frames
+	uint64_t host = isotp_send(&e, len, 0);
+	ok &= check(host && iso_echoed == iso_sent && !e.early, s, "host paced transfer");
+	// The device doing it
+	gs_device_isotp cfg = { .flags = GS_ISOTP_AUTO_FC | GS_ISOTP_PACE_CF, .tx_id = ISOTP_TX_ID, .rx_id = ISOTP_RX_ID, .block_size = 4, .st_min = 0, .padding = 0xAA };
+	ok &= check(vendor_out(GS_USB_BREQ_ISOTP, 0, &cfg, sizeof(cfg)), s, "isotp request");
+	uint64_t device = isotp_send(&e, len, 1);
+	ok &= check(device && iso_echoed == iso_sent, s, "device paced transfer");
+	ok &= check(!e.early, s, "frames sent before the Flow Control");
+	// With STmin of the ECU, 1ms
+	e.bs = 4;
+	e.st_min = 1;
+	uint64_t t0 = sim_cycles, slept = sim_sleep_cycles;
+	isotp_send(&e, 64, 1);
+	ok &= check(e.left == 0 && !e.early && e.min_gap_us >= 1000, s, "STmin not kept");
+	// Asleep in the gaps rather than trying the held frame over and over
+	double asleep = (double)(sim_sleep_cycles - slept) / (sim_cycles - t0);
+	ok &= check(asleep > 0.5, s, "awake through the STmin gaps");
+	// Refused, the rest is dropped with the echoes still coming
+	e.fs = 2;
+	isotp_send(&e, 64, 1);
+	ok &= check(iso_echoed == iso_sent && e.left == 58, s, "refused message sent");
+	e.fs = 0;
+	// The ECU sending, 100 bytes are a First Frame and 14 Consecutive Frames
+	uint32_t seen = sim_bus.n_sent, fcs = 0, cf = 0;
+	uint64_t ff_at, fc_after = 0;
+	sim_can_frame ff = { .id = ISOTP_RX_ID, .dlc = 8, .data = { 0x10, 100 } };
+	// The bus is idle, the frame starts right away
+	sim_bus_send(&ff, sim_cycles);
+	ff_at = sim_cycles + frame_cycles(&ff);
+	uint64_t limit = sim_cycles + SIM_CYCLES_MS(50);
+	while(cf < 14 && sim_cycles < limit) {
+		for(; seen < sim_bus.n_sent; seen++) {
+			sim_can_frame* f = &sim_bus.sent[seen].frame;
+			if(f->id != ISOTP_TX_ID || f->data[0] != 0x30) {
+				continue;
+			}
+			if(!fcs++) {
+				fc_after = sim_bus.sent[seen].time - ff_at;
+			}
+			ok &= check(f->data[1] == cfg.block_size && f->data[3] == cfg.padding, s, "Flow Control frame");
+			for(uint32_t i=0; i<f->data[1] && cf < 14; i++) {
+				sim_can_frame c = { .id = ISOTP_RX_ID, .dlc = 8, .data = { 0x20 | (++cf & 0x0F) } };
+				sim_bus_send(&c, sim_bus.sent[seen].time + SIM_CYCLES_US(ISOTP_ECU_US));
+			}
+		}
+		sim_wait(SIM_CYCLES_US(20));
+	}
+	collect(2);
+	ok &= check(cf == 14 && fcs == 4, s, "Flow Control frames to the ECU");
+	for(int i=0; i<n_got; i++) {
+		ok &= check(got[i].echo_id == ECHO_RX, s, "Flow Control frame echoed");
+	}
+	cfg.flags = 0;
+	ok &= check(vendor_out(GS_USB_BREQ_ISOTP, 0, &cfg, sizeof(cfg)), s, "isotp request");
+	ok &= check(gs_stop(), s, "stop");
+	char m[160];
+	snprintf(m, sizeof(m), "%u bytes in %.1fms paced by the device, %.1fms by the host, FC %uus after the FF, %.0f%% asleep with STmin",
+		len, device / (double)SIM_CYCLES_MS(1), host / (double)SIM_CYCLES_MS(1), (uint32_t)(fc_after / SIM_CYCLES_US(1)), asleep * 100);
+	result(s, ok, m);
+}
+
+/* The serial number string: the chip's own in hex until a user ID is set,
+   then the ID in hex, kept in the EEPROM; refused with the interface up */
+
+static int read_serial(char* serial) {
+	uint8_t d[64];
+	int n = sim_host_control(0x80, 6, 0x0300 | ISERIAL, 0x0409, d, sizeof(d));
+	if(n < 2 || d[0] != n || d[1] != 3) {
+		return 0;
+	}
+	for(int i=0; i<(n - 2)/2; i++) {
+		serial[i] = d[2 + 2*i];
+	}
+	serial[(n - 2)/2] = 0;
+	return 1;
+}
+
+static void scenario_serial() {
+	const char* s = "serial";
+	char own[32], serial[32];
+	int ok = check(read_serial(own), s, "serial request");
+	ok &= check(!strcmp(own, "593637313935FF0C2711"), s, "not the signature row serial");
+	uint32_t got_id = 0;
+	ok &= check(sim_host_control(0xC1, GS_USB_BREQ_GET_USER_ID, 0, 0, &got_id, sizeof(got_id)) == sizeof(got_id)
+		&& got_id == GS_USER_ID_NONE, s, "user id set from the start");
+	uint32_t id = 0x0000C0A2;
+	ok &= check(vendor_out(GS_USB_BREQ_SET_USER_ID, 0, &id, sizeof(id)), s, "user id request");
+	ok &= check(read_serial(serial) && !strcmp(serial, "0000C0A2"), s, "user id not the serial");
+	ok &= check(sim_host_control(0xC1, GS_USB_BREQ_GET_USER_ID, 0, 0, &got_id, sizeof(got_id)) == sizeof(got_id)
+		&& got_id == id, s, "user id not read back");
+	ok &= check(sim_eeprom[0] == 0x5A && !memcmp(&sim_eeprom[1], &id, sizeof(id)), s, "user id not in the EEPROM");
+	ok &= check(gs_start(GS_CAN_MODE_NORMAL, BIT_CYCLES_1M), s, "start");
+	uint32_t none = GS_USER_ID_NONE;
+	ok &= check(!vendor_out(GS_USB_BREQ_SET_USER_ID, 0, &none, sizeof(none)), s, "cleared with the interface up");
+	ok &= check(gs_stop(), s, "stop");
+	ok &= check(read_serial(serial) && !strcmp(serial, "0000C0A2"), s, "user id lost");
+	ok &= check(vendor_out(GS_USB_BREQ_SET_USER_ID, 0, &none, sizeof(none)), s, "clear request");
+	ok &= check(read_serial(serial) && !strcmp(serial, own) && sim_eeprom[0] == 0xFF, s, "not back to the own serial");
+	char m[160];
+	snprintf(m, sizeof(m), "own %s", own);
+	result(s, ok, m);
+}
+
+/* The set up kept for a reset: the device starts on it by itself and
+   receives before the host has enumerated it, a start with the same set up
+   takes over with those frames, a different one starts over */
+
+static int boot_frames(const char* s, uint32_t id, int len) {
+	int n = 0;
+	for(int i=0; i<n_got; i++) {
+		if(got[i].echo_id == ECHO_RX && got[i].can_id == id) {
+			n += check(got_len[i] == len && seq_of(got[i].data) == n, s, "frame out of order or of the wrong size");
+		}
+	}
+	return n;
+}
+
+static void scenario_boot() {
+	const char* s = "boot";
+	int ok = check(vendor_out(GS_USB_BREQ_BOOT_CONFIG, GS_BOOT_CONFIG_ON, 0, 0), s, "boot config request");
+	sim_bus_reset(BIT_CYCLES_500K);
+	ok &= check(gs_start(GS_CAN_MODE_HW_TIMESTAMP, BIT_CYCLES_500K), s, "start");
+	ok &= check(!vendor_out(GS_USB_BREQ_BOOT_CONFIG, GS_BOOT_CONFIG_OFF, 0, 0), s, "turned off with the interface up");
+	ok &= check(gs_stop(), s, "stop");
+	ok &= check(sim_eeprom[32] == 0x5A, s, "set up not kept");
+	// Frames from 2ms after the reset on, the host enumerates after 10ms
+	sim_host_reset();
+	uint64_t t0 = sim_cycles;
+	uint32_t received = sim_bus.n_received;
+	for(uint32_t i=0; i<8; i++) {
+		sim_can_frame f = std_frame(0x123, i);
+		sim_bus_send(&f, t0 + SIM_CYCLES_MS(2) + i*SIM_CYCLES_US(500));
+	}
+	sim_wait(SIM_CYCLES_MS(10));
+	uint32_t early = sim_bus.n_received - received;
+	ok &= check(enumerate(), s, "enumerate");
+	ok &= check(gs_start(GS_CAN_MODE_HW_TIMESTAMP, BIT_CYCLES_500K), s, "start");
+	collect(5);
+	ok &= check(boot_frames(s, 0x123, GS_HOST_FRAME_SIZE_TS) == 8, s, "frames from before the enumeration lost");
+	// The host sends on the taken over start as well
+	uint32_t on_bus = sim_bus.n_sent;
+	gs_host_frame hf = { .echo_id = 0, .can_id = 0x125, .can_dlc = 0 };
+	sim_host_out(&hf, GS_HOST_FRAME_SIZE_TS);
+	collect(2);
+	int echoes = 0;
+	for(int i=0; i<n_got; i++) {
+		echoes += got[i].echo_id == 0;
+	}
+	ok &= check(sim_bus.n_sent == on_bus + 1 && echoes == 1, s, "host frame not sent after the take over");
+	ok &= check(gs_stop(), s, "stop");
+	// A different set up from the host
+	sim_host_reset();
+	sim_wait(SIM_CYCLES_MS(5));
+	ok &= check(enumerate(), s, "enumerate");
+	ok &= check(gs_start(GS_CAN_MODE_NORMAL, BIT_CYCLES_1M), s, "start");
+	sim_bus_reset(BIT_CYCLES_1M);
+	uint32_t merr = sim_bus.n_merr;
+	for(uint32_t i=0; i<8; i++) {
+		sim_can_frame f = std_frame(0x124, i);
+		sim_bus_send(&f, sim_cycles + i*SIM_CYCLES_US(200));
+	}
+	collect(5);
+	ok &= check(boot_frames(s, 0x124, GS_HOST_FRAME_SIZE) == 8 && sim_bus.n_merr == merr, s, "not started over with the host set up");
+	ok &= check(gs_stop(), s, "stop");
+	// The 1Mbit/s set up is the kept one now, until turned off
+	ok &= check(sim_eeprom[32] == 0x5A, s, "set up not kept");
+	ok &= check(vendor_out(GS_USB_BREQ_BOOT_CONFIG, GS_BOOT_CONFIG_OFF, 0, 0), s, "boot config request");
+	sim_host_reset();
+	sim_wait(SIM_CYCLES_MS(5));
+	ok &= check(enumerate(), s, "enumerate");
+	sim_can_frame f = std_frame(0x125, 0);
+	sim_bus_send(&f, sim_cycles);
+	collect(5);
+	ok &= check(!boot_frames(s, 0x125, GS_HOST_FRAME_SIZE), s, "started after a reset with it off");
+	ok &= check(gs_stop(), s, "stop");
+	// A start the MCP does not take is not kept
+	ok &= check(vendor_out(GS_USB_BREQ_BOOT_CONFIG, GS_BOOT_CONFIG_ON, 0, 0), s, "boot config request");
+	sim_bus.absent = 1;
+	ok &= check(gs_start(GS_CAN_MODE_NORMAL, BIT_CYCLES_500K), s, "start");
+	ok &= check(sim_eeprom[32] != 0x5A, s, "set up the MCP did not take kept");
+	ok &= check(gs_stop(), s, "stop");
+	ok &= check(vendor_out(GS_USB_BREQ_BOOT_CONFIG, GS_BOOT_CONFIG_OFF, 0, 0), s, "boot config request");
+	char m[160];
+	snprintf(m, sizeof(m), "%u frames received before the enumeration", early);
+	result(s, ok, m);
+}
+
+/* Bus statistics: a loaded bus counted without the frames going to the
+   host (and the statistics read during it not costing any of them), the
+   per id counts, and the load against the frame rate */
+
+static int bus_stats(gs_device_bus_stats* st, uint16_t value) {
+	return sim_host_control(0xC1, GS_USB_BREQ_BUS_STATS, value, 0, st, sizeof(*st)) == sizeof(*st);
+}
+
+static uint32_t worst_bits(int ext, int dlc) {
+	uint32_t g = (ext ? 54 : 34) + 8*dlc;
+	return g + 13 + (g - 1) / 4;
+}
+
+static void scenario_bus_stats() {
+	const char* s = "bus_stats";
+	const uint32_t n = 2000;
+	gs_device_bus_stats st;
+	int ok = check(vendor_out(GS_USB_BREQ_BUS_STATS, GS_BUS_STATS_ONLY, 0, 0), s, "bus stats request");
+	ok &= check(gs_start(GS_CAN_MODE_NORMAL, BIT_CYCLES_1M), s, "start");
+	uint32_t ovr = sim_bus.n_rx0ovr + sim_bus.n_rx1ovr;
+	ok &= check(bus_stats(&st, GS_STATS_READ_CLEAR), s, "bus stats request");
+	// 40 ids back to back, more than the table takes
+	uint64_t t0 = sim_cycles;
+	for(uint32_t i=0; i<n; i++) {
+		sim_can_frame f = std_frame(0x100 + i % 40, i);
+		sim_bus_send(&f, t0);
+	}
+	int polls = 0;
+	while(sim_bus_pending()) {
+		sim_wait(SIM_CYCLES_MS(10));
+		polls += bus_stats(&st, GS_STATS_READ);
+	}
+	collect(2);
+	ok &= check(bus_stats(&st, GS_STATS_READ), s, "bus stats request");
+	ok &= check(!n_got, s, "frames sent to the host");
+	ok &= check(sim_bus.n_rx0ovr + sim_bus.n_rx1ovr == ovr && st.frames == n, s, "frames lost");
+	ok &= check(st.bits == n * worst_bits(0, 8) && st.mode == GS_BUS_STATS_ONLY, s, "bits miscounted");
+	uint32_t tracked = 0, ids = 0;
+	for(int i=0; i<GS_BUS_STATS_IDS; i++) {
+		if(st.count[i]) {
+			ids++;
+			tracked += st.count[i];
+			ok &= check(st.can_id[i] >= 0x100 && st.can_id[i] < 0x128 && st.count[i] == n / 40, s, "id miscounted");
+		}
+	}
+	ok &= check(tracked + st.untracked == n && ids >= 28, s, "untracked frames miscounted");
+	uint32_t full = st.load;
+	// A frame every 250 bit times (250us at 1Mbit/s): 135 of the 250 bits
+	ok &= check(bus_stats(&st, GS_STATS_READ_CLEAR), s, "bus stats request");
+	t0 = sim_cycles;
+	for(uint32_t i=0; i<400; i++) {
+		sim_can_frame f = std_frame(0x200, i);
+		sim_bus_send(&f, t0 + i*250*BIT_CYCLES_1M);
+	}
+	sim_wait(400*250*BIT_CYCLES_1M);
+	ok &= check(bus_stats(&st, GS_STATS_READ_CLEAR), s, "bus stats request");
+	uint32_t expected = worst_bits(0, 8) * 10000 / 250;
+	ok &= check(st.frames == 400 && st.load > expected - 100 && st.load < expected + 100, s, "load off");
+	uint32_t half = st.load;
+	// Forwarded as well, and the sent frames counted
+	ok &= check(vendor_out(GS_USB_BREQ_BUS_STATS, GS_BUS_STATS_ON, 0, 0), s, "bus stats request");
+	for(uint32_t i=0; i<10; i++) {
+		sim_can_frame f = std_frame(0x201, i);
+		sim_bus_send(&f, sim_cycles);
+		gs_host_frame hf = { .echo_id = i, .can_id = 0x301 | CAN_EFF_FLAG, .can_dlc = 2 };
+		sim_host_out(&hf, GS_HOST_FRAME_SIZE);
+	}
+	collect(2);
+	ok &= check(n_got == 20, s, "frames not sent to the host");
+	ok &= check(bus_stats(&st, GS_STATS_READ), s, "bus stats request");
+	ok &= check(st.frames == 20 && st.bits == 10 * (worst_bits(0, 8) + worst_bits(1, 2)), s, "sent frames miscounted");
+	// Frames of the device itself, counted with their own id and length
+	// rather than those of the host frame last in the transmit buffer
+	ok &= check(bus_stats(&st, GS_STATS_READ_CLEAR), s, "bus stats request");
+	ok &= check(set_cyclic(0, 1, 5, 0x7E0), s, "cyclic request");
+	sim_wait(SIM_CYCLES_MS(10));
+	ok &= check(bus_stats(&st, GS_STATS_READ), s, "bus stats request");
+	int cyclic = 0;
+	for(int i=0; i<GS_BUS_STATS_IDS; i++) {
+		cyclic += st.can_id[i] == 0x7E0 && st.count[i] == 5;
+	}
+	ok &= check(st.frames == 5 && st.bits == 5 * worst_bits(0, 2) && cyclic, s, "device frames miscounted");
+	ok &= check(vendor_out(GS_USB_BREQ_BUS_STATS, GS_BUS_STATS_OFF, 0, 0), s, "bus stats request");
+	ok &= check(gs_stop(), s, "stop");
+	char m[160];
+	snprintf(m, sizeof(m), "%u ids of 40 tracked, load %.2f%% at a frame every 250 bits, %.2f%% back to back, %d reads during it",
+		ids, half / 100.0, full / 100.0, polls);
+	result(s, ok, m);
+}
+
+/* Bit rate detection: a node sending every period_us at one of the
+   standard rates, or nobody on the bus */
+
+static int autobaud_get(gs_device_autobaud* ab) {
+	return sim_host_control(0xC1, GS_USB_BREQ_AUTOBAUD, 0, 0, ab, sizeof(*ab)) == sizeof(*ab);
+}
+
+// Bit time of the timing found, in CPU cycles like the one of the bus
+static uint64_t autobaud_bit_cycles(const gs_device_autobaud* ab) {
+	const gs_device_bittiming* bt = &ab->bittiming;
+	return (uint64_t)bt->brp * (1 + bt->prop_seg + bt->phase_seg1 + bt->phase_seg2) * SIM_F_CPU / MCP_FCLK_CAN;
+}
+
+static uint64_t autobaud(const char* s, int* ok, uint32_t bit_cycles, uint32_t period_us, gs_device_autobaud* ab) {
+	sim_bus_reset(bit_cycles);
+	uint64_t t0 = sim_cycles;
+	for(uint32_t i=0; period_us && i<1500000 / period_us; i++) {
+		sim_can_frame f = std_frame(0x321, i);
+		sim_bus_send(&f, t0 + i*SIM_CYCLES_US(period_us));
+	}
+	*ok &= check(vendor_out(GS_USB_BREQ_AUTOBAUD, 0, 0, 0), s, "autobaud request");
+	do {
+		sim_wait(SIM_CYCLES_MS(5));
+		*ok &= check(autobaud_get(ab), s, "autobaud request");
+	} while(ab->state == GS_AUTOBAUD_RUNNING && sim_cycles - t0 < SIM_CYCLES_MS(2000));
+	uint64_t t = sim_cycles - t0;
+	*ok &= check(!sim_bus.n_sent, s, "frames sent while listening");
+	sim_bus_reset(bit_cycles);
+	return t;
+}
+
+static void scenario_autobaud() {
+	const char* s = "autobaud";
+	gs_device_autobaud ab;
+	int ok = 1;
+	uint64_t t250 = autobaud(s, &ok, 64, 2000, &ab);
+	ok &= check(ab.state == GS_AUTOBAUD_FOUND && ab.bitrate == 250000 && autobaud_bit_cycles(&ab) == 64, s, "250kbit/s not found");
+	uint64_t t83 = autobaud(s, &ok, 192, 10000, &ab);
+	ok &= check(ab.state == GS_AUTOBAUD_FOUND && ab.bitrate == 83333 && autobaud_bit_cycles(&ab) == 192, s, "83.3kbit/s not found");
+	uint64_t t1m = autobaud(s, &ok, BIT_CYCLES_1M, 1000, &ab);
+	ok &= check(ab.state == GS_AUTOBAUD_FOUND && autobaud_bit_cycles(&ab) == BIT_CYCLES_1M, s, "top rate not found");
+	uint64_t tidle = autobaud(s, &ok, BIT_CYCLES_1M, 0, &ab);
+	ok &= check(ab.state == GS_AUTOBAUD_FAILED, s, "found on a quiet bus");
+	// Not with the interface up, and the interface comes up as usual after it
+	ok &= check(gs_start(GS_CAN_MODE_NORMAL, BIT_CYCLES_1M), s, "start");
+	ok &= check(!vendor_out(GS_USB_BREQ_AUTOBAUD, 0, 0, 0), s, "started with the interface up");
+	sim_can_frame f = std_frame(0x322, 0);
+	sim_bus_send(&f, sim_cycles);
+	collect(2);
+	ok &= check(n_got == 1, s, "frame not received after it");
+	ok &= check(gs_stop(), s, "stop");
+	char m[160];
+	snprintf(m, sizeof(m), "found in %.0fms at 250k, %.0fms at 83.3k, %.0fms at %luk, given up after %.0fms",
+		t250 / (double)SIM_CYCLES_MS(1), t83 / (double)SIM_CYCLES_MS(1), t1m / (double)SIM_CYCLES_MS(1), SIM_F_CPU / BIT_CYCLES_1M / 1000,
+		tidle / (double)SIM_CYCLES_MS(1));
+	result(s, ok, m);
+}
+
+static const char* bench_file;
+
+static int harness() {
+	sim_bus_reset(BIT_CYCLES_1M);
+	scenario_enumerate();
+	if(failures) {
+		return failures;
+	}
+	if(bench_file) {
+		return bench(bench_file);
+	}
+	scenario_bittiming();
+	scenario_rx_burst();
+	scenario_rollover();
+	scenario_tx_burst();
+	scenario_host_stall();
+	scenario_loopback();
+	scenario_hw_filter();
+	scenario_sw_filter();
+	scenario_rtr();
+	scenario_timestamp();
+	scenario_stats();
+	scenario_error_state();
+	scenario_restart();
+	scenario_bus_off();
+	scenario_cyclic();
+	scenario_isotp();
+	scenario_serial();
+	scenario_boot();
+	scenario_bus_stats();
+	scenario_autobaud();
+	printf("%d scenario(s) failed\n", failures);
+	return failures;
+}
+
+int main(int argc, char** argv) {
+	if(argc == 3 && !strcmp(argv[1], "--bench")) {
+		bench_file = argv[2];
+	} else if(argc != 1) {
+		fprintf(stderr, "Usage: %s [--bench results.json]\n", argv[0]);
+		return 1;
+	}
+	sim_start(firmware_main, harness);
+	return 1;
+}
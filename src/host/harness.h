@@ -0,0 +1,81 @@
+/*
+
+  This file is part of gs_usb_leonardo project --
+  gs_usb compatible SocketCAN firmware for Arduino Leonardo /
+  MCP2515 based USB device, see
+
+          https://github.com/woj76/gs_usb_leonardo
+
+  For information about how this code came to be and what / whose
+  work it is based on, please see the LICENSE.md file in the project
+  root directory.
+
+  Copyright (C) 2019 Wojciech Mostowski <wojciech.mostowski@gmail.com>
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the License, or any later
+  version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  The copy of the license can be found in the licenses directory of
+  the project, or on GNU/FSF website at https://www.gnu.org/licenses/.
+
+*/
+
+/* The gs_usb host side shared by the scenarios (harness.c) and the
+   benchmark (bench.c) */
+
+#ifndef HARNESS_H
+#define HARNESS_H
+
+#include <stdint.h>
+
+#include "sim.h"
+#include "gs_usb.h"
+#include "can.h"
+#include "mcp.h"
+
+// Bit times in CPU cycles of the rates the scenarios run at, 1M, 500k and
+// 125kbit/s with the 16MHz MCP2515 of the board. A slower one does not make
+// 1Mbit/s, with MCP_CLOCK=8000000 the same scenarios run at half the rates.
+#define BIT_SLOWER		(MCP_CLOCK < SIM_F_CPU ? SIM_F_CPU / MCP_CLOCK : 1)
+#define BIT_CYCLES_1M		(16 * BIT_SLOWER)
+#define BIT_CYCLES_500K		(32 * BIT_SLOWER)
+#define BIT_CYCLES_125K		(128 * BIT_SLOWER)
+
+#define ECHO_RX			0xFFFFFFFF
+#define HOST_TX_URBS		10	// Like the Linux driver
+
+// How much later than sent a frame can reach the host, a packed IN transfer
+// waits for the SOF
+#ifdef USB_IN_BATCH
+#define HOST_IN_DELAY		SIM_CYCLES_MS(USB_IN_BATCH_SOFS)
+#else
+#define HOST_IN_DELAY		0
+#endif
+
+#define MAX_GOT			4096
+
+// Frames from the device and when the host got them, filled by collect
+extern gs_host_frame got[MAX_GOT];
+extern uint64_t got_time[MAX_GOT];
+extern int got_len[MAX_GOT];
+extern int n_got;
+
+double per_second(uint32_t n, uint64_t cycles);
+int vendor_out(uint8_t request, uint16_t value, void* data, uint16_t len);
+int enumerate();
+int gs_start(uint32_t flags, uint32_t bit_cycles);
+int gs_stop();
+void collect(uint32_t quiet_ms);
+sim_can_frame std_frame(uint32_t id, uint32_t seq);
+uint32_t seq_of(const uint8_t* data);
+
+int bench(const char* file_name);
+
+#endif
@@ -0,0 +1,182 @@
+/*
+
+  This file is part of gs_usb_leonardo project --
+  gs_usb compatible SocketCAN firmware for Arduino Leonardo /
+  MCP2515 based USB device, see
+
+          https://github.com/woj76/gs_usb_leonardo
+
+  For information about how this code came to be and what / whose
+  work it is based on, please see the LICENSE.md file in the project
+  root directory.
+
+  Copyright (C) 2019 Wojciech Mostowski <wojciech.mostowski@gmail.com>
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the License, or any later
+  version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  The copy of the license can be found in the licenses directory of
+  the project, or on GNU/FSF website at https://www.gnu.org/licenses/.
+
+*/
+
+/* The interface between the parts of the host build: the AVR core and
+   register side (sim_avr.c), the USB controller with the host end of the
+   cable (sim_usb.c), the MCP2515 with the CAN bus (sim_mcp.c), and the
+   scenarios driving all of it (harness.c). */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+
+#define SIM_F_CPU		16000000UL
+#define SIM_CYCLES_US(us)	((uint64_t)(us) * (SIM_F_CPU / 1000000UL))
+#define SIM_CYCLES_MS(ms)	((uint64_t)(ms) * (SIM_F_CPU / 1000UL))
+
+// Virtual time in cycles of a 16MHz clock, advanced by the register accesses
+// of the firmware with the rough costs below, the models run against this clock
+extern uint64_t sim_cycles;
+
+// SRAM bytes read and written by the firmware with HOST_SRAM, see sim_avr.c
+extern uint64_t sim_sram_bytes;
+
+// Storage of the registers, not counted as SRAM
+#define SIM_REG			__attribute__((section("sim_regs")))
+
+// Costs of the firmware in units of that clock, made up, not AVR cycles of
+// the built code: what runs between the accesses is free
+#define SIM_COST_REG		2	// Any register access
+#define SIM_COST_SPI_BYTE	18	// SPI byte at SCK = 8MHz plus the loop around it
+#define SIM_COST_ISR		20	// Interrupt entry and exit with the register pushes
+
+void sim_sync();
+void sim_poll();
+
+// AVR core, sim_avr.c
+
+extern uint8_t sim_sreg;
+extern uint8_t sim_isr_active;
+
+enum {
+	SIM_VECT_INT6,
+	SIM_VECT_USB_GEN,
+	SIM_VECT_USB_COM,
+	SIM_VECT_TIMER1_COMPA,
+	SIM_VECT_TIMER1_COMPB,
+	SIM_VECT_TIMER1_COMPC,
+	SIM_VECT_TIMER1_OVF,
+	SIM_N_VECTORS
+};
+
+typedef struct {
+	uint32_t count;
+	uint64_t cycles;	// Entry to exit, nested accesses and all
+	uint64_t sram;		// SRAM bytes, the same way
+	uint32_t max;
+} sim_vector_stats;
+
+extern sim_vector_stats sim_vectors[SIM_N_VECTORS];
+extern uint32_t sim_cli_max;	// Longest stretch of the main line code with interrupts disabled
+extern uint32_t sim_int6_latency_max;	// Longest wait of the low MCP interrupt line for ISR(INT6_vect)
+extern uint64_t sim_int6_latency_total;	// And all of them, over sim_int6_entries
+extern uint32_t sim_int6_entries;
+extern uint64_t sim_sleep_cycles;	// Spent in SLEEP
+
+void sim_stats_reset();
+
+void sim_timer_run();
+void sim_start(void (*firmware)(), int (*harness)());
+void sim_wait(uint64_t cycles);
+int sim_wait_for(int (*done)(), uint64_t time_out);
+
+// USB controller and host, sim_usb.c
+
+void sim_usb_sync();
+void sim_usb_run();
+uint8_t sim_usb_gen_pending();
+uint8_t sim_usb_com_pending();
+void sim_usb_com_done();
+
+void sim_host_attach();
+void sim_host_reset();
+int sim_host_configured();
+int sim_host_control(uint8_t type, uint8_t request, uint16_t value, uint16_t index, void* data, uint16_t len);
+void sim_host_out(const void* data, uint8_t len);
+int sim_host_out_pending();
+int sim_host_in(void* data);
+void sim_host_in_pause(int pause);
+
+extern uint64_t sim_usb_out_time;	// When the last OUT packet got to the firmware
+extern uint64_t sim_usb_out_sram;	// And sim_sram_bytes then
+extern uint32_t sim_usb_in_packets;	// IN transfers taken by the host
+
+// MCP2515 and CAN bus, sim_mcp.c
+
+typedef struct {
+	uint32_t id;
+	uint8_t ext;
+	uint8_t rtr;
+	uint8_t dlc;
+	uint8_t data[8];
+} sim_can_frame;
+
+typedef struct {
+	sim_can_frame frame;
+	uint64_t time;		// End of the frame on the bus
+} sim_bus_entry;
+
+#define SIM_BUS_LOG_SIZE	8192
+
+typedef enum {
+	SIM_TX_OK,
+	SIM_TX_NO_ACK,		// No other node on the bus
+	SIM_TX_BIT_ERROR	// Every transmission is destroyed, ends in bus off
+} sim_tx_fault;
+
+typedef struct {
+	uint32_t bit_cycles;	// Bit time of the other nodes, 16 for 1Mbit/s
+	sim_tx_fault tx_fault;
+	uint8_t absent;		// The MCP does not answer, MISO stays high
+	// Frames sent by the device, in bus order
+	sim_bus_entry sent[SIM_BUS_LOG_SIZE];
+	uint32_t n_sent;
+	// Event counters
+	uint32_t n_received;	// Frames stored in RXB0 / RXB1
+	uint32_t n_rx0ovr;
+	uint32_t n_rx1ovr;
+	uint32_t n_merr;
+	uint32_t n_busoff;
+	uint64_t busoff_time;	// Of the last one
+	// READ RX BUFFER transactions of a frame with 8 data bytes, and their
+	// time from the chip select to the unselect
+	uint32_t n_rx_reads;
+	uint64_t rx_read_cycles;
+} sim_bus_state;
+
+extern sim_bus_state sim_bus;
+
+void sim_mcp_select(uint8_t selected);
+uint8_t sim_mcp_spi(uint8_t mosi);
+uint8_t sim_mcp_int();
+void sim_mcp_run();
+
+void sim_bus_reset(uint32_t bit_cycles);
+void sim_bus_send(const sim_can_frame* frame, uint64_t ready);
+uint32_t sim_bus_pending();
+uint64_t sim_bus_idle_at();
+uint32_t sim_bus_frame_bits(const sim_can_frame* frame);
+uint8_t sim_mcp_register(uint8_t address);
+void sim_mcp_set_register(uint8_t address, uint8_t value);
+
+extern uint64_t sim_mcp_txreq_time;	// When the last transmission was requested
+extern uint64_t sim_mcp_txreq_sram;	// And sim_sram_bytes then
+
+#endif
@@ -0,0 +1,692 @@
+/*
+
+  This file is part of gs_usb_leonardo project --
+  gs_usb compatible SocketCAN firmware for Arduino Leonardo /
+  MCP2515 based USB device, see
+
+          https://github.com/woj76/gs_usb_leonardo
+
+  For information about how this code came to be and what / whose
+  work it is based on, please see the LICENSE.md file in the project
+  root directory.
+
+  Copyright (C) 2019 Wojciech Mostowski <wojciech.mostowski@gmail.com>
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the License, or any later
+  version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  The copy of the license can be found in the licenses directory of
+  the project, or on GNU/FSF website at https://www.gnu.org/licenses/.
+
+*/
+
+/* The AVR core side of the host build. The firmware sources are compiled for
+   the Linux host against the headers in host/avr, run on the host CPU, and
+   see the ATmega32U4 through the registers declared there.
+
+   The registers with side effects are accessor functions returning a
+   pointer, so the firmware can both read and write through them. C gives no
+   way to tell a read from a write, hence the conventions here: a write lands
+   in the returned variable after the accessor returned and is picked up by
+   the next sim_sync, which compares it with the value last shown to the
+   firmware (see sim_usb.c for the endpoint registers). SPDR is keyed on SPIF:
+   spi.c always writes SPDR, polls SPSR and then reads SPDR, so the byte is
+   exchanged with the MCP2515 model on the SPSR poll that follows a write.
+   UDR1 of the USART backend (SPI_USART) is keyed on the UCSR1A poll before
+   it, see there.
+
+   Every accessor advances the virtual clock by a rough cost and polls the
+   models, and then runs the interrupt routines that are pending and enabled
+   while the I bit is set. This is the only place interrupts can happen, a
+   firmware loop that touches no register at all (like waiting for
+   gs_can_mode in main) is broken up by a host timer signal that advances the
+   clock by 1ms when no register was touched since the previous one.
+
+   The scenarios in harness.c run as a coroutine next to the firmware, they
+   get the control when the clock reaches the time they wait for, or the
+   condition they wait on holds.
+
+   SRAM accesses cost no cycles here. They are counted instead, in bytes: the
+   firmware objects are built with -fsanitize=thread and the hooks at the end
+   of this file take the place of its run time. The registers of the models
+   live in the sim_regs section and are left out. gcc keeps other values in
+   registers on the host than avr-gcc does on the AVR, so like the cycles the
+   bytes tell one version of the firmware from the next. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <ucontext.h>
+
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <avr/boot.h>
+
+#include "sim.h"
+
+void INT6_vect(void) __attribute__((weak));
+void USB_GEN_vect(void) __attribute__((weak));
+void USB_COM_vect(void) __attribute__((weak));
+void TIMER1_COMPA_vect(void) __attribute__((weak));
+void TIMER1_COMPB_vect(void) __attribute__((weak));
+void TIMER1_COMPC_vect(void) __attribute__((weak));
+void TIMER1_OVF_vect(void) __attribute__((weak));
+
+SIM_REG volatile uint8_t DDRB, PORTB, PINB;
+SIM_REG volatile uint8_t DDRC, PORTC, PINC;
+SIM_REG volatile uint8_t DDRD, PORTD, PIND;
+SIM_REG volatile uint8_t DDRE, PORTE, PINE;
+SIM_REG volatile uint8_t DDRF, PORTF, PINF;
+SIM_REG volatile uint8_t EICRA, EICRB, EIMSK, EIFR;
+SIM_REG volatile uint8_t SPCR;
+SIM_REG volatile uint8_t UCSR1B, UCSR1C;
+SIM_REG volatile uint16_t UBRR1;
+SIM_REG volatile uint8_t TCCR1A, TCCR1B, TCCR1C, TIMSK1;
+SIM_REG volatile uint16_t OCR1A, OCR1B, OCR1C;
+SIM_REG volatile uint8_t UHWCON, USBCON, USBSTA, UDCON, UDINT, UDIEN, UDADDR;
+SIM_REG volatile uint8_t UENUM, UERST, UEINT;
+SIM_REG volatile uint8_t UDFNUML, UDFNUMH;
+SIM_REG volatile uint8_t GPIOR0, GPIOR1, GPIOR2;
+SIM_REG volatile uint8_t SMCR, MCUCR, MCUSR;
+SIM_REG volatile uint8_t CLKSEL0, CLKSTA;
+
+uint64_t sim_cycles;
+uint64_t sim_sram_bytes;
+uint64_t sim_sleep_cycles;
+SIM_REG uint8_t sim_sreg;
+uint8_t sim_isr_active;
+sim_vector_stats sim_vectors[SIM_N_VECTORS];
+uint32_t sim_cli_max;
+uint32_t sim_int6_latency_max;
+uint64_t sim_int6_latency_total;
+uint32_t sim_int6_entries;
+
+uint8_t sim_eeprom[E2END + 1] = { [0 ... E2END] = 0xFF };
+
+static volatile uint32_t sim_polls;
+static uint8_t sim_in_poll;
+static uint8_t sim_dispatched;
+static uint8_t sim_int6_active;
+
+#define SIM_SREG_I		0x80
+
+static uint8_t cli_open;
+static uint64_t cli_from;
+
+static void sim_access(uint8_t cost) {
+	sim_cycles += cost;
+	sim_poll();
+}
+
+/* SPI */
+
+#define SPI_IDLE		0	// Next SPDR access is a write
+#define SPI_WRITTEN		1	// Next SPSR poll exchanges the byte
+#define SPI_DONE		2	// Next SPDR access reads the received byte
+
+SIM_REG static uint8_t spi_spdr;
+SIM_REG static uint8_t spi_spsr;
+static uint8_t spi_state = SPI_IDLE;
+static uint8_t spi_cs_low;
+
+uint8_t* sim_reg_spdr() {
+	sim_access(1);
+	if(spi_state == SPI_DONE) {
+		spi_state = SPI_IDLE;
+		spi_spsr &= ~(1 << SPIF);
+	} else if(spi_state == SPI_IDLE) {
+		spi_state = SPI_WRITTEN;
+	}
+	return &spi_spdr;
+}
+
+uint8_t* sim_reg_spsr() {
+	sim_access(SIM_COST_REG);
+	if(spi_state == SPI_WRITTEN) {
+		spi_spdr = spi_cs_low ? sim_mcp_spi(spi_spdr) : 0xFF;
+		sim_cycles += SIM_COST_SPI_BYTE;
+		spi_state = SPI_DONE;
+		spi_spsr |= (1 << SPIF);
+	}
+	return &spi_spsr;
+}
+
+/* USART1 in Master SPI mode. A byte takes 16 cycles at SCK = 8MHz in the
+   shift register, with one more waiting in the transmit buffer, received
+   bytes wait in a two byte FIFO. The shifts are run up to the current time
+   on every access. spi.c reads UDR1 only after a poll showed RXC1, and
+   writes it right away or after one showed UDRE1, so an access to UDR1 is a
+   read after a poll with RXC1 and a write otherwise. To keep the two apart
+   a poll shows UDRE1 only while no received byte is waiting, the next byte
+   then goes in one poll later, while the one before it is still shifted. */
+
+#define USART_BYTE_CYCLES	16
+
+SIM_REG static uint8_t usart_udr;
+SIM_REG static uint8_t usart_ucsra;
+static uint8_t usart_rxc_shown;
+static uint8_t usart_written;
+static uint64_t usart_written_at;
+static uint8_t usart_shifting;
+static uint8_t usart_shift;
+static uint64_t usart_shift_end;
+static uint8_t usart_tx_full;
+static uint8_t usart_tx;
+static uint8_t usart_rx[2];
+static uint8_t usart_rx_n;
+
+static void usart_run() {
+	// A write lands after the accessor returned, it is taken here
+	if(usart_written) {
+		usart_written = 0;
+		if(!usart_shifting) {
+			usart_shifting = 1;
+			usart_shift = usart_udr;
+			usart_shift_end = usart_written_at + USART_BYTE_CYCLES;
+		} else {
+			usart_tx_full = 1;
+			usart_tx = usart_udr;
+		}
+	}
+	while(usart_shifting && sim_cycles >= usart_shift_end) {
+		uint8_t in = spi_cs_low ? sim_mcp_spi(usart_shift) : 0xFF;
+		if(usart_rx_n < 2) {
+			usart_rx[usart_rx_n++] = in;
+		}
+		if(usart_tx_full) {
+			usart_tx_full = 0;
+			usart_shift = usart_tx;
+			usart_shift_end += USART_BYTE_CYCLES;
+		} else {
+			usart_shifting = 0;
+		}
+	}
+}
+
+uint8_t* sim_reg_udr1() {
+	sim_access(SIM_COST_REG);
+	usart_run();
+	if(usart_rxc_shown) {
+		usart_rxc_shown = 0;
+		usart_udr = usart_rx[0];
+		usart_rx[0] = usart_rx[1];
+		usart_rx_n--;
+	} else {
+		usart_written = 1;
+		usart_written_at = sim_cycles;
+	}
+	return &usart_udr;
+}
+
+uint8_t* sim_reg_ucsr1a() {
+	sim_access(SIM_COST_REG);
+	usart_run();
+	usart_rxc_shown = usart_rx_n != 0;
+	usart_ucsra = usart_rxc_shown ? (1 << RXC1) : usart_tx_full ? 0 : (1 << UDRE1);
+	return &usart_ucsra;
+}
+
+/* Core registers */
+
+SIM_REG static uint8_t pllcsr;
+
+uint8_t* sim_reg_sreg() {
+	sim_access(1);
+	return &sim_sreg;
+}
+
+void sim_cli() {
+	uint8_t opens = (sim_sreg & SIM_SREG_I) && !sim_isr_active;
+	// The I bit goes first, sim_tick can jump ahead right up to that point
+	// and the window starts after it
+	sim_sreg &= ~SIM_SREG_I;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	sim_cycles++;
+	if(opens) {
+		cli_open = 1;
+		cli_from = sim_cycles;
+	}
+}
+
+void sim_sei() {
+	sim_sreg |= SIM_SREG_I;
+	// With the sleep enabled this is the SEI right before SLEEP, the
+	// instruction after SEI runs before any interrupt, so a pending one
+	// wakes the CPU rather than being served ahead of the SLEEP
+	if(SMCR & (1 << SE)) {
+		sim_cycles++;
+		return;
+	}
+	sim_access(1);
+}
+
+/* SLEEP in the idle mode, the time runs on in steps of about the wake up
+   time until an interrupt was served */
+void sim_sleep() {
+	if(!(SMCR & (1 << SE)) || !(sim_sreg & SIM_SREG_I)) {
+		sim_access(1);
+		return;
+	}
+	do {
+		sim_cycles += 4;
+		sim_sleep_cycles += 4;
+		sim_poll();
+	} while(!sim_dispatched);
+}
+
+uint8_t* sim_reg_pllcsr() {
+	sim_access(SIM_COST_REG);
+	if(pllcsr & (1 << PLLE)) {
+		pllcsr |= (1 << PLOCK);
+	}
+	return &pllcsr;
+}
+
+/* The serial number bytes of the signature row, other addresses read as
+   0xFF. Made up, but like on the chip they are not all hex digits. */
+
+static const uint8_t signature_serial[10] = {0x59, 0x36, 0x37, 0x31, 0x39, 0x35, 0xFF, 0x0C, 0x27, 0x11};
+
+uint8_t sim_signature_byte(uint8_t address) {
+	sim_access(SIM_COST_REG);
+	if(address >= 0x0E && address < 0x0E + sizeof(signature_serial)) {
+		return signature_serial[address - 0x0E];
+	}
+	return 0xFF;
+}
+
+/* Timer 1, the normal and the CTC (TOP in OCR1A) modes. The count is kept
+   as the total number of timer ticks since the last time it was anchored
+   (set up, written, or its mode changed). */
+
+static const uint16_t t1_prescale[8] = {0, 1, 8, 64, 256, 1024, 0, 0};
+
+static uint64_t t1_anchor;
+static uint64_t t1_anchor_ticks;
+static uint64_t t1_seen;
+static uint8_t t1_cs;
+static uint8_t t1_ctc;
+static uint16_t t1_top;
+static uint8_t t1_flags;
+SIM_REG static uint16_t t1_reg, t1_shown;
+SIM_REG static uint8_t tifr1_reg, tifr1_shown;
+
+#define TIFR1_FLAGS		((1 << ICF1) | (1 << OCF1C) | (1 << OCF1B) | (1 << OCF1A) | (1 << TOV1))
+#define TIFR1_MARK		0x80	// Reserved bit shown as 1, written as 0 by any plain write
+
+static uint64_t t1_ticks() {
+	uint16_t p = t1_prescale[t1_cs];
+	if(!p) {
+		return t1_anchor_ticks;
+	}
+	return t1_anchor_ticks + (sim_cycles - t1_anchor) / p;
+}
+
+static uint16_t t1_count() {
+	uint64_t t = t1_ticks();
+	return t1_ctc ? t % ((uint64_t)t1_top + 1) : (uint16_t)t;
+}
+
+static void t1_anchor_at(uint16_t count) {
+	t1_anchor = sim_cycles;
+	t1_anchor_ticks = t1_seen = count;
+}
+
+/* Counts the times the total passed a value equal to residue modulo period
+   while going from the last seen total to now */
+static uint64_t t1_hits(uint64_t from, uint64_t to, uint64_t period, uint64_t residue) {
+	return (to + period - residue) / period - (from + period - residue) / period;
+}
+
+void sim_timer_run() {
+	uint8_t cs = TCCR1B & 0x07;
+	uint8_t ctc = (TCCR1B & ((1 << WGM13) | (1 << WGM12))) == (1 << WGM12) && !(TCCR1A & 0x03);
+	if(cs != t1_cs || ctc != t1_ctc || (ctc && OCR1A != t1_top)) {
+		uint16_t c = t1_count();
+		t1_cs = cs;
+		t1_ctc = ctc;
+		t1_top = OCR1A;
+		t1_anchor_at(ctc && c > t1_top ? 0 : c);
+	}
+	uint64_t now = t1_ticks();
+	if(now == t1_seen) {
+		return;
+	}
+	if(t1_ctc) {
+		if(t1_hits(t1_seen, now, (uint64_t)t1_top + 1, t1_top)) {
+			t1_flags |= (1 << OCF1A);
+		}
+	} else {
+		if(t1_hits(t1_seen, now, 0x10000, 0)) {
+			t1_flags |= (1 << TOV1);
+		}
+		if(t1_hits(t1_seen, now, 0x10000, OCR1A)) {
+			t1_flags |= (1 << OCF1A);
+		}
+		if(t1_hits(t1_seen, now, 0x10000, OCR1B)) {
+			t1_flags |= (1 << OCF1B);
+		}
+		if(t1_hits(t1_seen, now, 0x10000, OCR1C)) {
+			t1_flags |= (1 << OCF1C);
+		}
+	}
+	t1_seen = now;
+}
+
+static void sim_timer_sync() {
+	if(t1_reg != t1_shown) {
+		t1_anchor_at(t1_reg);
+		t1_shown = t1_reg;
+	}
+	if(tifr1_reg != tifr1_shown) {
+		t1_flags &= ~(tifr1_reg & TIFR1_FLAGS);
+		tifr1_shown = tifr1_reg;
+	}
+}
+
+uint16_t* sim_reg_tcnt1() {
+	sim_access(SIM_COST_REG);
+	t1_reg = t1_shown = t1_count();
+	return &t1_reg;
+}
+
+uint8_t* sim_reg_tifr1() {
+	sim_access(SIM_COST_REG);
+	tifr1_reg = tifr1_shown = t1_flags | TIFR1_MARK;
+	return &tifr1_reg;
+}
+
+/* Pins and interrupts */
+
+static void sim_pins() {
+	uint8_t low = sim_mcp_int();
+	uint8_t was_low = !(PINE & (1 << 6));
+	if(low != was_low) {
+		uint8_t isc = (EICRB >> ISC60) & 0x03;
+		if(isc == 1 || (isc == 2 && low) || (isc == 3 && !low)) {
+			EIFR |= (1 << INTF6);
+		}
+	}
+	if(low) {
+		PINE &= ~(1 << 6);
+	} else {
+		PINE |= (1 << 6);
+	}
+}
+
+static void (*const sim_vector_table[SIM_N_VECTORS])(void) = {
+	INT6_vect, USB_GEN_vect, USB_COM_vect, TIMER1_COMPA_vect, TIMER1_COMPB_vect, TIMER1_COMPC_vect, TIMER1_OVF_vect
+};
+
+/* INT6 latency: from the first poll that finds the line low, enabled and
+   INT6 not running, to the entry of the routine. A line still low after the
+   routine starts a new wait. */
+
+static uint8_t int6_waiting;
+static uint64_t int6_low_from;
+
+static void sim_int6_wait() {
+	if(!(EIMSK & (1 << INT6)) || (PINE & (1 << 6))) {
+		int6_waiting = 0;
+	} else if(!int6_waiting && !sim_int6_active) {
+		int6_waiting = 1;
+		int6_low_from = sim_cycles;
+	}
+}
+
+static int8_t sim_pending_vector() {
+	if(EIMSK & (1 << INT6)) {
+		if(!((EICRB >> ISC60) & 0x03)) {
+			if(!(PINE & (1 << 6))) {
+				return SIM_VECT_INT6;
+			}
+		} else if(EIFR & (1 << INTF6)) {
+			EIFR &= ~(1 << INTF6);
+			return SIM_VECT_INT6;
+		}
+	}
+	if(sim_usb_gen_pending()) {
+		return SIM_VECT_USB_GEN;
+	}
+	if(sim_usb_com_pending()) {
+		return SIM_VECT_USB_COM;
+	}
+	if((TIMSK1 & (1 << OCIE1A)) && (t1_flags & (1 << OCF1A))) {
+		t1_flags &= ~(1 << OCF1A);
+		return SIM_VECT_TIMER1_COMPA;
+	}
+	if((TIMSK1 & (1 << OCIE1B)) && (t1_flags & (1 << OCF1B))) {
+		t1_flags &= ~(1 << OCF1B);
+		return SIM_VECT_TIMER1_COMPB;
+	}
+	if((TIMSK1 & (1 << OCIE1C)) && (t1_flags & (1 << OCF1C))) {
+		t1_flags &= ~(1 << OCF1C);
+		return SIM_VECT_TIMER1_COMPC;
+	}
+	if((TIMSK1 & (1 << TOIE1)) && (t1_flags & (1 << TOV1))) {
+		t1_flags &= ~(1 << TOV1);
+		return SIM_VECT_TIMER1_OVF;
+	}
+	return -1;
+}
+
+/* One interrupt routine per poll: the AVR always executes one instruction of
+   the interrupted code after RETI before it takes the next interrupt, here
+   that is the code up to the next register access */
+static uint8_t sim_interrupts() {
+	if(!(sim_sreg & SIM_SREG_I) || sim_isr_active) {
+		return 0;
+	}
+	int8_t v = sim_pending_vector();
+	if(v < 0 || !sim_vector_table[v]) {
+		// An enabled interrupt without a routine, the real device would reset
+		return 0;
+	}
+	uint64_t start = sim_cycles;
+	uint64_t sram = sim_sram_bytes;
+	if(v == SIM_VECT_INT6) {
+		if(int6_waiting) {
+			if(sim_cycles - int6_low_from > sim_int6_latency_max) {
+				sim_int6_latency_max = sim_cycles - int6_low_from;
+			}
+			sim_int6_latency_total += sim_cycles - int6_low_from;
+			sim_int6_entries++;
+		}
+		int6_waiting = 0;
+		sim_int6_active = 1;
+	}
+	sim_isr_active = 1;
+	sim_sreg &= ~SIM_SREG_I;
+	sim_cycles += SIM_COST_ISR;
+	sim_vector_table[v]();
+	sim_int6_active = 0;
+	if(v == SIM_VECT_USB_COM) {
+		sim_usb_com_done();
+	}
+	sim_sreg |= SIM_SREG_I;
+	sim_isr_active = 0;
+	sim_vector_stats* st = &sim_vectors[v];
+	st->count++;
+	st->cycles += sim_cycles - start;
+	st->sram += sim_sram_bytes - sram;
+	if(sim_cycles - start > st->max) {
+		st->max = sim_cycles - start;
+	}
+	return 1;
+}
+
+/* Stretches of the main line code with interrupts disabled, closed by the
+   first register access after the I bit is back */
+static void sim_cli_window() {
+	if(cli_open && (sim_sreg & SIM_SREG_I)) {
+		cli_open = 0;
+		if(sim_cycles - cli_from > sim_cli_max) {
+			sim_cli_max = sim_cycles - cli_from;
+		}
+	}
+}
+
+void sim_stats_reset() {
+	memset(sim_vectors, 0, sizeof(sim_vectors));
+	sim_cli_max = 0;
+	sim_int6_latency_max = 0;
+	sim_int6_latency_total = 0;
+	sim_int6_entries = 0;
+}
+
+/* The harness coroutine */
+
+static ucontext_t fw_context;
+static ucontext_t harness_context;
+static char harness_stack[1 << 20];
+static int (*harness_main)();
+static uint8_t in_harness;
+static uint64_t wake_at;
+static int (*wake_done)();
+
+static void sim_harness_entry() {
+	exit(harness_main());
+}
+
+static void sim_harness_due() {
+	if(in_harness || (sim_cycles < wake_at && !(wake_done && wake_done()))) {
+		return;
+	}
+	in_harness = 1;
+	swapcontext(&fw_context, &harness_context);
+	in_harness = 0;
+}
+
+void sim_wait(uint64_t cycles) {
+	wake_at = sim_cycles + cycles;
+	wake_done = 0;
+	swapcontext(&harness_context, &fw_context);
+}
+
+int sim_wait_for(int (*done)(), uint64_t time_out) {
+	if(done()) {
+		return 1;
+	}
+	wake_at = sim_cycles + time_out;
+	wake_done = done;
+	swapcontext(&harness_context, &fw_context);
+	wake_done = 0;
+	return done();
+}
+
+static void sim_tick(int signal) {
+	static uint32_t seen;
+	(void)signal;
+	// With interrupts off nothing could run anyway, and the jump would show
+	// as an interrupts disabled window in the benchmark
+	if(sim_polls != seen || in_harness || sim_in_poll || sim_isr_active || !(sim_sreg & SIM_SREG_I)) {
+		seen = sim_polls;
+		return;
+	}
+	// A window ended by a plain write of SREG is only closed by the next poll
+	sim_cli_window();
+	// The firmware spins between the interrupts. Time moves on in steps of
+	// 10us up to 1ms, so the bus and timer events are served about when
+	// they happen, then any number of interrupts can run.
+	for(uint8_t n=0; n<100; n++) {
+		sim_cycles += SIM_CYCLES_US(10);
+		sim_poll();
+		if(sim_dispatched) {
+			break;
+		}
+	}
+	for(uint8_t n=0; n<16 && sim_dispatched; n++) {
+		sim_poll();
+	}
+	seen = sim_polls;
+}
+
+void sim_sync() {
+	uint8_t cs_low = !(PORTB & 0x01);
+	if(cs_low != spi_cs_low) {
+		spi_cs_low = cs_low;
+		sim_mcp_select(cs_low);
+	}
+	sim_usb_sync();
+	sim_timer_sync();
+}
+
+void sim_poll() {
+	sim_polls++;
+	if(sim_in_poll) {
+		return;
+	}
+	sim_in_poll = 1;
+	sim_sync();
+	sim_timer_run();
+	sim_mcp_run();
+	sim_usb_run();
+	sim_pins();
+	sim_int6_wait();
+	// Still marked as in the poll, sim_tick jumping ahead in the middle of
+	// this would count the jump into the window
+	sim_cli_window();
+	sim_in_poll = 0;
+	sim_dispatched = sim_interrupts();
+	sim_harness_due();
+}
+
+void sim_start(void (*firmware)(), int (*harness)()) {
+	PORTB = 0x01;
+	PINE = (1 << 6);
+	harness_main = harness;
+	getcontext(&harness_context);
+	harness_context.uc_stack.ss_sp = harness_stack;
+	harness_context.uc_stack.ss_size = sizeof(harness_stack);
+	harness_context.uc_link = 0;
+	makecontext(&harness_context, sim_harness_entry, 0);
+
+	struct sigaction sa;
+	sa.sa_handler = sim_tick;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGALRM, &sa, 0);
+	struct itimerval it = { {0, 200}, {0, 200} };
+	setitimer(ITIMER_REAL, &it, 0);
+
+	firmware();
+	fprintf(stderr, "firmware main returned\n");
+	exit(2);
+}
+
+/* SRAM counting with "make HOST_SRAM=1", the hooks -fsanitize=thread puts
+   around every load and store of the firmware */
+
+#ifdef HOST_SRAM
+
+extern char __start_sim_regs[], __stop_sim_regs[];
+
+static void sim_sram(void* p, unsigned long n) {
+	if((char*)p < __start_sim_regs || (char*)p >= __stop_sim_regs) {
+		sim_sram_bytes += n;
+	}
+}
+
+void __tsan_init() {}
+void __tsan_func_entry(void* pc) {}
+void __tsan_func_exit() {}
+void __tsan_read1(void* p) { sim_sram(p, 1); }
+void __tsan_read2(void* p) { sim_sram(p, 2); }
+void __tsan_read4(void* p) { sim_sram(p, 4); }
+void __tsan_read8(void* p) { sim_sram(p, 8); }
+void __tsan_write1(void* p) { sim_sram(p, 1); }
+void __tsan_write2(void* p) { sim_sram(p, 2); }
+void __tsan_write4(void* p) { sim_sram(p, 4); }
+void __tsan_write8(void* p) { sim_sram(p, 8); }
+void __tsan_read_range(void* p, unsigned long n) { sim_sram(p, n); }
+void __tsan_write_range(void* p, unsigned long n) { sim_sram(p, n); }
+#endif
@@ -0,0 +1,733 @@
+/*
+
+  This file is part of gs_usb_leonardo project --
+  gs_usb compatible SocketCAN firmware for Arduino Leonardo /
+  MCP2515 based USB device, see
+
+          https://github.com/woj76/gs_usb_leonardo
+
+  For information about how this code came to be and what / whose
+  work it is based on, please see the LICENSE.md file in the project
+  root directory.
+
+  Copyright (C) 2019 Wojciech Mostowski <wojciech.mostowski@gmail.com>
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the License, or any later
+  version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  The copy of the license can be found in the licenses directory of
+  the project, or on GNU/FSF website at https://www.gnu.org/licenses/.
+
+*/
+
+/* Behavioural model of the MCP2515 and of the CAN bus it sits on, from the
+   register and SPI instruction descriptions of the data sheet. Covered are
+   the three transmit buffers with their priorities, the two receive buffers
+   with the acceptance filters and rollover, CANINTF / EFLG with the error
+   counters up to bus off and its recovery, the operation modes including
+   loopback and listen only, and one-shot transmission. Not covered are the
+   filters on the first two data bytes of standard frames, sleep and wake
+   up, and the RXnBF / TXnRTS pins.
+
+   The other nodes on the bus are one queue of frames given by the harness,
+   each ready to go from a given time. Whenever the bus goes idle the frame
+   winning the arbitration (the lowest identifier) between the head of that
+   queue and the transmit buffer the MCP offers goes next. The frames take
+   their nominal length without stuff bits. The device receives a frame at
+   its end, a bit rate of the device that differs from the one of the bus
+   turns every frame into an error (MERRF). */
+
+#include <string.h>
+
+#include "sim.h"
+#include "mcp.h"
+
+// Registers and bits, the firmware has its own names in mcp.h
+#define R_CANSTAT		0x0E
+#define R_CANCTRL		0x0F
+#define R_TEC			0x1C
+#define R_REC			0x1D
+#define R_CNF3			0x28
+#define R_CNF2			0x29
+#define R_CNF1			0x2A
+#define R_CANINTE		0x2B
+#define R_CANINTF		0x2C
+#define R_EFLG			0x2D
+#define R_TXBCTRL(n)		(0x30 + ((n) << 4))
+#define R_RXBCTRL(n)		(0x60 + ((n) << 4))
+
+#define OPMOD_NORMAL		0x00
+#define OPMOD_SLEEP		0x20
+#define OPMOD_LOOPBACK		0x40
+#define OPMOD_LISTEN		0x60
+#define OPMOD_CONFIG		0x80
+#define OPMOD_MASK		0xE0
+#define CANCTRL_ABAT		0x10
+#define CANCTRL_OSM		0x08
+
+#define TXB_ABTF		0x40
+#define TXB_MLOA		0x20
+#define TXB_TXERR		0x10
+#define TXB_TXREQ		0x08
+#define TXB_TXP			0x03
+
+#define RXB_RXM			0x60
+#define RXB_RXRTR		0x08
+#define RXB_BUKT		0x04
+#define RXB_BUKT1		0x02
+
+#define SIDL_SRR		0x10
+#define SIDL_IDE		0x08
+#define DLC_RTR			0x40
+
+#define INTF_RX0IF		0x01
+#define INTF_RX1IF		0x02
+#define INTF_TX0IF		0x04
+#define INTF_ERRIF		0x20
+#define INTF_MERRF		0x80
+
+#define EFLG_RX1OVR		0x80
+#define EFLG_RX0OVR		0x40
+#define EFLG_TXBO		0x20
+#define EFLG_TXEP		0x10
+#define EFLG_RXEP		0x08
+#define EFLG_TXWAR		0x04
+#define EFLG_RXWAR		0x02
+#define EFLG_EWARN		0x01
+
+#define SIM_BUS_QUEUE		16384
+
+sim_bus_state sim_bus;
+uint64_t sim_mcp_txreq_time;
+uint64_t sim_mcp_txreq_sram;
+
+static uint8_t regs[128];
+static uint16_t tec;
+static uint8_t rec;
+static uint8_t bus_off;
+static uint64_t bus_off_until;
+static uint64_t tx_ready[3];		// When TXREQ was set
+
+static struct {
+	uint8_t selected;
+	uint8_t count;
+	uint8_t instruction;
+	uint8_t address;
+	uint8_t mask;
+	uint8_t read_rx;	// READ RX BUFFER of RXB0 / RXB1 + 1
+	uint64_t selected_at;
+} spi;
+
+static struct {
+	sim_can_frame frame;
+	uint64_t ready;
+} bus_q[SIM_BUS_QUEUE];
+static uint32_t bus_q_head, bus_q_tail;
+
+static struct {
+	uint8_t active;
+	int8_t txb;		// Transmit buffer of the device, -1 for the other nodes
+	uint8_t failed;
+	sim_can_frame frame;
+	uint64_t end;
+} cur;
+static uint64_t bus_idle;
+
+static uint8_t mcp_mode() {
+	return regs[R_CANSTAT] & OPMOD_MASK;
+}
+
+/* Bit time of the device in CPU cycles, TQ = 2 * (BRP + 1) / Fosc with the
+   MCP_CLOCK of the build, on the board the same 16MHz as the AVR */
+static uint32_t mcp_bit_cycles() {
+	uint32_t brp = (regs[R_CNF1] & 0x3F) + 1;
+	uint32_t prseg = (regs[R_CNF2] & 0x07) + 1;
+	uint32_t phseg1 = ((regs[R_CNF2] >> 3) & 0x07) + 1;
+	uint32_t phseg2 = (regs[R_CNF3] & 0x07) + 1;
+	return 2 * (uint64_t)brp * (1 + prseg + phseg1 + phseg2) * SIM_F_CPU / MCP_CLOCK;
+}
+
+uint32_t sim_bus_frame_bits(const sim_can_frame* frame) {
+	// SOF, arbitration, control, data, CRC, ACK, EOF and the intermission
+	return (frame->ext ? 67 : 47) + (frame->rtr ? 0 : 8 * (frame->dlc > 8 ? 8 : frame->dlc));
+}
+
+/* Key for the arbitration, the lower one wins: the base identifier, then
+   RTR of a standard frame / SRR, IDE, the extended identifier, RTR */
+static uint64_t arbitration_key(const sim_can_frame* f) {
+	if(f->ext) {
+		uint64_t base = (f->id >> 18) & 0x7FF;
+		return (base << 21) | (1 << 20) | (1 << 19) | ((f->id & 0x3FFFF) << 1) | f->rtr;
+	}
+	return ((uint64_t)(f->id & 0x7FF) << 21) | ((uint64_t)f->rtr << 20);
+}
+
+static void update_eflg() {
+	uint8_t e = regs[R_EFLG] & (EFLG_RX1OVR | EFLG_RX0OVR);
+	if(bus_off) {
+		e |= EFLG_TXBO;
+	}
+	if(tec >= 128) {
+		e |= EFLG_TXEP;
+	}
+	if(rec >= 128) {
+		e |= EFLG_RXEP;
+	}
+	if(tec >= 96) {
+		e |= EFLG_TXWAR | EFLG_EWARN;
+	}
+	if(rec >= 96) {
+		e |= EFLG_RXWAR | EFLG_EWARN;
+	}
+	if(e != regs[R_EFLG]) {
+		regs[R_CANINTF] |= INTF_ERRIF;
+	}
+	regs[R_EFLG] = e;
+	regs[R_TEC] = tec > 255 ? 255 : tec;
+	regs[R_REC] = rec;
+}
+
+static void mcp_reset() {
+	memset(regs, 0, sizeof(regs));
+	regs[R_CANCTRL] = 0x87;
+	regs[R_CANSTAT] = OPMOD_CONFIG;
+	tec = rec = 0;
+	bus_off = 0;
+	if(cur.active && cur.txb >= 0) {
+		cur.active = 0;
+		bus_idle = cur.end;
+	}
+}
+
+/* Registers */
+
+static uint8_t canstat() {
+	// ICOD, the highest priority pending and enabled interrupt
+	static const uint8_t icod[8] = {6, 7, 3, 4, 5, 1, 2, 0};
+	static const uint8_t order[7] = {0x20, 0x40, 0x04, 0x08, 0x10, 0x01, 0x02};
+	uint8_t f = regs[R_CANINTF] & regs[R_CANINTE];
+	uint8_t code = 0;
+	for(uint8_t i=0; i<7; i++) {
+		if(f & order[i]) {
+			for(uint8_t b=0; b<8; b++) {
+				if(order[i] == (1 << b)) {
+					code = icod[b];
+				}
+			}
+			break;
+		}
+	}
+	return mcp_mode() | (code << 1);
+}
+
+static uint8_t reg_read(uint8_t a) {
+	a &= 0x7F;
+	if((a & 0x0F) == 0x0E) {
+		return canstat();
+	}
+	if((a & 0x0F) == 0x0F) {
+		return regs[R_CANCTRL];
+	}
+	return regs[a];
+}
+
+static void abort_tx(uint8_t n) {
+	if(cur.active && cur.txb == n) {
+		// The frame on the bus completes, only a retransmission is stopped
+		return;
+	}
+	regs[R_TXBCTRL(n)] = (regs[R_TXBCTRL(n)] & ~TXB_TXREQ) | TXB_ABTF;
+}
+
+static void request_tx(uint8_t n) {
+	uint8_t* c = &regs[R_TXBCTRL(n)];
+	if(!(*c & TXB_TXREQ)) {
+		*c = (*c & TXB_TXP) | TXB_TXREQ;
+		tx_ready[n] = sim_cycles;
+		sim_mcp_txreq_time = sim_cycles;
+		sim_mcp_txreq_sram = sim_sram_bytes;
+	}
+}
+
+static void reg_write(uint8_t a, uint8_t v) {
+	a &= 0x7F;
+	uint8_t config = mcp_mode() == OPMOD_CONFIG;
+	if((a & 0x0F) == 0x0E) {
+		return;
+	}
+	if((a & 0x0F) == 0x0F) {
+		regs[R_CANCTRL] = v;
+		regs[R_CANSTAT] = (regs[R_CANSTAT] & ~OPMOD_MASK) | (v & OPMOD_MASK);
+		if(v & CANCTRL_ABAT) {
+			for(uint8_t n=0; n<3; n++) {
+				if(regs[R_TXBCTRL(n)] & TXB_TXREQ) {
+					abort_tx(n);
+				}
+			}
+		}
+		return;
+	}
+	if(a < 0x30) {
+		// Filters, masks and bit timing only in the configuration mode
+		if(a < 0x28 && a != R_TEC && a != R_REC) {
+			if(config) {
+				regs[a] = v;
+			}
+		} else if(a <= R_CNF1) {
+			if(config) {
+				regs[a] = v;
+			}
+		} else if(a == R_CANINTE || a == R_CANINTF) {
+			regs[a] = v;
+		} else if(a == R_EFLG) {
+			regs[a] = (regs[a] & ~(EFLG_RX1OVR | EFLG_RX0OVR)) | (v & (EFLG_RX1OVR | EFLG_RX0OVR));
+		}
+		return;
+	}
+	if(a < 0x60) {
+		uint8_t n = (a - 0x30) >> 4;
+		if((a & 0x0F) == 0) {
+			uint8_t* c = &regs[a];
+			*c = (*c & ~TXB_TXP) | (v & TXB_TXP);
+			if(v & TXB_TXREQ) {
+				request_tx(n);
+			} else if(*c & TXB_TXREQ) {
+				abort_tx(n);
+				*c &= ~TXB_ABTF;
+			}
+		} else if((a & 0x0F) <= 0x0D) {
+			regs[a] = v;
+		}
+		return;
+	}
+	if(a == R_RXBCTRL(0)) {
+		regs[a] = (regs[a] & ~(RXB_RXM | RXB_BUKT | RXB_BUKT1)) | (v & (RXB_RXM | RXB_BUKT)) | ((v & RXB_BUKT) ? RXB_BUKT1 : 0);
+	} else if(a == R_RXBCTRL(1)) {
+		regs[a] = (regs[a] & ~RXB_RXM) | (v & RXB_RXM);
+	}
+}
+
+static uint8_t bit_modifiable(uint8_t a) {
+	a &= 0x7F;
+	return (a >= 0x30 && a < 0x80 && (a & 0x0F) == 0) || (a & 0x0F) == 0x0F || a == 0x0C || a == 0x0D
+		|| (a >= R_CNF3 && a <= R_EFLG);
+}
+
+static uint8_t read_status() {
+	uint8_t s = regs[R_CANINTF] & (INTF_RX0IF | INTF_RX1IF);
+	for(uint8_t n=0; n<3; n++) {
+		if(regs[R_TXBCTRL(n)] & TXB_TXREQ) {
+			s |= 0x04 << (2 * n);
+		}
+		if(regs[R_CANINTF] & (INTF_TX0IF << n)) {
+			s |= 0x08 << (2 * n);
+		}
+	}
+	return s;
+}
+
+static uint8_t rx_status() {
+	uint8_t f = regs[R_CANINTF] & (INTF_RX0IF | INTF_RX1IF);
+	uint8_t s = f << 6;
+	if(f) {
+		uint8_t b = (f & INTF_RX0IF) ? 0x60 : 0x70;
+		uint8_t ext = regs[b + 2] & SIDL_IDE;
+		uint8_t rtr = ext ? (regs[b + 5] & DLC_RTR) : (regs[b + 2] & SIDL_SRR);
+		s |= (ext ? 0x10 : 0) | (rtr ? 0x08 : 0);
+		s |= (f & INTF_RX0IF) ? (regs[0x60] & 0x01) : (regs[0x70] & 0x07);
+	}
+	return s;
+}
+
+/* SPI */
+
+void sim_mcp_select(uint8_t selected) {
+	if(!selected && spi.selected && spi.read_rx) {
+		regs[R_CANINTF] &= ~(INTF_RX0IF << (spi.read_rx - 1));
+		// The instruction, SIDH to DLC and 8 data bytes
+		if(spi.count == 14 && !(spi.instruction & 0x02)) {
+			sim_bus.n_rx_reads++;
+			sim_bus.rx_read_cycles += sim_cycles - spi.selected_at;
+		}
+	}
+	if(selected && !spi.selected) {
+		spi.selected_at = sim_cycles;
+	}
+	spi.selected = selected;
+	spi.count = 0;
+	spi.read_rx = 0;
+}
+
+uint8_t sim_mcp_spi(uint8_t mosi) {
+	if(sim_bus.absent) {
+		return 0xFF;
+	}
+	uint8_t miso = 0;
+	uint8_t c = spi.count;
+	if(spi.count < 0xFF) {
+		spi.count++;
+	}
+	if(!c) {
+		spi.instruction = mosi;
+		if(mosi == 0xC0) {
+			mcp_reset();
+		} else if((mosi & 0xF8) == 0x40 && (mosi & 0x07) <= 5) {
+			// LOAD TX BUFFER at TXBnSIDH or TXBnD0
+			spi.address = R_TXBCTRL(mosi >> 1 & 0x03) + ((mosi & 0x01) ? 6 : 1);
+		} else if((mosi & 0xF8) == 0x80) {
+			for(uint8_t n=0; n<3; n++) {
+				if(mosi & (1 << n)) {
+					request_tx(n);
+				}
+			}
+		} else if((mosi & 0xF9) == 0x90) {
+			// READ RX BUFFER at RXBnSIDH or RXBnD0
+			uint8_t n = (mosi >> 2) & 0x01;
+			spi.address = R_RXBCTRL(n) + ((mosi & 0x02) ? 6 : 1);
+			spi.read_rx = n + 1;
+		}
+		return 0;
+	}
+	uint8_t i = spi.instruction;
+	if(i == 0x03) {
+		if(c == 1) {
+			spi.address = mosi;
+		} else {
+			miso = reg_read(spi.address++);
+		}
+	} else if(i == 0x02) {
+		if(c == 1) {
+			spi.address = mosi;
+		} else {
+			reg_write(spi.address++, mosi);
+		}
+	} else if(i == 0x05) {
+		if(c == 1) {
+			spi.address = mosi;
+		} else if(c == 2) {
+			spi.mask = bit_modifiable(spi.address) ? mosi : 0xFF;
+		} else if(c == 3) {
+			uint8_t a = spi.address;
+			uint8_t v = (reg_read(a) & ~spi.mask) | (mosi & spi.mask);
+			if((a & 0x0F) == 0x0F) {
+				v = (regs[R_CANCTRL] & ~spi.mask) | (mosi & spi.mask);
+			}
+			reg_write(a, v);
+		}
+	} else if(i == 0xA0) {
+		miso = read_status();
+	} else if(i == 0xB0) {
+		miso = rx_status();
+	} else if((i & 0xF8) == 0x40) {
+		reg_write(spi.address++, mosi);
+	} else if((i & 0xF9) == 0x90) {
+		miso = reg_read(spi.address++);
+	}
+	return miso;
+}
+
+uint8_t sim_mcp_int() {
+	return (regs[R_CANINTF] & regs[R_CANINTE]) != 0;
+}
+
+uint8_t sim_mcp_register(uint8_t address) {
+	return reg_read(address);
+}
+
+/* A register write as if over SPI, for the scenarios */
+void sim_mcp_set_register(uint8_t address, uint8_t value) {
+	reg_write(address, value);
+}
+
+/* Receive side */
+
+static void frame_to_regs(const sim_can_frame* f, uint8_t* r) {
+	if(f->ext) {
+		r[0] = f->id >> 21;
+		r[1] = ((f->id >> 13) & 0xE0) | SIDL_IDE | ((f->id >> 16) & 0x03);
+		r[2] = f->id >> 8;
+		r[3] = f->id;
+		r[4] = (f->rtr ? DLC_RTR : 0) | (f->dlc & 0x0F);
+	} else {
+		r[0] = f->id >> 3;
+		r[1] = ((f->id & 0x07) << 5) | (f->rtr ? SIDL_SRR : 0);
+		r[2] = r[3] = 0;
+		r[4] = f->dlc & 0x0F;
+	}
+	memcpy(r + 5, f->data, 8);
+}
+
+static void regs_to_frame(const uint8_t* r, sim_can_frame* f) {
+	f->ext = (r[1] & SIDL_IDE) != 0;
+	if(f->ext) {
+		f->id = ((uint32_t)r[0] << 21) | ((uint32_t)(r[1] & 0xE0) << 13) | ((uint32_t)(r[1] & 0x03) << 16) | ((uint32_t)r[2] << 8) | r[3];
+	} else {
+		f->id = ((uint32_t)r[0] << 3) | (r[1] >> 5);
+	}
+	f->rtr = (r[4] & DLC_RTR) != 0;
+	f->dlc = r[4] & 0x0F;
+	memcpy(f->data, r + 5, 8);
+}
+
+static uint8_t filter_match(const sim_can_frame* f, uint8_t filter, uint8_t mask) {
+	static const uint8_t filter_address[6] = {0x00, 0x04, 0x08, 0x10, 0x14, 0x18};
+	uint8_t r[13];
+	frame_to_regs(f, r);
+	const uint8_t* fr = &regs[filter_address[filter]];
+	const uint8_t* m = &regs[0x20 + 4 * mask];
+	// A filter applies to either standard or extended frames, only all zero
+	// masks let both through
+	if((m[0] | m[1] | m[2] | m[3]) && ((fr[1] & SIDL_IDE) != 0) != f->ext) {
+		return 0;
+	}
+	if((fr[0] ^ r[0]) & m[0]) {
+		return 0;
+	}
+	if((fr[1] ^ r[1]) & m[1] & 0xE3 & (f->ext ? 0xE3 : 0xE0)) {
+		return 0;
+	}
+	if(f->ext && (((fr[2] ^ r[2]) & m[2]) || ((fr[3] ^ r[3]) & m[3]))) {
+		return 0;
+	}
+	return 1;
+}
+
+static void store_rx(uint8_t n, const sim_can_frame* f, uint8_t filhit) {
+	uint8_t* r = &regs[R_RXBCTRL(n)];
+	uint8_t keep = n ? RXB_RXM : (RXB_RXM | RXB_BUKT | RXB_BUKT1);
+	uint8_t ext_rtr = f->rtr && !f->ext;
+	r[0] = (r[0] & keep) | (ext_rtr ? RXB_RXRTR : 0) | filhit;
+	frame_to_regs(f, r + 1);
+	regs[R_CANINTF] |= (INTF_RX0IF << n);
+	sim_bus.n_received++;
+}
+
+static void receive(const sim_can_frame* f) {
+	uint8_t rxm0 = regs[R_RXBCTRL(0)] & RXB_RXM;
+	uint8_t rxm1 = regs[R_RXBCTRL(1)] & RXB_RXM;
+	int8_t hit0 = -1, hit1 = -1;
+	if(rxm0 == RXB_RXM) {
+		hit0 = 0;
+	} else if(filter_match(f, 0, 0)) {
+		hit0 = 0;
+	} else if(filter_match(f, 1, 0)) {
+		hit0 = 1;
+	}
+	if(hit0 >= 0) {
+		if(!(regs[R_CANINTF] & INTF_RX0IF)) {
+			store_rx(0, f, hit0);
+			return;
+		}
+		if(regs[R_RXBCTRL(0)] & RXB_BUKT) {
+			if(!(regs[R_CANINTF] & INTF_RX1IF)) {
+				store_rx(1, f, hit0);
+				return;
+			}
+			regs[R_EFLG] |= EFLG_RX1OVR;
+			sim_bus.n_rx1ovr++;
+		} else {
+			regs[R_EFLG] |= EFLG_RX0OVR;
+			sim_bus.n_rx0ovr++;
+		}
+		regs[R_CANINTF] |= INTF_ERRIF;
+		return;
+	}
+	if(rxm1 == RXB_RXM) {
+		hit1 = 0;
+	} else {
+		for(uint8_t i=2; i<6; i++) {
+			if(filter_match(f, i, 1)) {
+				hit1 = i;
+				break;
+			}
+		}
+	}
+	if(hit1 >= 0) {
+		if(!(regs[R_CANINTF] & INTF_RX1IF)) {
+			store_rx(1, f, hit1);
+			return;
+		}
+		regs[R_EFLG] |= EFLG_RX1OVR;
+		regs[R_CANINTF] |= INTF_ERRIF;
+		sim_bus.n_rx1ovr++;
+	}
+}
+
+/* The bus */
+
+static int8_t device_candidate() {
+	uint8_t m = mcp_mode();
+	if(bus_off || (m != OPMOD_NORMAL && m != OPMOD_LOOPBACK)) {
+		return -1;
+	}
+	int8_t best = -1;
+	for(uint8_t n=0; n<3; n++) {
+		uint8_t c = regs[R_TXBCTRL(n)];
+		if((c & TXB_TXREQ) && (best < 0 || (c & TXB_TXP) >= (regs[R_TXBCTRL(best)] & TXB_TXP))) {
+			best = n;
+		}
+	}
+	return best;
+}
+
+static void tx_done(uint8_t n) {
+	uint8_t* c = &regs[R_TXBCTRL(n)];
+	if(cur.failed) {
+		uint8_t passive = tec >= 128;
+		*c |= TXB_TXERR;
+		regs[R_CANINTF] |= INTF_MERRF;
+		sim_bus.n_merr++;
+		if(sim_bus.tx_fault == SIM_TX_BIT_ERROR || !passive) {
+			tec += 8;
+		}
+		if(tec > 255) {
+			bus_off = 1;
+			bus_off_until = cur.end + 128 * 11 * (uint64_t)mcp_bit_cycles();
+			sim_bus.n_busoff++;
+			sim_bus.busoff_time = cur.end;
+		}
+		if(regs[R_CANCTRL] & CANCTRL_OSM) {
+			*c = (*c & ~TXB_TXREQ) | TXB_ABTF;
+		}
+	} else {
+		*c &= ~(TXB_TXREQ | TXB_TXERR | TXB_MLOA);
+		regs[R_CANINTF] |= (INTF_TX0IF << n);
+		if(tec) {
+			tec--;
+		}
+		if(sim_bus.n_sent < SIM_BUS_LOG_SIZE) {
+			sim_bus.sent[sim_bus.n_sent].frame = cur.frame;
+			sim_bus.sent[sim_bus.n_sent].time = cur.end;
+		}
+		sim_bus.n_sent++;
+		if(mcp_mode() == OPMOD_LOOPBACK) {
+			receive(&cur.frame);
+		}
+	}
+	update_eflg();
+}
+
+static void rx_done() {
+	uint8_t m = mcp_mode();
+	if(bus_off || (m != OPMOD_NORMAL && m != OPMOD_LISTEN)) {
+		return;
+	}
+	if(mcp_bit_cycles() != sim_bus.bit_cycles) {
+		regs[R_CANINTF] |= INTF_MERRF;
+		sim_bus.n_merr++;
+		if(m != OPMOD_LISTEN && rec < 255) {
+			rec++;
+		}
+	} else {
+		receive(&cur.frame);
+		if(rec) {
+			rec--;
+		}
+	}
+	update_eflg();
+}
+
+void sim_mcp_run() {
+	for(;;) {
+		if(cur.active) {
+			if(sim_cycles < cur.end) {
+				return;
+			}
+			cur.active = 0;
+			bus_idle = cur.end;
+			if(cur.txb >= 0) {
+				tx_done(cur.txb);
+			} else {
+				rx_done();
+			}
+			continue;
+		}
+		if(bus_off && sim_cycles >= bus_off_until) {
+			bus_off = 0;
+			tec = rec = 0;
+			update_eflg();
+		}
+		int8_t txb = device_candidate();
+		uint8_t other = bus_q_tail != bus_q_head && mcp_mode() != OPMOD_LOOPBACK;
+		uint64_t start = UINT64_MAX;
+		if(txb >= 0) {
+			start = tx_ready[txb];
+		}
+		if(other && bus_q[bus_q_tail % SIM_BUS_QUEUE].ready < start) {
+			start = bus_q[bus_q_tail % SIM_BUS_QUEUE].ready;
+		}
+		if(start == UINT64_MAX) {
+			return;
+		}
+		if(start < bus_idle) {
+			start = bus_idle;
+		}
+		if(start > sim_cycles) {
+			return;
+		}
+		const sim_can_frame* o = other && bus_q[bus_q_tail % SIM_BUS_QUEUE].ready <= start ? &bus_q[bus_q_tail % SIM_BUS_QUEUE].frame : 0;
+		uint8_t device = txb >= 0 && tx_ready[txb] <= start;
+		cur.active = 1;
+		cur.failed = 0;
+		if(device) {
+			regs_to_frame(&regs[R_TXBCTRL(txb) + 1], &cur.frame);
+			if(o && arbitration_key(o) < arbitration_key(&cur.frame)) {
+				regs[R_TXBCTRL(txb)] |= TXB_MLOA;
+				device = 0;
+			}
+		}
+		if(device) {
+			cur.txb = txb;
+			uint64_t bits = sim_bus_frame_bits(&cur.frame);
+			if(mcp_mode() != OPMOD_LOOPBACK && sim_bus.tx_fault != SIM_TX_OK) {
+				cur.failed = 1;
+				bits += 14;
+			} else if(mcp_mode() != OPMOD_LOOPBACK && mcp_bit_cycles() != sim_bus.bit_cycles) {
+				cur.failed = 1;
+				bits = 20;
+			}
+			cur.end = start + bits * mcp_bit_cycles();
+		} else {
+			cur.txb = -1;
+			cur.frame = *o;
+			cur.end = start + sim_bus_frame_bits(o) * (uint64_t)sim_bus.bit_cycles;
+			bus_q_tail++;
+		}
+	}
+}
+
+void sim_bus_reset(uint32_t bit_cycles) {
+	sim_bus.bit_cycles = bit_cycles;
+	sim_bus.tx_fault = SIM_TX_OK;
+	sim_bus.absent = 0;
+	sim_bus.n_sent = 0;
+	sim_bus.n_received = 0;
+	sim_bus.n_rx0ovr = sim_bus.n_rx1ovr = 0;
+	sim_bus.n_merr = 0;
+	sim_bus.n_busoff = 0;
+	sim_bus.busoff_time = 0;
+	sim_bus.n_rx_reads = 0;
+	sim_bus.rx_read_cycles = 0;
+	bus_q_head = bus_q_tail = 0;
+}
+
+void sim_bus_send(const sim_can_frame* frame, uint64_t ready) {
+	bus_q[bus_q_head % SIM_BUS_QUEUE].frame = *frame;
+	bus_q[bus_q_head % SIM_BUS_QUEUE].ready = ready;
+	bus_q_head++;
+}
+
+uint32_t sim_bus_pending() {
+	return bus_q_head - bus_q_tail + (cur.active ? 1 : 0);
+}
+
+uint64_t sim_bus_idle_at() {
+	return cur.active ? cur.end : bus_idle;
+}
@@ -0,0 +1,518 @@
+/*
+
+  This file is part of gs_usb_leonardo project --
+  gs_usb compatible SocketCAN firmware for Arduino Leonardo /
+  MCP2515 based USB device, see
+
+          https://github.com/woj76/gs_usb_leonardo
+
+  For information about how this code came to be and what / whose
+  work it is based on, please see the LICENSE.md file in the project
+  root directory.
+
+  Copyright (C) 2019 Wojciech Mostowski <wojciech.mostowski@gmail.com>
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the License, or any later
+  version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  The copy of the license can be found in the licenses directory of
+  the project, or on GNU/FSF website at https://www.gnu.org/licenses/.
+
+*/
+
+/* The USB device controller of the ATmega32U4 as seen through the endpoint
+   registers, and the host at the other end of the cable. Each endpoint has
+   the bank the firmware currently works on (buf, read or written through
+   UEDATX) and up to one more bank on the way to / from the host. The host
+   takes IN packets and delivers OUT packets one at a time at roughly the
+   full speed bulk rate. Control transfers are driven by sim_host_control,
+   the setup packet is handed to the firmware with RXSTPI and the transfer
+   completes when the USB_COM routine returns.
+
+   Writes to UEINTX and UECONX are picked up by sim_usb_sync, see sim_avr.c.
+   A UEINTX bit shown to the firmware as 1 and written back as 0 is a clear,
+   bits written as 1 do nothing, as with the real register. */
+
+#include <string.h>
+
+#include <avr/io.h>
+
+#include "sim.h"
+
+#define SIM_USB_EPS		7
+#define SIM_UEINTX_CLEARABLE	((1 << FIFOCON) | (1 << NAKINI) | (1 << NAKOUTI) | (1 << RXSTPI) | (1 << RXOUTI) | (1 << STALLEDI) | (1 << TXINI))
+#define SIM_UEINTX_INTS		((1 << NAKINI) | (1 << NAKOUTI) | (1 << RXSTPI) | (1 << RXOUTI) | (1 << STALLEDI) | (1 << TXINI))
+#define SIM_UDINT_INTS		((1 << UPRSMI) | (1 << EORSMI) | (1 << WAKEUPI) | (1 << EORSTI) | (1 << SOFI) | (1 << SUSPI))
+
+// Bulk packet time on a full speed bus, the data plus about 16 bytes of
+// token, handshake and gaps at 12Mbit/s
+#define SIM_USB_PACKET_CYCLES(len)	(((uint64_t)(len) + 16) * 8 * SIM_F_CPU / 12000000UL)
+
+#define SIM_HOST_QUEUE		8192
+
+typedef struct {
+	uint8_t flags;		// UEINTX as the controller keeps it, without RWAL
+	uint8_t ueintx;		// What the firmware reads and writes
+	uint8_t ueintx_shown;
+	uint8_t ueconx;
+	uint8_t ueconx_shown;
+	uint8_t ueienx;
+	uint8_t uecfg0x;
+	uint8_t uecfg1x;
+	uint8_t uebclx;
+	uint8_t enabled;
+	uint8_t stalled;
+	uint8_t bank;		// The firmware has a bank, IN: to fill, OUT: with a packet
+	uint8_t buf[64];
+	uint8_t len;
+	uint8_t idx;
+	uint8_t queued;		// IN: banks waiting for the host, OUT: packets behind the firmware bank
+	uint8_t q[2][64];
+	uint8_t q_len[2];
+	uint8_t q_first;
+} sim_ep;
+
+typedef struct {
+	uint8_t data[64];
+	uint8_t len;
+} sim_packet;
+
+uint64_t sim_usb_out_time;
+uint64_t sim_usb_out_sram;
+uint32_t sim_usb_in_packets;
+
+SIM_REG static sim_ep eps[SIM_USB_EPS];
+SIM_REG static uint8_t dummy_reg;
+
+static uint8_t host_attached;
+static uint8_t bus_reset_done;
+static uint64_t next_sof;
+static uint8_t host_in_paused;
+
+static sim_packet host_in_q[SIM_HOST_QUEUE];
+static uint32_t host_in_head, host_in_tail;
+static uint8_t host_in_pos;
+static sim_packet host_out_q[SIM_HOST_QUEUE];
+static uint32_t host_out_head, host_out_tail;
+
+static struct {
+	uint8_t active;		// 0 none, 1 IN, 2 OUT
+	uint8_t ep;
+	uint64_t end;
+	sim_packet packet;
+} xfer;
+
+static struct {
+	uint8_t active;
+	uint8_t done;
+	uint8_t in;		// Device to host
+	uint8_t* data;
+	uint16_t len;
+	uint16_t pos;
+	int result;
+} ctrl;
+
+static uint8_t ep_is_control(sim_ep* ep) {
+	return !(ep->uecfg0x & ((1 << EPTYPE1) | (1 << EPTYPE0)));
+}
+
+static uint8_t ep_is_in(sim_ep* ep) {
+	return ep->uecfg0x & (1 << EPDIR);
+}
+
+static uint8_t ep_banks(sim_ep* ep) {
+	return (ep->uecfg1x & (1 << EPBK0)) ? 2 : 1;
+}
+
+static sim_ep* ep_selected() {
+	uint8_t n = UENUM & 0x07;
+	return n < SIM_USB_EPS ? &eps[n] : &eps[0];
+}
+
+static uint8_t ep_ueintx(sim_ep* ep) {
+	uint8_t v = ep->flags;
+	if(ep->bank && !ep_is_control(ep) && ep->idx < (ep_is_in(ep) ? 64 : ep->len)) {
+		v |= (1 << RWAL);
+	}
+	return v;
+}
+
+/* Hands the firmware a new bank when there is one */
+static void ep_update(sim_ep* ep) {
+	if(!ep->enabled || ep_is_control(ep) || ep->bank) {
+		return;
+	}
+	if(ep_is_in(ep)) {
+		if(ep->queued < ep_banks(ep)) {
+			ep->bank = 1;
+			ep->idx = 0;
+			ep->flags |= (1 << TXINI) | (1 << FIFOCON);
+		}
+	} else if(ep->queued) {
+		memcpy(ep->buf, ep->q[ep->q_first], ep->q_len[ep->q_first]);
+		ep->len = ep->q_len[ep->q_first];
+		ep->idx = 0;
+		ep->q_first ^= 1;
+		ep->queued--;
+		ep->bank = 1;
+		ep->flags |= (1 << RXOUTI) | (1 << FIFOCON);
+		sim_usb_out_time = sim_cycles;
+		sim_usb_out_sram = sim_sram_bytes;
+	}
+}
+
+static void ep_enable(sim_ep* ep) {
+	ep->enabled = 1;
+	ep->stalled = 0;
+	ep->bank = 0;
+	ep->idx = ep->len = 0;
+	ep->queued = 0;
+	ep->q_first = 0;
+	ep->ueienx = 0;
+	ep->flags = 0;
+}
+
+static void ctrl_load_out() {
+	sim_ep* ep = &eps[0];
+	uint16_t n = ctrl.len - ctrl.pos;
+	if(n > 64) {
+		n = 64;
+	}
+	memcpy(ep->buf, ctrl.data + ctrl.pos, n);
+	ctrl.pos += n;
+	ep->len = n;
+	ep->idx = 0;
+	ep->flags |= (1 << RXOUTI);
+}
+
+static void ep_cleared(sim_ep* ep, uint8_t cleared) {
+	if(ep_is_control(ep)) {
+		if(cleared & (1 << RXSTPI)) {
+			ep->idx = ep->len = 0;
+			if(ctrl.active && !ctrl.in && ctrl.len) {
+				ctrl_load_out();
+			}
+		}
+		if((cleared & (1 << RXOUTI)) && ctrl.active && !ctrl.in) {
+			ep->idx = ep->len = 0;
+			if(ctrl.pos < ctrl.len) {
+				ctrl_load_out();
+			}
+		}
+		if(cleared & (1 << TXINI)) {
+			if(ctrl.active && ctrl.in) {
+				uint16_t n = ep->idx;
+				if(n > ctrl.len - ctrl.pos) {
+					n = ctrl.len - ctrl.pos;
+				}
+				memcpy(ctrl.data + ctrl.pos, ep->buf, n);
+				ctrl.pos += n;
+				ep->idx = 0;
+			}
+			ep->flags |= (1 << TXINI);
+		}
+		return;
+	}
+	if((cleared & (1 << FIFOCON)) && ep->bank) {
+		ep->bank = 0;
+		if(ep_is_in(ep)) {
+			uint8_t n = (ep->q_first + ep->queued) & 1;
+			memcpy(ep->q[n], ep->buf, ep->idx);
+			ep->q_len[n] = ep->idx;
+			ep->queued++;
+			ep->flags &= ~((1 << TXINI) | (1 << FIFOCON));
+		} else {
+			ep->flags &= ~((1 << RXOUTI) | (1 << FIFOCON));
+		}
+		ep->idx = ep->len = 0;
+	}
+	ep_update(ep);
+}
+
+void sim_usb_sync() {
+	for(uint8_t i=0; i<SIM_USB_EPS; i++) {
+		sim_ep* ep = &eps[i];
+		if(ep->ueconx != ep->ueconx_shown) {
+			uint8_t v = ep->ueconx;
+			if(!(v & (1 << EPEN))) {
+				ep->enabled = 0;
+			} else if(!ep->enabled) {
+				ep_enable(ep);
+				if(!i) {
+					ep->flags = (1 << TXINI);
+				}
+			}
+			if(v & (1 << STALLRQ)) {
+				ep->stalled = 1;
+			}
+			ep->ueconx = ep->ueconx_shown = ep->enabled ? (1 << EPEN) : 0;
+		}
+		if(ep->ueintx != ep->ueintx_shown) {
+			uint8_t cleared = ep->ueintx_shown & ~ep->ueintx & ep->flags & SIM_UEINTX_CLEARABLE;
+			ep->flags &= ~cleared;
+			ep_cleared(ep, cleared);
+			ep->ueintx = ep->ueintx_shown = ep_ueintx(ep);
+		}
+	}
+}
+
+static void sim_usb_bus_reset() {
+	for(uint8_t i=0; i<SIM_USB_EPS; i++) {
+		memset(&eps[i], 0, sizeof(sim_ep));
+	}
+	xfer.active = 0;
+	UDINT |= (1 << EORSTI);
+	next_sof = sim_cycles + SIM_CYCLES_MS(1);
+}
+
+static void sim_usb_xfer() {
+	if(xfer.active) {
+		if(sim_cycles < xfer.end) {
+			return;
+		}
+		sim_ep* ep = &eps[xfer.ep];
+		if(xfer.active == 1) {
+			host_in_q[host_in_head++ % SIM_HOST_QUEUE] = xfer.packet;
+			sim_usb_in_packets++;
+			ep->q_first ^= 1;
+			ep->queued--;
+		} else {
+			uint8_t n = (ep->q_first + ep->queued) & 1;
+			memcpy(ep->q[n], xfer.packet.data, xfer.packet.len);
+			ep->q_len[n] = xfer.packet.len;
+			ep->queued++;
+			host_out_tail++;
+		}
+		xfer.active = 0;
+		ep_update(ep);
+	}
+	for(uint8_t i=1; i<SIM_USB_EPS; i++) {
+		sim_ep* ep = &eps[i];
+		if(!ep->enabled || ep_is_control(ep)) {
+			continue;
+		}
+		if(ep_is_in(ep)) {
+			if(ep->queued && !host_in_paused && host_in_head - host_in_tail < SIM_HOST_QUEUE) {
+				xfer.active = 1;
+				xfer.packet.len = ep->q_len[ep->q_first];
+				memcpy(xfer.packet.data, ep->q[ep->q_first], xfer.packet.len);
+			}
+		} else if(host_out_head != host_out_tail && ep->bank + ep->queued < ep_banks(ep)) {
+			xfer.active = 2;
+			xfer.packet = host_out_q[host_out_tail % SIM_HOST_QUEUE];
+		}
+		if(xfer.active) {
+			xfer.ep = i;
+			xfer.end = sim_cycles + SIM_USB_PACKET_CYCLES(xfer.packet.len);
+			return;
+		}
+	}
+}
+
+void sim_usb_run() {
+	if(!bus_reset_done) {
+		if(host_attached && (USBCON & (1 << USBE)) && !(USBCON & (1 << FRZCLK)) && !(UDCON & (1 << DETACH))) {
+			bus_reset_done = 1;
+			sim_usb_bus_reset();
+		}
+		return;
+	}
+	while(sim_cycles >= next_sof) {
+		next_sof += SIM_CYCLES_MS(1);
+		UDINT |= (1 << SOFI);
+		if(!++UDFNUML) {
+			UDFNUMH = (UDFNUMH + 1) & 0x07;
+		}
+	}
+	sim_usb_xfer();
+	uint8_t ueint = 0;
+	for(uint8_t i=0; i<SIM_USB_EPS; i++) {
+		// The configuration comes after the enable, banks are handed out
+		// from here on
+		ep_update(&eps[i]);
+		if(eps[i].enabled && (ep_ueintx(&eps[i]) & eps[i].ueienx & SIM_UEINTX_INTS)) {
+			ueint |= (1 << i);
+		}
+	}
+	UEINT = ueint;
+}
+
+uint8_t sim_usb_gen_pending() {
+	return UDINT & UDIEN & SIM_UDINT_INTS;
+}
+
+uint8_t sim_usb_com_pending() {
+	return UEINT;
+}
+
+void sim_usb_com_done() {
+	sim_ep* ep = &eps[0];
+	sim_usb_sync();
+	if(ctrl.active && !(ep->flags & (1 << RXSTPI))) {
+		ctrl.result = ep->stalled ? -1 : ctrl.pos;
+		ctrl.active = 0;
+		ctrl.done = 1;
+		ep->stalled = 0;
+		ep->idx = ep->len = 0;
+		ep->flags = (1 << TXINI);
+		ep->ueintx = ep->ueintx_shown = ep->flags;
+	}
+	sim_usb_run();
+}
+
+/* Endpoint registers */
+
+uint8_t* sim_reg_ueintx() {
+	sim_cycles += SIM_COST_REG;
+	sim_poll();
+	sim_ep* ep = ep_selected();
+	ep->ueintx = ep->ueintx_shown = ep_ueintx(ep);
+	return &ep->ueintx;
+}
+
+uint8_t* sim_reg_uedatx() {
+	sim_cycles += SIM_COST_REG;
+	sim_poll();
+	sim_ep* ep = ep_selected();
+	if(ep->idx < sizeof(ep->buf)) {
+		return &ep->buf[ep->idx++];
+	}
+	return &dummy_reg;
+}
+
+uint8_t* sim_reg_uebclx() {
+	sim_cycles += SIM_COST_REG;
+	sim_poll();
+	sim_ep* ep = ep_selected();
+	if(ep_is_control(ep)) {
+		ep->uebclx = (ep->flags & ((1 << RXSTPI) | (1 << RXOUTI))) ? ep->len - ep->idx : ep->idx;
+	} else {
+		ep->uebclx = ep_is_in(ep) ? ep->idx : ep->len - ep->idx;
+	}
+	return &ep->uebclx;
+}
+
+uint8_t* sim_reg_ueconx() {
+	sim_cycles += SIM_COST_REG;
+	sim_poll();
+	sim_ep* ep = ep_selected();
+	ep->ueconx = ep->ueconx_shown = ep->enabled ? (1 << EPEN) : 0;
+	return &ep->ueconx;
+}
+
+uint8_t* sim_reg_ueienx() {
+	sim_cycles += SIM_COST_REG;
+	sim_poll();
+	return &ep_selected()->ueienx;
+}
+
+uint8_t* sim_reg_uecfg0x() {
+	sim_cycles += SIM_COST_REG;
+	sim_poll();
+	return &ep_selected()->uecfg0x;
+}
+
+uint8_t* sim_reg_uecfg1x() {
+	sim_cycles += SIM_COST_REG;
+	sim_poll();
+	return &ep_selected()->uecfg1x;
+}
+
+/* The host side, called from the harness */
+
+void sim_host_attach() {
+	host_attached = 1;
+}
+
+/* A bus reset like after a reboot of the host, the packets queued either way
+   are gone and the device has to be enumerated again */
+void sim_host_reset() {
+	bus_reset_done = 0;
+	host_in_tail = host_in_head;
+	host_in_pos = 0;
+	host_out_tail = host_out_head;
+}
+
+int sim_host_configured() {
+	for(uint8_t i=1; i<SIM_USB_EPS; i++) {
+		if(eps[i].enabled && !ep_is_control(&eps[i])) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int ctrl_ready() {
+	return eps[0].enabled && (eps[0].ueienx & (1 << RXSTPE));
+}
+
+static int ctrl_done() {
+	return ctrl.done;
+}
+
+/* Runs a control transfer, returns the number of bytes transferred in the
+   data stage, -1 on a stall, and -2 when the device did not answer. */
+int sim_host_control(uint8_t type, uint8_t request, uint16_t value, uint16_t index, void* data, uint16_t len) {
+	if(!sim_wait_for(ctrl_ready, SIM_CYCLES_MS(100))) {
+		return -2;
+	}
+	sim_ep* ep = &eps[0];
+	uint8_t setup[8] = {type, request, value & 0xFF, value >> 8, index & 0xFF, index >> 8, len & 0xFF, len >> 8};
+	ctrl.active = 1;
+	ctrl.done = 0;
+	ctrl.in = type & 0x80;
+	ctrl.data = data;
+	ctrl.len = len;
+	ctrl.pos = 0;
+	memcpy(ep->buf, setup, 8);
+	ep->len = 8;
+	ep->idx = 0;
+	ep->flags |= (1 << RXSTPI);
+	if(!sim_wait_for(ctrl_done, SIM_CYCLES_MS(100))) {
+		ctrl.active = 0;
+		return -2;
+	}
+	return ctrl.result;
+}
+
+void sim_host_out(const void* data, uint8_t len) {
+	sim_packet* p = &host_out_q[host_out_head++ % SIM_HOST_QUEUE];
+	memcpy(p->data, data, len);
+	p->len = len;
+}
+
+int sim_host_out_pending() {
+	return host_out_head - host_out_tail;
+}
+
+/* Frames packed into one IN transfer (USB_IN_BATCH) are handed out one at a
+   time. They are all of the same size, 20 bytes or 24 with the time stamp,
+   and up to 64 bytes the size follows from the length of the transfer. */
+int sim_host_in(void* data) {
+	if(host_in_tail == host_in_head) {
+		return -1;
+	}
+	sim_packet* p = &host_in_q[host_in_tail % SIM_HOST_QUEUE];
+	uint8_t len = p->len;
+	if(len > 24) {
+		len = (len % 20) ? 24 : 20;
+	}
+	memcpy(data, p->data + host_in_pos, len);
+	host_in_pos += len;
+	if(host_in_pos >= p->len) {
+		host_in_pos = 0;
+		host_in_tail++;
+	}
+	return len;
+}
+
+void sim_host_in_pause(int pause) {
+	host_in_paused = pause;
+}
@@ -0,0 +1,258 @@
+/*
+
+  This file is part of gs_usb_leonardo project --
+  gs_usb compatible SocketCAN firmware for Arduino Leonardo /
+  MCP2515 based USB device, see
+
+          https://github.com/woj76/gs_usb_leonardo
+
+  For information about how this code came to be and what / whose
+  work it is based on, please see the LICENSE.md file in the project
+  root directory.
+
+  Copyright (C) 2019 Wojciech Mostowski <wojciech.mostowski@gmail.com>
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the License, or any later
+  version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  The copy of the license can be found in the licenses directory of
+  the project, or on GNU/FSF website at https://www.gnu.org/licenses/.
+
+*/
+
+/* ISO-TP (ISO 15765-2, normal addressing) help for the flashing kind of
+   transfers, see gs_device_isotp. The host round trip for every Flow Control
+   frame costs at least a USB frame, with dozens of them per flash block that
+   is most of the transfer time.
+
+   With GS_ISOTP_AUTO_FC a First Frame of the ECU (on rx_id) is answered
+   from the MCP interrupt with the configured Flow Control frame, and so is
+   every block_size-th Consecutive Frame while the message has more to come.
+
+   With GS_ISOTP_PACE_CF the host queues a whole segmented message on tx_id
+   at once. After the First Frame goes out the Consecutive Frames are held in
+   the TX FIFO until the Flow Control frame of the ECU comes in, then let out
+   as its block size and STmin say (STmin counted from the end of the
+   previous one on the bus). An overflow answer, or no answer within N_Bs,
+   drops the rest of the message with the echoes still sent. While a frame
+   is held isotp_tx_held is set, and cleared by the interrupt that ends the
+   hold: the MCP one for the Flow Control frame or the previous frame sent,
+   the Timer1 compare C one for the end of STmin or N_Bs. The main loop
+   sleeps in between.
+
+   The frames go to and come from the host as usual either way, only the
+   Flow Control frames of the device are not echoed. */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "isotp.h"
+#include "mcp.h"
+#include "mcp_gs.h"
+#include "timer.h"
+#include "bool.h"
+
+// Protocol control information, the high nibble of the first data byte
+#define ISOTP_PCI_MASK		0xF0
+#define ISOTP_SF		0x00
+#define ISOTP_FF		0x10
+#define ISOTP_CF		0x20
+#define ISOTP_FC		0x30
+// Flow status, the low nibble of a Flow Control frame
+#define ISOTP_FS_CTS		0
+#define ISOTP_FS_WAIT		1
+
+// Transmit side states
+#define ISOTP_TX_IDLE		0
+#define ISOTP_TX_WAIT_FC	1
+#define ISOTP_TX_SEND		2
+#define ISOTP_TX_ABORT		3
+
+// How long the ECU has to send a Flow Control frame
+#define ISOTP_N_BS_US		1000000
+
+uint8_t isotp_flags;
+uint32_t isotp_tx_id;
+uint32_t isotp_rx_id;
+uint8_t isotp_block_size;
+uint8_t isotp_fc_buf[13];
+volatile uint8_t isotp_fc_due;
+
+uint16_t isotp_rx_left;		// Bytes of the ECU message still to come
+uint8_t isotp_rx_block;		// Consecutive Frames left to the next Flow Control
+
+uint8_t isotp_tx_state;
+uint8_t isotp_tx_block;		// Consecutive Frames left to the next Flow Control, 0 for no limit
+uint32_t isotp_tx_gap;		// STmin of the ECU in microseconds
+uint32_t isotp_tx_since;	// Start of the wait for the Flow Control
+uint32_t isotp_tx_next;		// Earliest load of the next Consecutive Frame
+uint8_t isotp_tx_busy;		// Buffer with a Consecutive Frame not sent yet
+volatile uint8_t isotp_tx_held;
+
+ISR(TIMER1_COMPC_vect) {
+	TIMSK1 &= ~(1 << OCIE1C);
+	isotp_tx_held = FALSE;
+}
+
+void isotp_reset() {
+	register uint8_t _sreg = SREG;
+	cli();
+	isotp_fc_due = FALSE;
+	isotp_rx_left = 0;
+	isotp_tx_state = ISOTP_TX_IDLE;
+	isotp_tx_busy = MCP_N_TXBUFFERS;
+	isotp_tx_held = FALSE;
+	TIMSK1 &= ~(1 << OCIE1C);
+	SREG = _sreg;
+}
+
+/* Flags of 0 turn the engine off. Returns FALSE for unknown flags. */
+uint8_t isotp_set(volatile gs_device_isotp* isotp) {
+	if(isotp->flags & ~(GS_ISOTP_AUTO_FC | GS_ISOTP_PACE_CF)) {
+		return FALSE;
+	}
+	gs_host_frame hf;
+	hf.can_id = isotp->tx_id;
+	hf.can_dlc = 8;
+	hf.data[0] = ISOTP_FC | ISOTP_FS_CTS;
+	hf.data[1] = isotp->block_size;
+	hf.data[2] = isotp->st_min;
+	for(uint8_t i=3; i<8; i++) {
+		hf.data[i] = isotp->padding;
+	}
+	register uint8_t _sreg = SREG;
+	cli();
+	isotp_flags = isotp->flags;
+	isotp_tx_id = isotp->tx_id;
+	isotp_rx_id = isotp->rx_id;
+	isotp_block_size = isotp->block_size;
+	gs_host_frame_to_mcp(&hf, isotp_fc_buf);
+	isotp_reset();
+	SREG = _sreg;
+	return TRUE;
+}
+
+/* STmin in microseconds, the reserved values mean the longest one */
+uint32_t isotp_st_min_us(uint8_t st_min) {
+	if(st_min <= 0x7F) {
+		return (uint32_t)st_min * 1000;
+	}
+	if(st_min >= 0xF1 && st_min <= 0xF9) {
+		return (st_min - 0xF0) * 100;
+	}
+	return 127000;
+}
+
+/* Looks at a received frame, from the MCP interrupt */
+void isotp_rx(volatile gs_host_frame* hf, uint32_t ts) {
+	if(!isotp_flags || hf->can_id != isotp_rx_id) {
+		return;
+	}
+	uint8_t dlc = hf->can_dlc;
+	if(!dlc) {
+		return;
+	}
+	uint8_t* data = (uint8_t *)hf->data;
+	uint8_t pci = data[0] & ISOTP_PCI_MASK;
+	if(isotp_flags & GS_ISOTP_AUTO_FC) {
+		if(pci == ISOTP_FF && dlc >= 2) {
+			uint16_t len = ((data[0] & 0x0F) << 8) | data[1];
+			// Lengths over 4095 (escaped with 0) are not followed
+			isotp_rx_left = len > 6 ? len - 6 : 0;
+			isotp_rx_block = isotp_block_size;
+			isotp_fc_due = TRUE;
+		} else if(pci == ISOTP_CF && isotp_rx_left) {
+			isotp_rx_left = isotp_rx_left > 7 ? isotp_rx_left - 7 : 0;
+			if(isotp_rx_left && isotp_block_size && !--isotp_rx_block) {
+				isotp_rx_block = isotp_block_size;
+				isotp_fc_due = TRUE;
+			}
+		}
+	}
+	if((isotp_flags & GS_ISOTP_PACE_CF) && pci == ISOTP_FC && dlc >= 3 && isotp_tx_state != ISOTP_TX_IDLE) {
+		uint8_t fs = data[0] & 0x0F;
+		isotp_tx_held = FALSE;
+		if(fs == ISOTP_FS_CTS) {
+			isotp_tx_state = ISOTP_TX_SEND;
+			isotp_tx_block = data[1];
+			isotp_tx_gap = isotp_st_min_us(data[2]);
+			isotp_tx_next = ts;
+		} else if(fs == ISOTP_FS_WAIT) {
+			isotp_tx_state = ISOTP_TX_WAIT_FC;
+			isotp_tx_since = ts;
+		} else {
+			isotp_tx_state = ISOTP_TX_ABORT;
+		}
+	}
+}
+
+/* Returns the Flow Control frame in the MCP transmit buffer format */
+uint8_t* isotp_take_fc() {
+	isotp_fc_due = FALSE;
+	return isotp_fc_buf;
+}
+
+/* Decides on the oldest frame of the TX FIFO that is about to go into the
+   transmit buffer txb_index. Needs to run with interrupts disabled. */
+uint8_t isotp_tx(volatile gs_host_frame* hf, uint8_t txb_index) {
+	if(!(isotp_flags & GS_ISOTP_PACE_CF) || hf->can_id != isotp_tx_id || !hf->can_dlc) {
+		return ISOTP_SEND;
+	}
+	uint8_t pci = hf->data[0] & ISOTP_PCI_MASK;
+	if(pci == ISOTP_FF) {
+		isotp_tx_state = ISOTP_TX_WAIT_FC;
+		isotp_tx_since = timer_now();
+		return ISOTP_SEND;
+	}
+	if(pci == ISOTP_SF) {
+		isotp_tx_state = ISOTP_TX_IDLE;
+	}
+	if(pci != ISOTP_CF || isotp_tx_state == ISOTP_TX_IDLE) {
+		return ISOTP_SEND;
+	}
+	if(isotp_tx_state == ISOTP_TX_ABORT) {
+		return ISOTP_DROP;
+	}
+	if(isotp_tx_state == ISOTP_TX_WAIT_FC) {
+		if(timer_now() - isotp_tx_since < ISOTP_N_BS_US) {
+			timer_wake(TIMER_WAKE_C, isotp_tx_since + ISOTP_N_BS_US);
+			isotp_tx_held = TRUE;
+			return ISOTP_HOLD;
+		}
+		isotp_tx_state = ISOTP_TX_ABORT;
+		return ISOTP_DROP;
+	}
+	if(isotp_tx_gap) {
+		if(isotp_tx_busy != MCP_N_TXBUFFERS) {
+			isotp_tx_held = TRUE;
+			return ISOTP_HOLD;
+		}
+		if((int32_t)(timer_now() - isotp_tx_next) < 0) {
+			timer_wake(TIMER_WAKE_C, isotp_tx_next);
+			isotp_tx_held = TRUE;
+			return ISOTP_HOLD;
+		}
+		isotp_tx_busy = txb_index;
+	}
+	if(isotp_tx_block && !--isotp_tx_block) {
+		isotp_tx_state = ISOTP_TX_WAIT_FC;
+		isotp_tx_since = timer_now();
+	}
+	return ISOTP_SEND;
+}
+
+/* The frame in txb_index went out at ts, from the MCP interrupt */
+void isotp_tx_done(uint8_t txb_index, uint32_t ts) {
+	if(isotp_tx_busy == txb_index) {
+		isotp_tx_busy = MCP_N_TXBUFFERS;
+		isotp_tx_held = FALSE;
+		isotp_tx_next = ts + isotp_tx_gap;
+	}
+}
@@ -0,0 +1,51 @@
+/*
+
+  This file is part of gs_usb_leonardo project --
+  gs_usb compatible SocketCAN firmware for Arduino Leonardo /
+  MCP2515 based USB device, see
+
+          https://github.com/woj76/gs_usb_leonardo
+
+  For information about how this code came to be and what / whose
+  work it is based on, please see the LICENSE.md file in the project
+  root directory.
+
+  Copyright (C) 2019 Wojciech Mostowski <wojciech.mostowski@gmail.com>
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the License, or any later
+  version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  The copy of the license can be found in the licenses directory of
+  the project, or on GNU/FSF website at https://www.gnu.org/licenses/.
+
+*/
+
+#ifndef ISOTP_H
+#define ISOTP_H
+
+#include <stdint.h>
+#include "gs_usb.h"
+
+// What isotp_tx tells to do with a frame from the host
+#define ISOTP_SEND		0
+#define ISOTP_HOLD		1	// Leave it in the FIFO for now
+#define ISOTP_DROP		2	// Echo it without sending, the transfer was aborted
+
+extern volatile uint8_t isotp_fc_due;
+extern volatile uint8_t isotp_tx_held;
+
+uint8_t isotp_set(volatile gs_device_isotp* isotp);
+void isotp_reset();
+void isotp_rx(volatile gs_host_frame* hf, uint32_t ts);
+uint8_t* isotp_take_fc();
+uint8_t isotp_tx(volatile gs_host_frame* hf, uint8_t txb_index);
+void isotp_tx_done(uint8_t txb_index, uint32_t ts);
+
+#endif
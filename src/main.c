@@ -31,37 +31,88 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
 
 #include "usb.h"
 #include "gs_usb.h"
 #include "mcp.h"
 #include "mcp_gs.h"
+#include "timer.h"
+#include "filter.h"
+#include "cyclic.h"
+#include "isotp.h"
+#include "busstat.h"
+#include "autobaud.h"
+#include "can.h"
 #include "bool.h"
 #include "leds.h"
 
-#define HOST_FRAME_OUT_1_IDX	0
-#define HOST_FRAME_OUT_2_IDX	1
-#define HOST_FRAME_IN_IDX	2
-#define HOST_FRAME_IN_NUM	MCP_N_TXBUFFERS
-#define HOST_FRAME_ERR_IDX	(HOST_FRAME_IN_IDX + HOST_FRAME_IN_NUM)
-#define HOST_FRAMES_SIZE	(HOST_FRAME_ERR_IDX + 1)
+/* Frames on their way to the host (received CAN frames, echoes of the sent
+   ones and error frames) are queued in this ring by the MCP interrupt and
+   sent out from the main loop, this way the interrupt routine only talks to
+   the MCP and never waits for the USB IN endpoint. The last few slots are
+   kept for the echoes of the frames in the MCP transmit buffers and an error
+   frame, received CAN frames dropped on a full ring are reported to the host
+   with the overflow flag set on the next received frame that makes it. */
+#define HOST_RING_SIZE		16	// Power of 2, 16 frames take 384 bytes of SRAM
+#define HOST_RING_MASK		(HOST_RING_SIZE - 1)
+#define HOST_RING_RESERVED	(MCP_N_TXBUFFERS + 1)
 
-volatile gs_host_frame host_frames[HOST_FRAMES_SIZE];
+volatile gs_host_frame host_ring[HOST_RING_SIZE];
+volatile uint8_t host_ring_head;
+volatile uint8_t host_ring_tail;
+volatile uint8_t host_ring_overflow;
+
+// A received frame that finds no room in the ring is read into this one
+volatile gs_host_frame host_ring_spare;
+
+/* Frames from the host wait in this FIFO for a free MCP transmit buffer. The
+   OUT endpoint interrupt wakes main_loop, which takes them in as long as
+   there is room (see host_out), and a buffer is refilled from the MCP
+   interrupt as soon as its frame is sent. The MCP keeps the frames
+   in the loading order (see mcp_enqueue_can_frame), so they leave in the
+   order the host sent them. */
+#define TX_FIFO_SIZE		8	// Power of 2, 8 frames take 192 bytes of SRAM
+#define TX_FIFO_MASK		(TX_FIFO_SIZE - 1)
+
+volatile gs_host_frame tx_fifo[TX_FIFO_SIZE];
+volatile uint8_t tx_fifo_head;
+volatile uint8_t tx_fifo_tail;
+// A packet announced by the OUT endpoint interrupt, which stays off until
+// main_loop has taken it
+volatile uint8_t host_out_due;
+
+// The frames loaded into the MCP transmit buffers, kept for sending the echo back
+volatile gs_host_frame host_frames[MCP_N_TXBUFFERS];
+
+// Echo id of the frames the device sends by itself (cyclic, ISO-TP Flow
+// Control) in host_frames, their echo is not sent
+#define DEVICE_ECHO_ID		0xFFFFFFFE
 
-uint8_t mcp_index;
 volatile uint8_t mcp_free[MCP_N_TXBUFFERS];
 
+// Transmissions held after a bus off until the restart alarm, and the
+// number of FIFO frames to drop after it (see gs_device_restart)
+volatile uint8_t bus_off_hold;
+volatile uint8_t tx_fifo_flush;
+
+// The size of frames sent to the host, with or without the time stamp
+uint8_t host_frame_size;
+
+void host_out();
+
 usb_device_configuration gs_udc = {
 	.usb_init_func = gs_usb_init,
 	.usb_descriptor_func = gs_usb_descriptor,
 	.usb_setup_func = gs_usb_setup,
+	.usb_out_func = host_out,
 	.usb_interface_num = GS_USB_INTERFACE,
 	.usb_endpoint_in = GS_USB_ENDPOINT_IN,
 	.usb_endpoint_out = GS_USB_ENDPOINT_OUT
 };
 
 void clear_data() {
-	for(uint8_t i=0; i<HOST_FRAMES_SIZE; i++) {
+	for(uint8_t i=0; i<MCP_N_TXBUFFERS; i++) {
 		host_frames[i].echo_id = 0;
 		host_frames[i].can_id = 0;
 		host_frames[i].can_dlc = 0;
@@ -72,127 +123,429 @@ void clear_data() {
 			host_frames[i].data[j] = 0;
 		}
 	}
-	// These three freames are the actual frames (non echo).
-	host_frames[HOST_FRAME_OUT_1_IDX].echo_id =
-		host_frames[HOST_FRAME_OUT_2_IDX].echo_id =
-		host_frames[HOST_FRAME_ERR_IDX].echo_id =
-		0xFFFFFFFF;
+	host_ring_head = host_ring_tail = 0;
+	host_ring_overflow = FALSE;
+	tx_fifo_head = tx_fifo_tail = 0;
+	host_out_due = FALSE;
 	mcp_free[0] = mcp_free[1] = mcp_free[2] = TRUE;
-	mcp_index = 0;
+	timer_alarm_cancel();
+	cyclic_stop();
+	isotp_reset();
+	bus_off_hold = FALSE;
+	tx_fifo_flush = 0;
+}
+
+uint8_t host_ring_free() {
+	return HOST_RING_SIZE - (uint8_t)(host_ring_head - host_ring_tail);
+}
+
+/* Returns the next free ring slot prepared for a non-echo frame, or 0 when
+   there are no more than reserved slots left. */
+volatile gs_host_frame* host_ring_next(uint8_t reserved) {
+	if(host_ring_free() <= reserved) {
+		return 0;
+	}
+	volatile gs_host_frame* hf = &host_ring[host_ring_head & HOST_RING_MASK];
+	hf->echo_id = 0xFFFFFFFF;
+	hf->channel = 0;
+	hf->flags = 0;
+	hf->reserved = 0;
+	return hf;
+}
+
+/* Passes on a received frame that already sits in the next ring slot (or
+   the spare one), the slot is only taken if the frame goes to the host */
+void host_ring_put_rx(volatile gs_host_frame* hf, uint32_t ts) {
+	gs_stats.rx_frames++;
+	if(filter_enabled && !filter_match(hf->can_id)) {
+		return;
+	}
+	if(hf != &host_ring_spare) {
+		hf->timestamp_us = ts;
+		if(host_ring_overflow) {
+			hf->flags = GS_CAN_FLAG_OVERFLOW;
+			host_ring_overflow = FALSE;
+		}
+		host_ring_head++;
+	} else {
+		host_ring_overflow = TRUE;
+		gs_stats.rx_dropped++;
+	}
+}
+
+/* Reads the MCP receive buffer of the READ RX BUFFER instruction straight
+   into the next ring slot, no copy of the frame is made on the way to the
+   IN endpoint */
+void host_ring_rx(uint8_t instruction, uint32_t ts) {
+	volatile gs_host_frame* hf = host_ring_next(HOST_RING_RESERVED);
+	if(!hf) {
+		hf = &host_ring_spare;
+	}
+	mcp_to_gs_host_frame(instruction, hf);
+	isotp_rx(hf, ts);
+	if(busstat_rx(hf)) {
+		host_ring_put_rx(hf, ts);
+	}
+}
+
+/* Echoes the frame of a transmit buffer and frees the buffer. One that was
+   dropped instead of sent (by the bus off restart) still gets its echo, the
+   host needs it to free its transmit slot, but it is not counted. */
+void host_ring_put_echo(uint8_t txb_index, uint8_t sent, uint32_t ts) {
+	isotp_tx_done(txb_index, ts);
+	if(sent) {
+		busstat_tx(&host_frames[txb_index]);
+	}
+	if(host_frames[txb_index].echo_id != DEVICE_ECHO_ID && host_ring_free()) {
+		volatile gs_host_frame* hf = &host_ring[host_ring_head & HOST_RING_MASK];
+		*hf = host_frames[txb_index];
+		hf->timestamp_us = ts;
+		host_ring_head++;
+		if(sent) {
+			gs_stats.echo_frames++;
+		}
+	}
+	mcp_free[txb_index] = TRUE;
+}
+
+/* Moves the oldest host frame from the FIFO into the free MCP transmit
+   buffer, provided the ring has room for its echo. Needs to run with
+   interrupts disabled. */
+void tx_fifo_load(uint8_t txb_index) {
+	if(bus_off_hold || tx_fifo_tail == tx_fifo_head || host_ring_free() <= HOST_RING_RESERVED) {
+		return;
+	}
+	uint8_t drop = tx_fifo_flush;
+	if(!drop) {
+		uint8_t pace = isotp_tx(&tx_fifo[tx_fifo_tail & TX_FIFO_MASK], txb_index);
+		if(pace == ISOTP_HOLD) {
+			return;
+		}
+		drop = pace == ISOTP_DROP;
+	}
+	if(drop) {
+		// Dropped by the bus off restart or an aborted ISO-TP transfer, only
+		// the echo goes back
+		volatile gs_host_frame* hf = &host_ring[host_ring_head & HOST_RING_MASK];
+		*hf = tx_fifo[tx_fifo_tail & TX_FIFO_MASK];
+		hf->timestamp_us = timer_now();
+		host_ring_head++;
+		tx_fifo_tail++;
+		if(tx_fifo_flush) {
+			tx_fifo_flush--;
+		}
+		return;
+	}
+	volatile gs_host_frame* hf = &host_frames[txb_index];
+	*hf = tx_fifo[tx_fifo_tail & TX_FIFO_MASK];
+	tx_fifo_tail++;
+	mcp_free[txb_index] = FALSE;
+	// The data bytes go to the MCP from the frame kept for the echo
+	uint8_t head[5];
+	uint8_t n = gs_host_frame_to_mcp_head(hf, head);
+	mcp_enqueue_can_frame(txb_index, head, (uint8_t *)hf->data, n);
+	gs_stats.tx_frames++;
+}
+
+/* Keeps the high water mark of the host ring, interrupts need to be off */
+void host_ring_peak() {
+	uint8_t n = host_ring_head - host_ring_tail;
+	if(n > gs_stats.host_ring_peak) {
+		gs_stats.host_ring_peak = n;
+	}
+}
+
+/* Loads a frame of the device itself, kept in the MCP transmit buffer
+   format in buf, into the free MCP transmit buffer. Needs to run with
+   interrupts disabled. */
+void device_load(uint8_t txb_index, uint8_t* buf) {
+	volatile gs_host_frame* hf = &host_frames[txb_index];
+	hf->echo_id = DEVICE_ECHO_ID;
+	// The id and length the bus statistics count at the echo, in the
+	// transmit buffer format RTR is in the DLC byte for both id lengths
+	hf->can_id = mcp_to_can_id(buf) | ((buf[4] & MCP_TXB_RTR_M) ? CAN_RTR_FLAG : 0);
+	hf->can_dlc = buf[4] & MCP_DLC_MASK;
+	mcp_free[txb_index] = FALSE;
+	mcp_enqueue_can_frame(txb_index, buf, buf + 5, buf[4] & MCP_DLC_MASK);
+	gs_stats.tx_frames++;
+}
+
+/* Refills a free MCP transmit buffer, a due ISO-TP Flow Control frame goes
+   first, then a due cyclic frame */
+void tx_load(uint8_t txb_index) {
+	if(bus_off_hold) {
+		return;
+	}
+	if(isotp_fc_due) {
+		device_load(txb_index, isotp_take_fc());
+	} else if(cyclic_pending) {
+		device_load(txb_index, cyclic_take());
+	} else {
+		tx_fifo_load(txb_index);
+	}
+}
+
+/* Ends the hold of the transmissions after a bus off, the frames in the MCP
+   buffers are either started again or dropped together with the ones
+   waiting in the FIFO. The error frame of the restart tells the host how
+   many were dropped, with CAN_ERR_CRTL_TX_OVERFLOW and their number in
+   data[5], their echoes are not to be taken for sent frames. Needs to run
+   with interrupts disabled. */
+void bus_off_restart() {
+	uint32_t ts = timer_now();
+	bus_off_hold = FALSE;
+	timer_alarm_fired = FALSE;
+	uint8_t tx = 0;
+	uint8_t dropped = 0;
+	if(gs_restart.flags & GS_RESTART_FLUSH_TX) {
+		tx = mcp_tx_drop();
+		tx_fifo_flush = tx_fifo_head - tx_fifo_tail;
+		dropped = tx_fifo_flush;
+		for(uint8_t n=0; n<MCP_N_TXBUFFERS; n++) {
+			if((tx & (MCP_TX0IF << n)) && host_frames[n].echo_id != DEVICE_ECHO_ID) {
+				dropped++;
+			}
+		}
+	} else {
+		mcp_tx_resume();
+	}
+	// Before the echoes, those have their slots reserved
+	volatile gs_host_frame* hf = host_ring_next(MCP_N_TXBUFFERS);
+	if(hf) {
+		hf->timestamp_us = ts;
+		hf->can_id = CAN_ERR_FLAG | CAN_ERR_RESTARTED;
+		hf->can_dlc = 8;
+		for(uint8_t i=0; i<8; i++) {
+			hf->data[i] = 0;
+		}
+		if(dropped) {
+			hf->can_id |= CAN_ERR_CTRL;
+			hf->data[1] = CAN_ERR_CRTL_TX_OVERFLOW;
+			hf->data[5] = dropped;
+		}
+		host_ring_head++;
+	}
+	while(tx) {
+		uint8_t n = mcp_first_sent(tx);
+		tx &= ~(MCP_TX0IF << n);
+		host_ring_put_echo(n, FALSE, ts);
+	}
+}
+
+/* From the USB_COM routine for a packet on the OUT endpoint: only turns the
+   endpoint interrupt off and leaves the packet to main_loop, the interrupt
+   wakes it up. Reading it here would hold off the MCP interrupt for the
+   whole copy. */
+void host_out() {
+	usb_out_interrupt(FALSE);
+	host_out_due = TRUE;
+}
+
+/* Takes the packet announced by host_out into the TX FIFO, which has room
+   for it. The endpoint interrupt goes back on right after, with a second
+   bank waiting it is raised again at once. A full FIFO leaves it off, the
+   host is then held off by the endpoint itself until a frame was sent. */
+void host_out_take() {
+	if(usb_receive((uint8_t *)&tx_fifo[tx_fifo_head & TX_FIFO_MASK], GS_HOST_FRAME_SIZE)) {
+		tx_fifo_head++;
+		if((uint8_t)(tx_fifo_head - tx_fifo_tail) == TX_FIFO_SIZE) {
+			gs_stats.tx_fifo_full++;
+			return;
+		}
+	}
+	host_out_due = FALSE;
+	usb_out_interrupt(TRUE);
+}
+
+/* Whether a free MCP transmit buffer has a frame waiting for it */
+uint8_t tx_refill_due() {
+	return ((tx_fifo_tail != tx_fifo_head && (!isotp_tx_held || tx_fifo_flush)) || cyclic_pending || isotp_fc_due) && (mcp_free[0] || mcp_free[1] || mcp_free[2]);
+}
+
+/* Sends out the oldest queued frame, if there is any and the IN endpoint
+   has a free bank for it */
+void host_ring_send() {
+	if(host_ring_tail != host_ring_head) {
+		volatile gs_host_frame* hf = &host_ring[host_ring_tail & HOST_RING_MASK];
+		if(usb_send((uint8_t *)hf, host_frame_size, hf->echo_id == 0xFFFFFFFF)) {
+			host_ring_tail++;
+		}
+	}
 }
 
 ISR(INT6_vect) {
+	// The raw timer is enough for the duration, it wraps after 32ms
+	uint16_t start = TCNT1;
+	// Everything reported by this interrupt gets the time of its entry
+	uint32_t ts = timer_now();
 	uint8_t ri = mcp_service_interrupt();
 	if(ri & MCP_RX0IF) {
-		mcp_to_gs_host_frame(mcp_buf_in[0], &host_frames[HOST_FRAME_OUT_1_IDX]);
-		usb_send((uint8_t *)&host_frames[HOST_FRAME_OUT_1_IDX], sizeof(gs_host_frame), TRUE);
+		host_ring_rx(MCP_READ_RX0, ts);
+		ri = mcp_rx_rollover(ri);
 	}
 	if(ri & MCP_RX1IF) {
-		mcp_to_gs_host_frame(mcp_buf_in[1], &host_frames[HOST_FRAME_OUT_2_IDX]);
-		usb_send((uint8_t *)&host_frames[HOST_FRAME_OUT_2_IDX], sizeof(gs_host_frame), TRUE);
+		host_ring_rx(MCP_READ_RX1, ts);
 	}
-	if(ri & MCP_TX0IF) {
-		usb_send((uint8_t *)&host_frames[HOST_FRAME_IN_IDX], sizeof(gs_host_frame), FALSE);
-		mcp_free[0] = TRUE;
+	// Echoes go to the host in the order the frames went on the bus, then the
+	// freed buffers are refilled
+	uint8_t tx = ri & MCP_TX_IF_MASK;
+	while(tx) {
+		uint8_t n = mcp_first_sent(tx);
+		tx &= ~(MCP_TX0IF << n);
+		host_ring_put_echo(n, TRUE, ts);
 	}
-	if(ri & MCP_TX1IF) {
-		usb_send((uint8_t *)&host_frames[HOST_FRAME_IN_IDX + 1], sizeof(gs_host_frame), FALSE);
-		mcp_free[1] = TRUE;
+	for(uint8_t n=0; n<MCP_N_TXBUFFERS; n++) {
+		if(ri & (MCP_TX0IF << n)) {
+			tx_load(n);
+		}
 	}
-	if(ri & MCP_TX2IF) {
-		usb_send((uint8_t *)&host_frames[HOST_FRAME_IN_IDX + 2], sizeof(gs_host_frame), FALSE);
-		mcp_free[2] = TRUE;
+	// A Flow Control frame does not wait for a buffer to be freed
+	if(isotp_fc_due) {
+		for(uint8_t n=0; n<MCP_N_TXBUFFERS; n++) {
+			if(mcp_free[n]) {
+				tx_load(n);
+				break;
+			}
+		}
 	}
 	if(ri & MCP_ERRIF) {
-		mcp_to_err_host_frame(mcp_err_flags, &host_frames[HOST_FRAME_ERR_IDX]);
-		usb_send((uint8_t *)&host_frames[HOST_FRAME_ERR_IDX], sizeof(gs_host_frame), TRUE);
+		volatile gs_host_frame* hf = host_ring_next(MCP_N_TXBUFFERS);
+		if(hf) {
+			hf->timestamp_us = ts;
+			mcp_to_err_host_frame(mcp_err_flags, mcp_err_counters, hf);
+			host_ring_head++;
+		}
+		if((mcp_err_flags & MCP_EFLG_TXBO) && gs_restart.restart_ms && !bus_off_hold) {
+			mcp_tx_hold();
+			bus_off_hold = TRUE;
+			timer_alarm(gs_restart.restart_ms);
+		}
 	}
-}
-
-void main_loop() {
-main_loop_repeat:
-	if(!gs_can_mode) {
-		return;
+	host_ring_peak();
+	uint16_t d = TCNT1 - start;
+	if(d > gs_stats.isr_max_ticks) {
+		gs_stats.isr_max_ticks = d;
 	}
-	if(mcp_free[mcp_index]) {
-		uint8_t hf_index = mcp_index + HOST_FRAME_IN_IDX;
-		if(usb_receive((uint8_t *)&host_frames[hf_index], sizeof(gs_host_frame))) {
-			mcp_free[mcp_index] = FALSE;
-			mcp_enqueue_can_frame(mcp_index, gs_host_frame_to_mcp(&host_frames[hf_index], mcp_buf_out));
-			mcp_index++;
-			if(mcp_index == MCP_N_TXBUFFERS) {
-				mcp_index = 0;
-			}
+}
 
+/* Loads the due cyclic frames, the ones that find no free transmit buffer
+   go with the next one the MCP interrupt frees */
+ISR(TIMER1_COMPB_vect) {
+	uint8_t n = 0;
+	while(cyclic_due()) {
+		while(n < MCP_N_TXBUFFERS && !mcp_free[n]) {
+			n++;
+		}
+		if(n == MCP_N_TXBUFFERS || bus_off_hold) {
+			cyclic_wait();
+			return;
 		}
+		device_load(n, cyclic_take());
 	}
-	goto main_loop_repeat;
+	cyclic_arm();
 }
 
-/* A separate communication loop for the loopback mode. The main problem it
-   seems is that the MCP looses some incoming CAN frame interrupts when in
-   loopback mode. The fact that there are three transmit buffers, but only two
-   receive ones does not help. So, to make it work the frames are sent with an
-   immediate  wait for acknowledgement using only one buffer, and the received
-   ones are manually polled for (they seem to arrive immediatelly). Yet, when
-   the usb_send is called too quickly after the one that sends back the echo
-   frame, things lock down (not sure at which end). Hence the manual delay that
-   seems to solve the issue. This contraption is acceptable considering
-   loopback mode is typically used for checking devices connectivity only. But
-   note that performance wise (bus speed) this is not optimal. */
-void loopback_main_loop() {
-loopback_main_loop_repeat:
-	if(!gs_can_mode) {
+/* Serves the loopback mode as well: the MCP interrupts come in it like in
+   the normal mode (the level triggered INT6 and taking both receive buffers
+   at once see that none of the looped back frames is missed), and the IN
+   endpoint is only ever written from here, one frame per free bank. The
+   frames from the host are announced by the OUT endpoint interrupt, so with
+   nothing for the host, nothing from it and no buffer to refill the CPU
+   sleeps until the next interrupt, the SOF one comes every 1ms. */
+void main_loop() {
+	host_out_due = FALSE;
+	usb_out_interrupt(TRUE);
+main_loop_repeat:
+	if(gs_can_mode != GS_CAN_MODE_START) {
+		usb_out_interrupt(FALSE);
 		return;
 	}
-	if(usb_receive((uint8_t *)&host_frames[HOST_FRAME_IN_IDX], sizeof(gs_host_frame))) {
-		mcp_enqueue_can_frame(0, gs_host_frame_to_mcp(&host_frames[HOST_FRAME_IN_IDX], mcp_buf_out));
-		if(mcp_send_can_frame(0) == OK) {
-			usb_send((uint8_t *)&host_frames[HOST_FRAME_IN_IDX], sizeof(gs_host_frame), FALSE);
-		}
+	host_ring_send();
+	if(bus_off_hold && timer_alarm_fired) {
+		cli();
+		bus_off_restart();
+		sei();
 	}
-	// TODO Why is this delay necessary?
-	// 0xC0 is not the smallest value that works, but safe
-	uint16_t tc = 0xC0;
-	while(--tc) {
-		asm volatile("nop");
+	if(host_out_due && (uint8_t)(tx_fifo_head - tx_fifo_tail) < TX_FIFO_SIZE) {
+		host_out_take();
+	}
+	// Buffers that were freed while the FIFO was empty (or the ring was
+	// short of room for the echo) are refilled here, one at a time not to
+	// hold off the MCP interrupt for all three loads. A frame held by the
+	// ISO-TP pacing waits for the interrupt that ends the hold.
+	if(tx_refill_due()) {
+		for(uint8_t n=0; n<MCP_N_TXBUFFERS; n++) {
+			cli();
+			if(mcp_free[n]) {
+				tx_load(n);
+			}
+			sei();
+		}
 	}
-	uint8_t r = mcp_receive_can_frame();
-	if(r) {
-		r--;
-		mcp_to_gs_host_frame(mcp_buf_in[r], &host_frames[r]);
-		usb_send((uint8_t *)&host_frames[r], sizeof(gs_host_frame), TRUE);
+	// Checked with interrupts off, the one after SEI always runs before
+	// any interrupt, so that none can slip in between and be slept over.
+	// A full FIFO sleeps too, the MCP interrupt makes room in it.
+	cli();
+	if(gs_can_mode == GS_CAN_MODE_START && host_ring_tail == host_ring_head && !tx_refill_due()
+		&& !(bus_off_hold && timer_alarm_fired)
+		&& !(host_out_due && (uint8_t)(tx_fifo_head - tx_fifo_tail) < TX_FIFO_SIZE)) {
+		sleep_enable();
+		sei();
+		sleep_cpu();
+		sleep_disable();
 	}
-	goto loopback_main_loop_repeat;
+	sei();
+	goto main_loop_repeat;
 }
 
 void main() {
 	sei();
+	timer_init();
+	filter_clear();
 	usb_init(&gs_udc);
 	DDRE &= 0xBF; // MCP interrupt pin
-	EICRB = (EICRB & ~((1<<ISC60) | (1<<ISC61))) | (2 << ISC60);
+	// Low level, not falling edge: a flag that the MCP raises while the
+	// interrupt is being serviced keeps the line low and would otherwise
+	// never be seen
+	EICRB &= ~((1<<ISC60) | (1<<ISC61));
+	set_sleep_mode(SLEEP_MODE_IDLE);
 	POWER_LED_MODE;
 	POWER_LED_ON;
 repeat_main:
-	clear_data();
+	// Off before the ring and the FIFO are cleared, the level triggered
+	// interrupt would fire into them half way
 	EIMSK &= ~(1<<INT6);
+	clear_data();
 	mcp_set_mode_normal();
-	while(!gs_can_mode);
+	while(!gs_can_mode) {
+		if(autobaud.state == GS_AUTOBAUD_RUNNING) {
+			autobaud_run();
+		}
+	}
+	// From here on a restart asked for by gs_usb.c is under way
+	cli();
+	if(gs_can_mode == GS_CAN_MODE_RESTART) {
+		gs_can_mode = GS_CAN_MODE_START;
+	}
+	sei();
+	host_frame_size = (gs_can_mode_flags & GS_CAN_MODE_HW_TIMESTAMP) ? GS_HOST_FRAME_SIZE_TS : GS_HOST_FRAME_SIZE;
 	if(gs_can_mode_flags & GS_CAN_MODE_LOOP_BACK) {
 		mcp_set_mode_loopback();
-	} else {
-		EIMSK |= (1<<INT6);
-		if(gs_can_mode_flags & GS_CAN_MODE_LISTEN_ONLY) {
-			mcp_set_mode_listen();
-		}
+	} else if(gs_can_mode_flags & GS_CAN_MODE_LISTEN_ONLY) {
+		mcp_set_mode_listen();
 	}
 	gs_bittiming_to_mcp(&gs_requested_bittiming, gs_can_mode_flags & GS_CAN_MODE_TRIPLE_SAMPLE, mcp_cnfs);
-	if(mcp_begin(FALSE) == OK && mcp_mode_one_shot(gs_can_mode_flags & GS_CAN_MODE_ONE_SHOT) == OK) {
-		if(gs_can_mode_flags & GS_CAN_MODE_LOOP_BACK) {
-			loopback_main_loop();
-		} else {
-			main_loop();
-		}
+	gs_filter_to_mcp(&gs_requested_filter, mcp_rxf, mcp_rxm);
+	if(mcp_begin(TRUE) == OK && mcp_mode_one_shot(gs_can_mode_flags & GS_CAN_MODE_ONE_SHOT) == OK) {
+		// Kept for the next reset only now that the MCP took it. A changed
+		// set up keeps main here for up to 0.2s, the frames that do not fit
+		// into the receive buffers meanwhile are reported as overflows.
+		gs_usb_boot_save();
+		// Only now, the line may still be low from before the MCP reset
+		// and the interrupt must not cut into the set up over SPI
+		EIMSK |= (1<<INT6);
+		cyclic_start();
+		main_loop();
 	}
 	goto repeat_main;
 }
@@ -37,10 +37,21 @@
 #include "bool.h"
 
 uint8_t mcp_device_mode = MODE_NORMAL;
-uint8_t mcp_buf_in[2][13];
-uint8_t mcp_buf_out[13];
 uint8_t mcp_err_flags;
+// TEC and REC as of the last ERRIF
+uint8_t mcp_err_counters[2];
+// RX0OVR / RX1OVR events seen by mcp_service_interrupt, for GS_USB_BREQ_STATS
+volatile uint32_t mcp_rx_overflows[2];
 uint8_t mcp_cnfs[3];
+// RXF0-RXF5 and RXM0-RXM1 register values, set up with gs_filter_to_mcp
+// before each mcp_begin (writing them over SPI overwrites them)
+uint8_t mcp_rxf[MCP_N_FILTERS][4];
+uint8_t mcp_rxm[MCP_N_MASKS][4];
+
+// Transmit buffers loaded and not yet sent, and the shadow of their TXBnCTRL
+// priority bits, see mcp_enqueue_can_frame
+volatile uint8_t mcp_tx_pending;
+uint8_t mcp_tx_prio[MCP_N_TXBUFFERS];
 
 #define mcp_select()	(PORTB &= 0xFE)
 #define mcp_unselect()	(PORTB |= 0x01)
@@ -77,6 +88,34 @@ void mcp_read_registers_spi(const uint8_t address, uint8_t* values, const uint8_
 	SREG = _sreg;
 }
 
+/* Reads a receive buffer with the READ RX BUFFER instruction, the MCP then
+   clears the RXnIF flag by itself when the chip is unselected, which saves a
+   separate bit modify. The five bytes SIDH to DLC go to head, and only as
+   many data bytes as the DLC says go straight to data, which is where the
+   frame is kept for the host, see mcp_to_gs_host_frame. */
+void mcp_read_rx_buffer_spi(const uint8_t instruction, uint8_t* head, uint8_t* data) {
+	register uint8_t _sreg = SREG;
+	cli();
+	mcp_select();
+	spi_transfer8(instruction);
+	spi_transfer(head, 5);
+	uint8_t n = head[4];
+	// Remote frames carry no data, a standard one is flagged by SRR in SIDL
+	if((head[MCP_SIDL] & MCP_TXB_EXIDE_M) ? (n & MCP_RXB_RTR_M) : (head[MCP_SIDL] & MCP_RXB_SRR_M)) {
+		n = 0;
+	} else {
+		n &= MCP_DLC_MASK;
+		if(n > 8) {
+			n = 8;
+		}
+	}
+	if(n) {
+		spi_transfer(data, n);
+	}
+	mcp_unselect();
+	SREG = _sreg;
+}
+
 void mcp_set_register_spi(const uint8_t address, const uint8_t value) {
 	register uint8_t _sreg = SREG;
 	cli();
@@ -111,6 +150,26 @@ void mcp_modify_register_spi(const uint8_t address, const uint8_t mask, const ui
 	SREG = _sreg;
 }
 
+void mcp_load_tx_buffer_spi(const uint8_t txb_index, const uint8_t* head, const uint8_t* data, const uint8_t n) {
+	register uint8_t _sreg = SREG;
+	cli();
+	mcp_select();
+	spi_transfer8(MCP_LOAD_TX(txb_index));
+	spi_send(head, 5);
+	spi_send(data, n);
+	mcp_unselect();
+	SREG = _sreg;
+}
+
+void mcp_request_to_send_spi(const uint8_t txb_index) {
+	register uint8_t _sreg = SREG;
+	cli();
+	mcp_select();
+	spi_transfer8(MCP_RTS_TX(txb_index));
+	mcp_unselect();
+	SREG = _sreg;
+}
+
 uint8_t mcp_read_status_spi() {
 	register uint8_t _sreg = SREG;
 	cli();
@@ -157,6 +216,10 @@ void mcp_init_buffers() {
 	}
 	mcp_set_register_spi(MCP_RXB0CTRL, 0);
 	mcp_set_register_spi(MCP_RXB1CTRL, 0);
+	mcp_tx_pending = 0;
+	for(uint8_t i=0; i < MCP_N_TXBUFFERS; i++) {
+		mcp_tx_prio[i] = 0;
+	}
 }
 
 uint8_t mcp_init(uint8_t use_rb2) {
@@ -170,15 +233,13 @@ uint8_t mcp_init(uint8_t use_rb2) {
 		return res;
 	}
 	mcp_init_buffers();
-	// See the note in main.c - interrupt based reception does not work well in loopback mode
-	if(mcp_device_mode == MODE_LOOPBACK) {
-		mcp_set_register_spi(MCP_CANINTE, MCP_NO_INT);
-	} else {
-		mcp_set_register_spi(MCP_CANINTE, MCP_RX0IF | MCP_RX1IF | MCP_TX0IF | MCP_TX1IF | MCP_TX2IF | MCP_ERRIF);
-	}
+	mcp_set_registers_spi(MCP_RXF0SIDH, mcp_rxf[0], 12);
+	mcp_set_registers_spi(MCP_RXF3SIDH, mcp_rxf[3], 12);
+	mcp_set_registers_spi(MCP_RXM0SIDH, mcp_rxm[0], 8);
+	mcp_set_register_spi(MCP_CANINTE, MCP_RX0IF | MCP_RX1IF | MCP_TX0IF | MCP_TX1IF | MCP_TX2IF | MCP_ERRIF);
 	if(use_rb2) {
 		mcp_modify_register_spi(MCP_RXB0CTRL, MCP_RXB_RX_MASK | MCP_RXB_BUKT_MASK, MCP_RXB_RX_STDEXT | MCP_RXB_BUKT_MASK);
-		mcp_modify_register_spi(MCP_RXB1CTRL, MCP_RXB_RX_MASK, MCP_RXB_RX_STDEXT);		
+		mcp_modify_register_spi(MCP_RXB1CTRL, MCP_RXB_RX_MASK, MCP_RXB_RX_STDEXT);
 	} else {
 		mcp_modify_register_spi(MCP_RXB0CTRL, MCP_RXB_RX_MASK, MCP_RXB_RX_STDEXT);
 	}
@@ -204,128 +265,183 @@ uint8_t mcp_begin(uint8_t use_rb2) {
 	return mcp_init(use_rb2);
 }
 
-inline void mcp_enqueue_can_frame(uint8_t txbctrl_index, uint8_t len) {
-	uint8_t txctrl = MCP_TXBCTRL(txbctrl_index);
-	mcp_set_registers_spi(txctrl+1, mcp_buf_out, len);
-	uint8_t t_idx = txbctrl_index + 1;
-	if(t_idx == MCP_N_TXBUFFERS) {
-		t_idx = 0;
+void mcp_set_tx_prio(uint8_t txb_index, uint8_t prio) {
+	if(mcp_tx_prio[txb_index] != prio) {
+		mcp_tx_prio[txb_index] = prio;
+		mcp_modify_register_spi(MCP_TXBCTRL(txb_index), MCP_TXB_TXP10_M, prio);
+	}
+}
+
+/* Out of the pending buffers the MCP sends the one with the highest priority
+   first, and on equal priorities the one with the higher number. For the
+   frames to go out in the order they were loaded, a new buffer has to rank
+   below all the pending ones. This returns the highest priority that does it
+   for the given buffer, or a value above MCP_TXB_TXP10_M if there is none. */
+uint8_t mcp_tx_prio_max(uint8_t txb_index) {
+	uint8_t lowest = MCP_N_TXBUFFERS;
+	for(uint8_t i=0; i < MCP_N_TXBUFFERS; i++) {
+		if((mcp_tx_pending & (1 << i)) && (lowest == MCP_N_TXBUFFERS || mcp_tx_prio[i] < mcp_tx_prio[lowest])) {
+			lowest = i;
+		}
 	}
-	mcp_modify_register_spi(MCP_TXBCTRL(t_idx), MCP_TXB_TXP10_M, 2);			// priority 2
-	t_idx++;
-	if(t_idx == MCP_N_TXBUFFERS) {
-		t_idx = 0;
+	if(lowest == MCP_N_TXBUFFERS) {
+		return MCP_TXB_TXP10_M;
 	}
-	mcp_modify_register_spi(MCP_TXBCTRL(t_idx), MCP_TXB_TXP10_M, 1);			// priority 1
-	mcp_modify_register_spi(txctrl, MCP_TXB_TXREQ_M | MCP_TXB_TXP10_M, MCP_TXB_TXREQ_M);	// priority 0
+	uint8_t prio = mcp_tx_prio[lowest];
+	if(txb_index > lowest) {
+		prio--;
+	}
+	return prio;
 }
 
-inline uint8_t mcp_send_can_frame(uint8_t txbctrl_index) {
-	uint16_t time_out = MCP_SEND_TIMEOUT;
-	uint8_t tx_int_mask = (MCP_TX0IF << txbctrl_index);
-	uint8_t res = 0;
-	while(!res && --time_out) {
-		res = (mcp_read_register_spi(MCP_CANINTF) & tx_int_mask);
+/* Loads the frame with LOAD TX BUFFER, the five bytes SIDH to DLC from head
+   and n data bytes from data, and starts it with RTS, 2 SPI bytes and 2 chip
+   selects on top of the frame itself. Neither is touched, the data bytes go
+   out of the frame kept for the echo without a copy. The
+   priority is only touched (one bit modify) when the one the buffer already
+   has would not keep the send order, and the pending buffers are only moved
+   back up when the priority levels run out. With 1, 2 and 3 frames in flight
+   this averages to 0, 0.67 and 1.33 bit modifies per frame, compared to 3 bit
+   modifies and a WRITE address byte before. */
+inline void mcp_enqueue_can_frame(uint8_t txbctrl_index, const uint8_t* head, const uint8_t* data, uint8_t n) {
+	uint8_t prio = mcp_tx_prio_max(txbctrl_index);
+	if(prio > MCP_TXB_TXP10_M) {
+		// Only the other two buffers can be pending, a goes out first
+		uint8_t a = txbctrl_index + 1;
+		if(a == MCP_N_TXBUFFERS) {
+			a = 0;
+		}
+		uint8_t b = a + 1;
+		if(b == MCP_N_TXBUFFERS) {
+			b = 0;
+		}
+		if(!(mcp_tx_pending & (1 << a)) || ((mcp_tx_pending & (1 << b)) &&
+			(mcp_tx_prio[b] > mcp_tx_prio[a] || (mcp_tx_prio[b] == mcp_tx_prio[a] && b > a)))) {
+			uint8_t t = a;
+			a = b;
+			b = t;
+		}
+		mcp_set_tx_prio(a, MCP_TXB_TXP10_M);
+		if(mcp_tx_pending & (1 << b)) {
+			mcp_set_tx_prio(b, b < a ? MCP_TXB_TXP10_M : MCP_TXB_TXP10_M - 1);
+		}
+		prio = mcp_tx_prio_max(txbctrl_index);
+	} else if(mcp_tx_prio[txbctrl_index] < prio) {
+		prio = mcp_tx_prio[txbctrl_index];
 	}
-	if(res) {
-		mcp_modify_register_spi(MCP_CANINTF, tx_int_mask, 0);
-		return OK;
+	mcp_set_tx_prio(txbctrl_index, prio);
+	mcp_load_tx_buffer_spi(txbctrl_index, head, data, n);
+	register uint8_t _sreg = SREG;
+	cli();
+	mcp_tx_pending |= (1 << txbctrl_index);
+	SREG = _sreg;
+	mcp_request_to_send_spi(txbctrl_index);
+}
+
+/* Of the transmit buffers flagged in tx_flags (MCP_TXnIF bits) returns the
+   one that was sent first, i.e. the one that ranked highest when pending. */
+uint8_t mcp_first_sent(uint8_t tx_flags) {
+	uint8_t first = MCP_N_TXBUFFERS;
+	for(uint8_t i=0; i < MCP_N_TXBUFFERS; i++) {
+		if((tx_flags & (MCP_TX0IF << i)) && (first == MCP_N_TXBUFFERS || mcp_tx_prio[i] >= mcp_tx_prio[first])) {
+			first = i;
+		}
 	}
-	return FAIL;
+	return first;
 }
 
+/* Clears the transmit and error flags and returns CANINTF, the receive
+   buffers flagged in it are left for the caller to read, RXB0 first and
+   then mcp_rx_rollover. */
 uint8_t mcp_service_interrupt() {
 	uint8_t canintf_eflag[2];
 	mcp_read_registers_spi(MCP_CANINTF, canintf_eflag, 2);
 	uint8_t res = canintf_eflag[0];
-	if(res & MCP_RX0IF) {
-		mcp_read_registers_spi(MCP_RXBUF_0, mcp_buf_in[0], 13);
-		mcp_modify_register_spi(MCP_CANINTF, MCP_RX0IF, 0);
-	}
-	if(res & MCP_RX1IF) {
-		mcp_read_registers_spi(MCP_RXBUF_1, mcp_buf_in[1], 13);
-		mcp_modify_register_spi(MCP_CANINTF, MCP_RX1IF, 0);
-	}
 	if(res & MCP_TX0IF) {
 		mcp_modify_register_spi(MCP_CANINTF, MCP_TX0IF, 0);
+		mcp_tx_pending &= ~(1 << 0);
 	}
 	if(res & MCP_TX1IF) {
 		mcp_modify_register_spi(MCP_CANINTF, MCP_TX1IF, 0);
+		mcp_tx_pending &= ~(1 << 1);
 	}
 	if(res & MCP_TX2IF) {
 		mcp_modify_register_spi(MCP_CANINTF, MCP_TX2IF, 0);
+		mcp_tx_pending &= ~(1 << 2);
 	}
 	if(res & MCP_ERRIF) {
 		mcp_err_flags = canintf_eflag[1];
+		// TEC and REC sit away from CANINTF / EFLG, they are only fetched
+		// here so that receiving without errors does not pay for them
+		mcp_read_registers_spi(MCP_TEC, mcp_err_counters, 2);
+		// The overflow flags stay set until cleared, and then no further
+		// overflow would raise ERRIF again
+		if(mcp_err_flags & (MCP_EFLG_RX0OVR | MCP_EFLG_RX1OVR)) {
+			if(mcp_err_flags & MCP_EFLG_RX0OVR) {
+				mcp_rx_overflows[0]++;
+			}
+			if(mcp_err_flags & MCP_EFLG_RX1OVR) {
+				mcp_rx_overflows[1]++;
+			}
+			mcp_modify_register_spi(MCP_EFLG, MCP_EFLG_RX0OVR | MCP_EFLG_RX1OVR, 0);
+		}
 		mcp_modify_register_spi(MCP_CANINTF, MCP_ERRIF, 0);
 	}
 	return res;
 }
 
-uint8_t mcp_receive_can_frame() {
-	uint8_t stat = mcp_read_status_spi();
-	if(stat & MCP_STAT_RX0IF) {
-		mcp_read_registers_spi(MCP_RXBUF_0, mcp_buf_in[0], 13);
-		mcp_modify_register_spi(MCP_CANINTF, MCP_RX0IF, 0);
-		return 1;
-	}else if(stat & MCP_STAT_RX1IF) {
-		mcp_read_registers_spi(MCP_RXBUF_1, mcp_buf_in[1], 13);
-		mcp_modify_register_spi(MCP_CANINTF, MCP_RX1IF, 0);
-		return 2;
+/* With rollover RXB1 only fills up while RXB0 is full, so whatever is in
+   RXB1 right after RXB0 was read is older than anything that can land in the
+   just freed RXB0. This holds as long as no frame goes straight into RXB1 by
+   its own filters, which gs_filter_in_order makes sure of. It is taken right away, otherwise the next interrupt could
+   find both buffers full and no way to tell their order. Returns the CANINTF
+   flags with RX1IF added in that case. */
+uint8_t mcp_rx_rollover(uint8_t flags) {
+	if(!(flags & MCP_RX1IF) && (mcp_read_status_spi() & MCP_STAT_RX1IF)) {
+		flags |= MCP_RX1IF;
 	}
-	return 0;
+	return flags;
 }
 
-/* These are currently unused, and the gs_usb driver for Linux itself
-   does not have the HW filter capability. */
-
-void mcp_write_id(const uint8_t mcp_addr, const uint8_t ext, const uint32_t id) {
-	uint16_t canid = (uint16_t)(id & 0xFFFF);
-	uint8_t buf[4];
-
-	if(ext) {
-		buf[MCP_EID0] = (uint8_t) (canid & 0xFF);
-		buf[MCP_EID8] = (uint8_t) (canid >> 8);
-		canid = (uint16_t)(id >> 16);
-		buf[MCP_SIDL] = (uint8_t) (canid & 0x03);
-		buf[MCP_SIDL] += (uint8_t) ((canid & 0x1C) << 3);
-		buf[MCP_SIDL] |= MCP_TXB_EXIDE_M;
-		buf[MCP_SIDH] = (uint8_t) (canid >> 5);
-	} else {
-		buf[MCP_SIDH] = (uint8_t) (canid >> 3);
-		buf[MCP_SIDL] = (uint8_t) ((canid & 0x07) << 5);
-		buf[MCP_EID0] = 0;
-		buf[MCP_EID8] = 0;
-	}
-	mcp_set_registers_spi(mcp_addr, buf, 4);
+/* Reads TEC and REC into counters and returns EFLG, the mode of the MCP is
+   left alone */
+uint8_t mcp_read_error_state(uint8_t* counters) {
+	mcp_read_registers_spi(MCP_TEC, counters, 2);
+	return mcp_read_register_spi(MCP_EFLG);
 }
 
-uint8_t mcp_init_mask(uint8_t num, uint8_t ext, uint32_t data) {
-	uint8_t res = mcp_set_ctrl_mode(MODE_CONFIG);
-	if(res) {
-		return res;
-	}
-	if(num == 0) {
-		mcp_write_id(MCP_RXM0SIDH, ext, data);
-	} else if(num == 1) {
-		mcp_write_id(MCP_RXM1SIDH, ext, data);
+/* For the bit rate detection: returns CANINTF with the receive and message
+   error flags in it cleared, the received frames are not read */
+uint8_t mcp_rx_probe() {
+	uint8_t res = mcp_read_register_spi(MCP_CANINTF);
+	if(res & (MCP_RX0IF | MCP_RX1IF | MCP_MERRF)) {
+		mcp_modify_register_spi(MCP_CANINTF, MCP_RX0IF | MCP_RX1IF | MCP_MERRF, 0);
 	}
-	return mcp_set_ctrl_mode(mcp_device_mode);
+	return res;
 }
 
-uint8_t mcp_init_filt(uint8_t num, uint8_t ext, uint32_t data) {
-	uint8_t res = mcp_set_ctrl_mode(MODE_CONFIG);
-	if(res) {
-		return res;
+/* Bus off recovery: the pending transmissions are stopped (TXREQ cleared,
+   the frames and their priorities stay loaded), and later either started
+   again in the same order or forgotten. mcp_tx_drop returns the buffers
+   that were pending in the MCP_TXnIF bit positions. */
+void mcp_tx_hold() {
+	for(uint8_t n=0; n<MCP_N_TXBUFFERS; n++) {
+		if(mcp_tx_pending & (1 << n)) {
+			mcp_modify_register_spi(MCP_TXBCTRL(n), MCP_TXB_TXREQ_M, 0);
+		}
 	}
-	switch(num) {
-		case 0: mcp_write_id(MCP_RXF0SIDH, ext, data); break;
-		case 1: mcp_write_id(MCP_RXF1SIDH, ext, data); break;
-		case 2: mcp_write_id(MCP_RXF2SIDH, ext, data); break;
-		case 3: mcp_write_id(MCP_RXF3SIDH, ext, data); break;
-		case 4: mcp_write_id(MCP_RXF4SIDH, ext, data); break;
-		case 5: mcp_write_id(MCP_RXF5SIDH, ext, data); break;
-		default: return FAIL;
+}
+
+void mcp_tx_resume() {
+	for(uint8_t n=0; n<MCP_N_TXBUFFERS; n++) {
+		if(mcp_tx_pending & (1 << n)) {
+			mcp_request_to_send_spi(n);
+		}
 	}
-	return mcp_set_ctrl_mode(mcp_device_mode);
+}
+
+uint8_t mcp_tx_drop() {
+	uint8_t p = mcp_tx_pending;
+	mcp_tx_pending = 0;
+	return p << 2;
 }
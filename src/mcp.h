@@ -30,24 +30,47 @@
 #ifndef MCP_H
 #define MCP_H
 
+// The MCP2515 crystal, the Leonardo CAN-BUS board has 16MHz, say for example
+// "make MCP_CLOCK=8000000" for another one. The time quanta are counted in
+// BRP + 1 periods of half of it, so the gs_usb brp is BRP + 1 of CNF1.
+#ifndef MCP_CLOCK
+#define MCP_CLOCK		16000000UL
+#endif
+#define MCP_FCLK_CAN		(MCP_CLOCK / 2)
+
+// Bit timing limits in time quanta: PRSEG and PHSEG1 (tseg1 together) and
+// PHSEG2 are 1 to 8, PHSEG2 at least 2
+#define MCP_SEG_MAX		8
+#define MCP_TSEG1_MIN		2
+#define MCP_TSEG1_MAX		(2 * MCP_SEG_MAX)
+#define MCP_TSEG2_MIN		2
+#define MCP_SJW_MAX		4
+#define MCP_BRP_MAX		64
+
 void mcp_set_mode_normal();
 void mcp_set_mode_loopback();
 void mcp_set_mode_listen();
 uint8_t mcp_mode_one_shot(uint8_t one_shot);
 
 uint8_t mcp_begin(uint8_t use_rb2);
-uint8_t mcp_init_mask(uint8_t num, uint8_t ext, uint32_t data);
-uint8_t mcp_init_filt(uint8_t num, uint8_t ext, uint32_t data);
 
 extern uint8_t mcp_cnfs[];
-extern uint8_t mcp_buf_in[][13];
-extern uint8_t mcp_buf_out[];
+extern uint8_t mcp_rxf[][4];
+extern uint8_t mcp_rxm[][4];
 extern uint8_t mcp_err_flags;
+extern uint8_t mcp_err_counters[2];
+extern volatile uint32_t mcp_rx_overflows[2];
 
-void mcp_enqueue_can_frame(uint8_t txbctrl_index, uint8_t len);
-uint8_t mcp_send_can_frame(uint8_t txbctrl_index);
-uint8_t mcp_receive_can_frame();
+void mcp_read_rx_buffer_spi(const uint8_t instruction, uint8_t* head, uint8_t* data);
+void mcp_enqueue_can_frame(uint8_t txbctrl_index, const uint8_t* head, const uint8_t* data, uint8_t n);
+uint8_t mcp_first_sent(uint8_t tx_flags);
 uint8_t mcp_service_interrupt();
+uint8_t mcp_rx_rollover(uint8_t flags);
+uint8_t mcp_read_error_state(uint8_t* counters);
+uint8_t mcp_rx_probe();
+void mcp_tx_hold();
+void mcp_tx_resume();
+uint8_t mcp_tx_drop();
 
 #define MCP_SIDH		0
 #define MCP_SIDL		1
@@ -77,7 +100,8 @@ uint8_t mcp_service_interrupt();
 
 #define MCP_TXB_RTR_M		0x40
 //#define MCP_RXB_IDE_M		0x08
-#define MCP_RXB_RTR_M		0x40
+#define MCP_RXB_RTR_M		0x40	// In RXBnDLC, only valid for extended frames
+#define MCP_RXB_SRR_M		0x10	// In RXBnSIDL, remote request of a standard frame
 
 #define MCP_STAT_RXIF_MASK	0x03
 #define MCP_STAT_RX0IF		0x01
@@ -140,7 +164,7 @@ uint8_t mcp_service_interrupt();
 #define MCP_TXB0CTRL		0x30
 #define MCP_TXB1CTRL		0x40
 #define MCP_TXB2CTRL		0x50
-#define MCP_TXBCTRL(i)		(MCP_TXB0CTRL + (i << 4))
+#define MCP_TXBCTRL(i)		(MCP_TXB0CTRL + ((i) << 4))
 #define MCP_RXB0CTRL		0x60
 #define MCP_RXB0SIDH		0x61
 #define MCP_RXB1CTRL		0x70
@@ -150,6 +174,8 @@ uint8_t mcp_service_interrupt();
 #define MCP_RX_INT		0x03
 #define MCP_NO_INT		0x00
 
+#define MCP_TX_IF_MASK		0x1C
+
 #define MCP_TX01_MASK		0x14
 #define MCP_TX_MASK		0x54
 
@@ -166,6 +192,8 @@ uint8_t mcp_service_interrupt();
 #define MCP_RTS_TX1		0x82
 #define MCP_RTS_TX2		0x84
 #define MCP_RTS_ALL		0x87
+#define MCP_LOAD_TX(i)		(MCP_LOAD_TX0 + ((i) << 1))
+#define MCP_RTS_TX(i)		(0x80 | (1 << (i)))
 #define MCP_READ_RX0		0x90
 #define MCP_READ_RX1		0x94
 #define MCP_READ_STATUS		0xA0
@@ -216,8 +244,7 @@ uint8_t mcp_service_interrupt();
 #define MCP_MERRF		0x80
 
 #define MCP_N_TXBUFFERS		3
-#define MCP_RXBUF_0		MCP_RXB0SIDH
-#define MCP_RXBUF_1		MCP_RXB1SIDH
-#define MCP_SEND_TIMEOUT	500
+#define MCP_N_FILTERS		6
+#define MCP_N_MASKS		2
 
 #endif
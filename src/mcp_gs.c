@@ -32,17 +32,28 @@
 #include "mcp_gs.h"
 #include "mcp.h"
 #include "can.h"
+#include "bool.h"
 
+/* Only the sum of prop_seg and phase_seg1 decides the sample point, the
+   host may split it in any way (Linux halves it), here each part has to
+   fit into its 3 bits */
 void gs_bittiming_to_mcp(volatile gs_device_bittiming* bittiming, uint8_t triple_sample, uint8_t* cnfs) {
-	cnfs[0] = (((uint8_t)bittiming->sjw - 1) << CNF1_SJW_SHIFT) 
-		| ((uint8_t)bittiming->brp - 1); // FIXME divide (?) brp by 2 if clk is defined to be 16MHz in the config
+	uint8_t prop = bittiming->prop_seg;
+	uint8_t ps1 = bittiming->phase_seg1;
+	if(ps1 > MCP_SEG_MAX) {
+		prop += ps1 - MCP_SEG_MAX;
+		ps1 = MCP_SEG_MAX;
+	} else if(prop > MCP_SEG_MAX) {
+		ps1 += prop - MCP_SEG_MAX;
+		prop = MCP_SEG_MAX;
+	}
+	cnfs[0] = (((uint8_t)bittiming->sjw - 1) << CNF1_SJW_SHIFT) | ((uint8_t)bittiming->brp - 1);
 	cnfs[1] = BTLMODE | (triple_sample ? SAMPLE_3X : SAMPLE_1X);
-	cnfs[1] |= (((uint8_t)bittiming->phase_seg1 - 1) << CNF2_PS1_SHIFT)
-		| ((uint8_t)bittiming->prop_seg - 1);
+	cnfs[1] |= ((ps1 - 1) << CNF2_PS1_SHIFT) | (prop - 1);
 	cnfs[2] = SOF_ENABLE | ((uint8_t)bittiming->phase_seg2 - 1);
 }
 
-void mcp_to_gs_host_frame(uint8_t* buf, volatile gs_host_frame* gs_frame) {
+uint32_t mcp_to_can_id(uint8_t* buf) {
 	uint32_t id = (buf[0]<<3) + (buf[1]>>5);
 	if((buf[1] & MCP_TXB_EXIDE_M) ==  MCP_TXB_EXIDE_M) {
 		id = (id<<2) + (buf[1] & 0x03);
@@ -50,35 +61,36 @@ void mcp_to_gs_host_frame(uint8_t* buf, volatile gs_host_frame* gs_frame) {
 		id = (id<<8) + buf[3];
 		id &= CAN_EFF_MASK;
 		id |= CAN_EFF_FLAG;
+		if(buf[4] & MCP_RXB_RTR_M) {
+			id |= CAN_RTR_FLAG;
+		}
 	} else {
 		id &= CAN_SFF_MASK;
+		if(buf[1] & MCP_RXB_SRR_M) {
+			id |= CAN_RTR_FLAG;
+		}
 	}
-	if(buf[4] & MCP_RXB_RTR_M) {
-		id |= CAN_RTR_FLAG;
-	}
-	buf[4] &= MCP_DLC_MASK;
-	gs_frame->can_id = id;
-	gs_frame->can_dlc = buf[4];
-	for(uint8_t i = 0; i < buf[4]; i++) {
-		gs_frame->data[i] = buf[5+i];
-	}
+	return id;
 }
 
-uint8_t gs_host_frame_to_mcp(volatile gs_host_frame* gs_frame, uint8_t* buf) {
-	uint8_t res = 5;
-	uint8_t can_len = gs_frame->can_dlc /*& MCP_DLC_MASK*/;
-	for(uint8_t i=0; i<can_len; i++) {
-		buf[5+i] = gs_frame->data[i];
-	}
-	res += can_len;
-
-	uint32_t can_id = gs_frame->can_id;
-	if(can_id & CAN_RTR_FLAG) {
-		can_len |= MCP_TXB_RTR_M;
+/* Reads the receive buffer of the READ RX BUFFER instruction into gs_frame,
+   the data bytes come over SPI right into its data, only the id is
+   translated on the way */
+void mcp_to_gs_host_frame(uint8_t instruction, volatile gs_host_frame* gs_frame) {
+	uint8_t head[5];
+	mcp_read_rx_buffer_spi(instruction, head, (uint8_t *)gs_frame->data);
+	// Only up to 8 data bytes are read from the MCP
+	uint8_t dlc = head[4] & MCP_DLC_MASK;
+	if(dlc > 8) {
+		dlc = 8;
 	}
+	gs_frame->can_id = mcp_to_can_id(head);
+	gs_frame->can_dlc = dlc;
+}
 
-	buf[4] = can_len;
-
+/* Converts a SocketCAN id into the four SIDH, SIDL, EID8, EID0 bytes, the same
+   for the transmit buffers and the acceptance filters and masks */
+void can_id_to_mcp(uint32_t can_id, uint8_t* buf) {
 	uint8_t ext_flg = 0;
 	if(can_id & CAN_EFF_FLAG) {
 		ext_flg = 1;
@@ -102,16 +114,89 @@ uint8_t gs_host_frame_to_mcp(volatile gs_host_frame* gs_frame, uint8_t* buf) {
 		buf[3] = 0;
 		buf[2] = 0;
 	}
-	return res;
 }
 
-void mcp_to_err_host_frame(uint8_t mcp_err_flags, volatile gs_host_frame *gs_frame) {
+/* Fills in the five bytes SIDH to DLC of the transmit buffer and returns
+   the number of data bytes, those are loaded from gs_frame as they are */
+uint8_t gs_host_frame_to_mcp_head(volatile gs_host_frame* gs_frame, uint8_t* head) {
+	uint8_t can_len = gs_frame->can_dlc /*& MCP_DLC_MASK*/;
+	uint32_t can_id = gs_frame->can_id;
+	head[4] = can_len;
+	if(can_id & CAN_RTR_FLAG) {
+		head[4] |= MCP_TXB_RTR_M;
+	}
+	can_id_to_mcp(can_id, head);
+	return can_len;
+}
+
+/* The whole transmit buffer, for the frames the device keeps ready to send */
+uint8_t gs_host_frame_to_mcp(volatile gs_host_frame* gs_frame, uint8_t* buf) {
+	uint8_t can_len = gs_host_frame_to_mcp_head(gs_frame, buf);
+	for(uint8_t i=0; i<can_len; i++) {
+		buf[5+i] = gs_frame->data[i];
+	}
+	return 5 + can_len;
+}
+
+/* With the rollover RXB1 has to stay the overflow of RXB0, see
+   mcp_rx_rollover: a frame that filters 2 to 5 pass and filters 0 and 1 do
+   not would go straight into RXB1 and could be read ahead of an older one
+   in RXB0. So mask 0 has to be 0, or each of filters 2 to 5 has to equal
+   filter 0 or 1 on the bits of mask 0 (and be for the same frame format),
+   with mask 1 taking at least those bits. */
+uint8_t gs_filter_in_order(gs_device_filter* filter) {
+	uint8_t m0[4], m1[4], f[3][4];
+	can_id_to_mcp(filter->mask[0], m0);
+	can_id_to_mcp(filter->mask[1], m1);
+	can_id_to_mcp(filter->filter[0], f[0]);
+	can_id_to_mcp(filter->filter[1], f[1]);
+	// The masks have no frame format bit, a filter has
+	m0[1] &= ~MCP_TXB_EXIDE_M;
+	m1[1] &= ~MCP_TXB_EXIDE_M;
+	if(!(m0[0] | m0[1] | m0[2] | m0[3])) {
+		return TRUE;
+	}
+	for(uint8_t i=0; i<4; i++) {
+		if(m0[i] & ~m1[i]) {
+			return FALSE;
+		}
+	}
+	m0[1] |= MCP_TXB_EXIDE_M;
+	for(uint8_t k=2; k<MCP_N_FILTERS; k++) {
+		can_id_to_mcp(filter->filter[k], f[2]);
+		uint8_t covered = 0;
+		for(uint8_t j=0; j<2; j++) {
+			uint8_t d = 0;
+			for(uint8_t i=0; i<4; i++) {
+				d |= (f[2][i] ^ f[j][i]) & m0[i];
+			}
+			covered |= !d;
+		}
+		if(!covered) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+void gs_filter_to_mcp(volatile gs_device_filter* filter, uint8_t (*rxf)[4], uint8_t (*rxm)[4]) {
+	for(uint8_t i=0; i<MCP_N_FILTERS; i++) {
+		can_id_to_mcp(filter->filter[i], rxf[i]);
+	}
+	for(uint8_t i=0; i<MCP_N_MASKS; i++) {
+		can_id_to_mcp(filter->mask[i], rxm[i]);
+	}
+}
+
+void mcp_to_err_host_frame(uint8_t mcp_err_flags, uint8_t* mcp_err_counters, volatile gs_host_frame *gs_frame) {
 	gs_frame->can_dlc = 8;
 	gs_frame->flags = 0;
 	for(uint8_t i=0; i<8; i++) {
 		gs_frame->data[i] = 0;
 	}
-	gs_frame->can_id = CAN_ERR_FLAG;
+	gs_frame->can_id = CAN_ERR_FLAG | CAN_ERR_CNT;
+	gs_frame->data[6] = mcp_err_counters[0];
+	gs_frame->data[7] = mcp_err_counters[1];
 	if(mcp_err_flags & MCP_EFLG_TXBO) {
 		gs_frame->can_id |= CAN_ERR_BUSOFF;
 	} else {
@@ -134,3 +219,14 @@ void mcp_to_err_host_frame(uint8_t mcp_err_flags, volatile gs_host_frame *gs_fra
 		}
 	}
 }
+
+uint32_t mcp_to_gs_state(uint8_t mcp_err_flags) {
+	if(mcp_err_flags & MCP_EFLG_TXBO) {
+		return GS_CAN_STATE_BUS_OFF;
+	} else if(mcp_err_flags & (MCP_EFLG_TXEP | MCP_EFLG_RXEP)) {
+		return GS_CAN_STATE_ERROR_PASSIVE;
+	} else if(mcp_err_flags & MCP_EFLG_EWARN) {
+		return GS_CAN_STATE_ERROR_WARNING;
+	}
+	return GS_CAN_STATE_ERROR_ACTIVE;
+}
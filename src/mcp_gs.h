@@ -34,8 +34,13 @@
 #include "gs_usb.h"
 
 void gs_bittiming_to_mcp(volatile gs_device_bittiming* bittiming, uint8_t triple_sample, uint8_t* cnfs);
-void mcp_to_gs_host_frame(uint8_t* buf, volatile gs_host_frame* gs_frame);
+uint32_t mcp_to_can_id(uint8_t* buf);
+void mcp_to_gs_host_frame(uint8_t instruction, volatile gs_host_frame* gs_frame);
+uint8_t gs_host_frame_to_mcp_head(volatile gs_host_frame* gs_frame, uint8_t* head);
 uint8_t gs_host_frame_to_mcp(volatile gs_host_frame* gs_frame, uint8_t* buf);
-void mcp_to_err_host_frame(uint8_t mcp_err_flags, volatile gs_host_frame *gs_frame);
+uint8_t gs_filter_in_order(gs_device_filter* filter);
+void gs_filter_to_mcp(volatile gs_device_filter* filter, uint8_t (*rxf)[4], uint8_t (*rxm)[4]);
+void mcp_to_err_host_frame(uint8_t mcp_err_flags, uint8_t* mcp_err_counters, volatile gs_host_frame *gs_frame);
+uint32_t mcp_to_gs_state(uint8_t mcp_err_flags);
 
 #endif
@@ -38,6 +38,7 @@
 void spi_init();
 uint8_t spi_transfer8(uint8_t data);
 void spi_transfer(uint8_t *buf, uint8_t count);
+void spi_send(const uint8_t *buf, uint8_t count);
 
 #endif
 
@@ -0,0 +1,131 @@
+/*
+
+  This file is part of gs_usb_leonardo project --
+  gs_usb compatible SocketCAN firmware for Arduino Leonardo /
+  MCP2515 based USB device, see
+
+          https://github.com/woj76/gs_usb_leonardo
+
+  For information about how this code came to be and what / whose
+  work it is based on, please see the LICENSE.md file in the project
+  root directory.
+
+  Copyright (C) 2019 Wojciech Mostowski <wojciech.mostowski@gmail.com>
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the License, or any later
+  version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  The copy of the license can be found in the licenses directory of
+  the project, or on GNU/FSF website at https://www.gnu.org/licenses/.
+
+*/
+
+/* The free running microsecond time base. Timer1 counts in 0.5us ticks
+   (16MHz clock divided by 8) and its overflow interrupt (every 32.768ms)
+   extends it to 32 bits worth of microseconds. The compare A interrupt
+   counts down the milliseconds of a single alarm. Compare B and C wake the
+   firmware at a given time with timer_wake, B for the cyclic transmissions
+   (cyclic.c) and C for the ISO-TP pacing (isotp.c), their interrupt routines
+   are kept there. */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "timer.h"
+#include "bool.h"
+
+#define TIMER_TICKS_MS		2000
+
+// Wake ups closer than this are moved this far, the compare register could
+// otherwise be passed before it is set and fire only a wrap later
+#define TIMER_SOON_US		8
+
+volatile uint32_t timer_overflows;
+volatile uint16_t timer_alarm_left;
+volatile uint8_t timer_alarm_fired;
+
+void timer_init() {
+	register uint8_t _sreg = SREG;
+	cli();
+	timer_overflows = 0;
+	TCCR1A = 0;
+	TCCR1B = (1 << CS11);
+	TCNT1 = 0;
+	TIFR1 = (1 << TOV1);
+	TIMSK1 = (1 << TOIE1);
+	SREG = _sreg;
+}
+
+ISR(TIMER1_OVF_vect) {
+	timer_overflows++;
+}
+
+/* Sets timer_alarm_fired after ms (at least 1) milliseconds, replacing an
+   alarm that is still running */
+void timer_alarm(uint16_t ms) {
+	register uint8_t _sreg = SREG;
+	cli();
+	timer_alarm_left = ms ? ms : 1;
+	timer_alarm_fired = FALSE;
+	OCR1A = TCNT1 + TIMER_TICKS_MS;
+	TIFR1 = (1 << OCF1A);
+	TIMSK1 |= (1 << OCIE1A);
+	SREG = _sreg;
+}
+
+void timer_alarm_cancel() {
+	register uint8_t _sreg = SREG;
+	cli();
+	TIMSK1 &= ~(1 << OCIE1A);
+	timer_alarm_fired = FALSE;
+	SREG = _sreg;
+}
+
+ISR(TIMER1_COMPA_vect) {
+	if(--timer_alarm_left) {
+		OCR1A += TIMER_TICKS_MS;
+	} else {
+		TIMSK1 &= ~(1 << OCIE1A);
+		timer_alarm_fired = TRUE;
+	}
+}
+
+/* Points the compare interrupt of channel (TIMER_WAKE_B or TIMER_WAKE_C)
+   at the timer_now time at. One more than 32ms off fires on the way, once
+   the counter gets to its low 16 bits. Needs to run with interrupts
+   disabled. */
+void timer_wake(uint8_t channel, uint32_t at) {
+	uint16_t ocr = (uint16_t)(at << 1);
+	if((int32_t)(at - timer_now()) < TIMER_SOON_US) {
+		ocr = TCNT1 + 2 * TIMER_SOON_US;
+	}
+	if(channel == TIMER_WAKE_B) {
+		OCR1B = ocr;
+	} else {
+		OCR1C = ocr;
+	}
+	TIFR1 = (1 << channel);
+	TIMSK1 |= (1 << channel);
+}
+
+/* Microseconds since timer_init, wraps around after 2^32us (~71 minutes)
+   like the gs_usb host side expects. */
+uint32_t timer_now() {
+	register uint8_t _sreg = SREG;
+	cli();
+	uint16_t t = TCNT1;
+	uint32_t o = timer_overflows;
+	// An overflow that happened since interrupts went off is still pending
+	if((TIFR1 & (1 << TOV1)) && t < 0x8000) {
+		o++;
+	}
+	SREG = _sreg;
+	return (o << 15) | (t >> 1);
+}
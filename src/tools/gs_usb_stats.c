@@ -0,0 +1,252 @@
+/*
+
+  This file is part of gs_usb_leonardo project --
+  gs_usb compatible SocketCAN firmware for Arduino Leonardo /
+  MCP2515 based USB device, see
+
+          https://github.com/woj76/gs_usb_leonardo
+
+  For information about how this code came to be and what / whose
+  work it is based on, please see the LICENSE.md file in the project
+  root directory.
+
+  Copyright (C) 2019 Wojciech Mostowski <wojciech.mostowski@gmail.com>
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; version 2 of the License, or any later
+  version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  The copy of the license can be found in the licenses directory of
+  the project, or on GNU/FSF website at https://www.gnu.org/licenses/.
+
+*/
+
+/* Linux tool that polls the counters of the device (GS_USB_BREQ_STATS) and
+   prints them with the rates since the previous poll, or the bus load and
+   the busiest ids (GS_USB_BREQ_BUS_STATS). It talks to the device
+   through usbfs, vendor control requests go through while the gs_usb driver
+   has the interface, so it can run next to candump and friends. Build with
+   "make tools" in the src directory, run as root or with write access to
+   the /dev/bus/usb node of the device:
+
+     tools/gs_usb_stats [-c | -b | -B] [interval_ms]
+
+   -c clears the counters with every poll, -b turns the bus statistics on
+   and prints them instead, -B as well but without the received frames
+   going to the host (until the next -b or a reset of the device). The
+   interval defaults to 1000. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
+
+#include "gs_usb.h"
+#include "can.h"
+
+static unsigned read_hex(const char* dir, const char* name) {
+	char path[512];
+	unsigned v = 0;
+	snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/%s", dir, name);
+	FILE* f = fopen(path, "r");
+	if(f) {
+		if(fscanf(f, "%x", &v) != 1) {
+			v = 0;
+		}
+		fclose(f);
+	}
+	return v;
+}
+
+static unsigned read_dec(const char* dir, const char* name) {
+	char path[512];
+	unsigned v = 0;
+	snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/%s", dir, name);
+	FILE* f = fopen(path, "r");
+	if(f) {
+		if(fscanf(f, "%u", &v) != 1) {
+			v = 0;
+		}
+		fclose(f);
+	}
+	return v;
+}
+
+/* Opens the first device with the candleLight ids the firmware uses */
+static int open_device() {
+	DIR* d = opendir("/sys/bus/usb/devices");
+	if(!d) {
+		perror("/sys/bus/usb/devices");
+		return -1;
+	}
+	struct dirent* e;
+	int fd = -1;
+	while(fd < 0 && (e = readdir(d))) {
+		if(e->d_name[0] == '.' || strchr(e->d_name, ':')) {
+			continue;
+		}
+		if(read_hex(e->d_name, "idVendor") != USB_CANDLELIGHT_VENDOR_ID || read_hex(e->d_name, "idProduct") != USB_CANDLELIGHT_PRODUCT_ID) {
+			continue;
+		}
+		char node[64];
+		snprintf(node, sizeof(node), "/dev/bus/usb/%03u/%03u", read_dec(e->d_name, "busnum"), read_dec(e->d_name, "devnum"));
+		fd = open(node, O_RDWR);
+		if(fd < 0) {
+			perror(node);
+		}
+	}
+	closedir(d);
+	return fd;
+}
+
+static int read_stats(int fd, uint16_t value, gs_device_stats* st) {
+	struct usbdevfs_ctrltransfer ct = {
+		.bRequestType = 0xC1, // Device to host, vendor, interface
+		.bRequest = GS_USB_BREQ_STATS,
+		.wValue = value,
+		.wIndex = GS_USB_INTERFACE,
+		.wLength = sizeof(gs_device_stats),
+		.timeout = 1000,
+		.data = st
+	};
+	return ioctl(fd, USBDEVFS_CONTROL, &ct) == sizeof(gs_device_stats);
+}
+
+static int set_bus_stats(int fd, uint16_t mode) {
+	struct usbdevfs_ctrltransfer ct = {
+		.bRequestType = 0x41, // Host to device, vendor, interface
+		.bRequest = GS_USB_BREQ_BUS_STATS,
+		.wValue = mode,
+		.wIndex = GS_USB_INTERFACE,
+		.wLength = 0,
+		.timeout = 1000,
+		.data = 0
+	};
+	return ioctl(fd, USBDEVFS_CONTROL, &ct) == 0;
+}
+
+static int read_bus_stats(int fd, gs_device_bus_stats* st) {
+	struct usbdevfs_ctrltransfer ct = {
+		.bRequestType = 0xC1,
+		.bRequest = GS_USB_BREQ_BUS_STATS,
+		.wValue = GS_STATS_READ_CLEAR,
+		.wIndex = GS_USB_INTERFACE,
+		.wLength = sizeof(gs_device_bus_stats),
+		.timeout = 1000,
+		.data = st
+	};
+	return ioctl(fd, USBDEVFS_CONTROL, &ct) == sizeof(gs_device_bus_stats);
+}
+
+#define BUSIEST_IDS	5
+
+/* Every interval the load, the frame rate, and the rates of the busiest
+   ids, the statistics are cleared with every read */
+static int poll_bus_stats(int fd, uint16_t mode, unsigned interval_ms) {
+	gs_device_bus_stats st;
+	if(!set_bus_stats(fd, mode)) {
+		perror("GS_USB_BREQ_BUS_STATS");
+		return 1;
+	}
+	printf("%8s %10s %10s  %s\n", "load", "frames/s", "untracked", "busiest ids, frames/s");
+	for(;;) {
+		usleep(interval_ms * 1000);
+		if(!read_bus_stats(fd, &st)) {
+			perror("GS_USB_BREQ_BUS_STATS");
+			return 1;
+		}
+		double s = st.interval_us / 1000000.0;
+		printf("%7.2f%% %10.0f %10u ", st.load / 100.0, st.frames / s, st.untracked);
+		for(int n=0; n<BUSIEST_IDS; n++) {
+			int m = -1;
+			for(int i=0; i<GS_BUS_STATS_IDS; i++) {
+				if(st.count[i] && (m < 0 || st.count[i] > st.count[m])) {
+					m = i;
+				}
+			}
+			if(m < 0) {
+				break;
+			}
+			if(st.can_id[m] & CAN_EFF_FLAG) {
+				printf(" %08X:%.0f", st.can_id[m] & CAN_EFF_MASK, st.count[m] / s);
+			} else {
+				printf(" %03X:%.0f", st.can_id[m], st.count[m] / s);
+			}
+			st.count[m] = 0;
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+}
+
+int main(int argc, char** argv) {
+	uint16_t value = GS_STATS_READ;
+	int bus_mode = -1;
+	unsigned interval_ms = 1000;
+	for(int i=1; i<argc; i++) {
+		if(!strcmp(argv[i], "-c")) {
+			value = GS_STATS_READ_CLEAR;
+		} else if(!strcmp(argv[i], "-b")) {
+			bus_mode = GS_BUS_STATS_ON;
+		} else if(!strcmp(argv[i], "-B")) {
+			bus_mode = GS_BUS_STATS_ONLY;
+		} else if(atoi(argv[i]) > 0) {
+			interval_ms = atoi(argv[i]);
+		} else {
+			fprintf(stderr, "Usage: %s [-c | -b | -B] [interval_ms]\n", argv[0]);
+			return 1;
+		}
+	}
+	int fd = open_device();
+	if(fd < 0) {
+		fprintf(stderr, "No gs_usb_leonardo device found\n");
+		return 1;
+	}
+	if(bus_mode >= 0) {
+		return poll_bus_stats(fd, bus_mode, interval_ms);
+	}
+	gs_device_stats prev, st;
+	if(!read_stats(fd, value, &prev)) {
+		perror("GS_USB_BREQ_STATS");
+		return 1;
+	}
+	if(value == GS_STATS_READ_CLEAR) {
+		memset(&prev, 0, sizeof(prev));
+	}
+	double s = interval_ms / 1000.0;
+	printf("%10s %10s %10s %10s %8s %8s %8s %8s %8s\n",
+		"rx/s", "tx/s", "echo/s", "dropped", "rx0ovr", "rx1ovr", "fifo", "isr_us", "ring");
+	for(;;) {
+		usleep(interval_ms * 1000);
+		if(!read_stats(fd, value, &st)) {
+			perror("GS_USB_BREQ_STATS");
+			return 1;
+		}
+		// Unsigned differences, so a counter wrapping around is fine
+		printf("%10.0f %10.0f %10.0f %10u %8u %8u %8u %8.1f %8u\n",
+			(uint32_t)(st.rx_frames - prev.rx_frames) / s,
+			(uint32_t)(st.tx_frames - prev.tx_frames) / s,
+			(uint32_t)(st.echo_frames - prev.echo_frames) / s,
+			st.rx_dropped - prev.rx_dropped,
+			st.rx_overflows[0] - prev.rx_overflows[0],
+			st.rx_overflows[1] - prev.rx_overflows[1],
+			st.tx_fifo_full - prev.tx_fifo_full,
+			st.isr_max_ticks / 2.0,
+			st.host_ring_peak);
+		fflush(stdout);
+		if(value == GS_STATS_READ) {
+			prev = st;
+		}
+	}
+}
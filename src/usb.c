@@ -50,6 +50,13 @@ uint16_t sent_control = 0;
 volatile uint8_t write_blinks = 0;
 volatile uint8_t read_blinks = 0;
 
+#ifdef USB_IN_BATCH
+// TRUE when the current IN bank holds frames that are not yet released to
+// the host, and the number of SOFs that passed since the first one went in
+volatile uint8_t usb_in_batched = FALSE;
+uint8_t usb_in_age;
+#endif
+
 inline uint8_t usb_receive(uint8_t *ptr, uint8_t len) {
 	uint8_t r = TRUE;
 	register uint8_t _sreg = SREG;
@@ -66,40 +73,79 @@ inline uint8_t usb_receive(uint8_t *ptr, uint8_t len) {
 		write_blinks = NUM_BLINKS;
 	} else {
 		r = FALSE;
+		if(UEINTX & (1<<RXOUTI)) {
+			// A zero length packet, released unread or the endpoint
+			// interrupt would be raised again right away
+			UEINTX = ~(1<<RXOUTI);
+			UEINTX &= ~(1 << FIFOCON);
+		}
 	}
 	SREG = _sreg;
 	return r;
 }
 
-inline void usb_send(uint8_t* ptr, uint8_t len, uint8_t blink) {
+inline uint8_t usb_send(uint8_t* ptr, uint8_t len, uint8_t blink) {
 //	if (usb_suspended) {
 //		UDCON |= (1 << RMWKUP);
 //	}
-	uint16_t time_out = 0xFFFF;
 	register uint8_t _sreg = SREG;
 	cli();
 	UENUM = udc->usb_endpoint_in;
-	// It seems that because of the double USB buffer in the gs_usb scenario
-	// this check always immediatelly goes through, thus the time out check does
-	// not cost extra cycles, yet it is useful to handle disconnected cable and
-	// similar situations.
-	while(!(UEINTX & (1<<RWAL))) { // alternatively !(UEINTX & (1<<TXINI))
-		if(!time_out--) {
-			SREG = _sreg;
-			return;
-		}
+	// A single non-blocking attempt, with no free bank (the host not reading,
+	// a disconnected cable) the caller simply retries later
+	if(!(UEINTX & (1<<RWAL))) { // alternatively !(UEINTX & (1<<TXINI))
+		SREG = _sreg;
+		return FALSE;
+	}
+#ifdef USB_IN_BATCH
+	// Frames are appended to the current bank, which is only released when
+	// the next frame would not fit anymore or by the SOF interrupt below
+	if(!usb_in_batched) {
+		UEINTX = ~(1<<TXINI);
+		usb_in_batched = TRUE;
+		usb_in_age = 0;
 	}
+	uint8_t n = len;
+	while (n--) {
+		UEDATX = *ptr++;
+	}
+	if(USB_EP_SIZE - UEBCLX < len) {
+		UEINTX &= ~(1 << FIFOCON);
+		usb_in_batched = FALSE;
+	}
+#else
 	UEINTX = ~(1<<TXINI);
 	while (len--) {
 		UEDATX = *ptr++;
 	}
 	UEINTX &= ~(1 << FIFOCON);
+#endif
 	SREG = _sreg;
 	// We blink selectively for gs_usb, that is only for the actual CAN received or error
 	// frames and not for the echo / confirmation ones
 	if(blink) {
 		read_blinks = NUM_BLINKS;
 	}
+	return TRUE;
+}
+
+/* Turns the RXOUTI interrupt of the OUT endpoint on or off. While on, the
+   USB_COM routine calls udc->usb_out_func as long as a packet waits there,
+   the function takes it with usb_receive or turns the interrupt off, the
+   packets then wait in the endpoint (NAKed to the host) until it is on
+   again. */
+void usb_out_interrupt(uint8_t on) {
+	register uint8_t _sreg = SREG;
+	cli();
+	uint8_t ue = UENUM;
+	UENUM = udc->usb_endpoint_out;
+	if(on) {
+		UEIENX |= (1<<RXOUTE);
+	} else {
+		UEIENX &= ~(1<<RXOUTE);
+	}
+	UENUM = ue;
+	SREG = _sreg;
 }
 
 inline void init_endpoint(uint8_t index, uint8_t type, uint8_t size) {
@@ -132,6 +178,16 @@ uint8_t usb_send_control(const void* d, uint8_t len) {
 	return TRUE;
 }
 
+uint8_t usb_send_control_ram(const void* d, uint8_t len) {
+	const uint8_t* ptr = (const uint8_t*)d;
+	while (len--) {
+		if (!usb_send_control8(*ptr++)) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
 uint8_t usb_send_string(const uint8_t* d, uint8_t len) {
 	uint8_t r = usb_send_control8(2 + len*2);
 	r &= usb_send_control8(USB_STRING_DESCRIPTOR_TYPE);
@@ -142,6 +198,16 @@ uint8_t usb_send_string(const uint8_t* d, uint8_t len) {
 	return r;
 }
 
+uint8_t usb_send_string_ram(const uint8_t* d, uint8_t len) {
+	uint8_t r = usb_send_control8(2 + len*2);
+	r &= usb_send_control8(USB_STRING_DESCRIPTOR_TYPE);
+	for(uint8_t i = 0; i < len; i++) {
+		r &= usb_send_control8(*d++);
+		r &= usb_send_control8(0);
+	}
+	return r;
+}
+
 void usb_receive_control(void* d, uint8_t len) {
 	while (!(UEINTX & (1<<RXOUTI)));
         uint8_t* ptr = (uint8_t*)d;
@@ -179,7 +245,7 @@ void usb_init(usb_device_configuration* device_configuration) {
 	UDCON &= ~(1<<DETACH);
 }
 
-ISR(USB_COM_vect) {
+void usb_control() {
 	UENUM = 0;
 	if (!(UEINTX & (1<<RXSTPI))) {
 		return;
@@ -255,6 +321,16 @@ ISR(USB_COM_vect) {
 	}
 }
 
+ISR(USB_COM_vect) {
+	// The interrupted code may be working on an endpoint of its own
+	uint8_t ue = UENUM;
+	if (UEINT & (1 << udc->usb_endpoint_out)) {
+		(*udc->usb_out_func)();
+	}
+	usb_control();
+	UENUM = ue;
+}
+
 // Some references for using the VBUS state bit, none of this seemed to work as expected though, neither 
 // the supspending and clock on-off switching suggested in the ATMega 32U4 docs. Another way of checking
 // for active USB connection is checking UDFNUML as in the newer USBCore.cpp implementation (frame counting),
@@ -306,12 +382,25 @@ ISR(USB_GEN_vect) {
 		UDINT &= ~(1<<EORSTI);
 		init_endpoint(0, EP_TYPE_CONTROL, EP_SINGLE_64);
 		(*udc->usb_init_func)();
+#ifdef USB_IN_BATCH
+		usb_in_batched = FALSE;
+#endif
 		//usb_configuration = 0;
 		UEIENX = (1 << RXSTPE);
 	}
-	// Start of frame every 1ms - utilise for LED flashing
+	// Start of frame every 1ms - utilise for LED flashing and for releasing
+	// the partially filled IN bank when batching
 	if (UDINT & (1<<SOFI)) {
 		UDINT &= ~(1<<SOFI);
+#ifdef USB_IN_BATCH
+		if(usb_in_batched && ++usb_in_age >= USB_IN_BATCH_SOFS) {
+			uint8_t ue = UENUM;
+			UENUM = udc->usb_endpoint_in;
+			UEINTX &= ~(1 << FIFOCON);
+			UENUM = ue;
+			usb_in_batched = FALSE;
+		}
+#endif
 		if(write_blinks) {
 			if(!write_blink_counter) {
 				write_blinks--;
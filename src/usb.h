@@ -112,6 +112,11 @@
 #define EP_SINGLE_64		0x32
 #define EP_DOUBLE_64		0x36
 
+// With USB_IN_BATCH defined (see the Makefile) frames sent with usb_send are
+// packed into one IN bank until the next one would not fit (three 20 byte
+// gs_host_frames for a 64 byte bank) or this many SOFs (1ms each) passed.
+#define USB_IN_BATCH_SOFS	1
+
 #define EP_TYPE_CONTROL		(0x00)
 #define EP_TYPE_BULK_IN		((1<<EPTYPE1) | (1<<EPDIR))
 #define EP_TYPE_BULK_OUT	(1<<EPTYPE1)
@@ -182,6 +187,7 @@ typedef struct {
 	void (*usb_init_func)();
 	uint8_t (*usb_descriptor_func)(usb_setup* setup);
 	uint8_t (*usb_setup_func)(usb_setup* setup);
+	void (*usb_out_func)();		// Called for the packets on the OUT endpoint, see usb_out_interrupt
 	uint8_t usb_interface_num;
 	uint8_t usb_endpoint_in;
 	uint8_t usb_endpoint_out;
@@ -189,9 +195,12 @@ typedef struct {
 
 void usb_init(usb_device_configuration* device_configuration);
 uint8_t usb_send_control(const void* d, uint8_t len);
+uint8_t usb_send_control_ram(const void* d, uint8_t len);
 uint8_t usb_send_string(const uint8_t* d, uint8_t len);
+uint8_t usb_send_string_ram(const uint8_t* d, uint8_t len);
 void usb_receive_control(void* d, uint8_t len);
-void usb_send(uint8_t* ptr, uint8_t len, uint8_t blink);
+uint8_t usb_send(uint8_t* ptr, uint8_t len, uint8_t blink);
 uint8_t usb_receive(uint8_t* ptr, uint8_t len);
+void usb_out_interrupt(uint8_t on);
 
 #endif